@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cwctype>
+#include <string>
+#include <vector>
+
+#include "Blacklist.h"
+
+namespace
+{
+    std::wstring Upcase(std::wstring path)
+    {
+        std::transform(path.begin(), path.end(), path.begin(), [](wchar_t c) { return static_cast<wchar_t>(std::towupper(c)); });
+        return (path);
+    }
+
+    std::wstring DeviceInstancePath(size_t index)
+    {
+        return L"HID\\VID_054C&PID_09CC&MI_03\\7&1c2f3b9a&0&" + std::to_wstring(index);
+    }
+
+    // Blacklist compiled into indexed records, the way the driver compiles the multi-string property
+    class IndexedBlacklist
+    {
+    public:
+        explicit IndexedBlacklist(const std::vector<std::wstring>& entries)
+        {
+            // Size the buckets the way the driver does, keeping the load factor below one half
+            ULONG bucketCount = 8;
+            while ((bucketCount / 2) < entries.size()) bucketCount <<= 1;
+            m_buckets.resize(bucketCount);
+            BlacklistIndexInitialize(&m_index, m_buckets.data(), bucketCount);
+
+            m_paths.reserve(entries.size());
+            m_records.reserve(entries.size());
+            for (const auto& entry : entries)
+            {
+                ULONG length;
+                ULONG jailSessionId;
+                BlacklistSplit(entry.c_str(), static_cast<ULONG>(entry.size()), &length, &jailSessionId);
+                m_paths.push_back(Upcase(entry.substr(0, length)));
+                const auto& path = m_paths.back();
+                const auto hash = BlacklistHash(path.c_str(), length);
+                if (nullptr != BlacklistIndexFind(&m_index, hash, path.c_str(), length)) continue;
+                m_records.push_back(BLACKLIST_RECORD{ nullptr, path.c_str(), length, hash, jailSessionId });
+                BlacklistIndexInsert(&m_index, &m_records.back());
+            }
+        }
+
+        PBLACKLIST_RECORD Find(const std::wstring& upcaseDeviceInstancePath, ULONG hash)
+        {
+            return (BlacklistIndexFind(&m_index, hash, upcaseDeviceInstancePath.c_str(), static_cast<ULONG>(upcaseDeviceInstancePath.size())));
+        }
+
+        std::vector<BLACKLIST_RECORD>  m_records;
+
+    private:
+        std::vector<std::wstring>      m_paths;
+        std::vector<PBLACKLIST_RECORD> m_buckets;
+        BLACKLIST_INDEX                m_index{};
+    };
+
+    // The lookup as done before compiling, splitting every entry and comparing it case-insensitive on each call
+    bool ParsedBlacklisted(const std::vector<std::wstring>& entries, const std::wstring& deviceInstancePath, ULONG* jailSessionId)
+    {
+        for (const auto& entry : entries)
+        {
+            const auto delimiter = entry.find(BLACKLIST_DELIMITER);
+            const auto length = (((std::wstring::npos == delimiter) || (0 == delimiter)) ? entry.size() : delimiter);
+            *jailSessionId = ((length == entry.size()) ? 0 : static_cast<ULONG>(std::wcstoul(entry.c_str() + length + 1, nullptr, 10)));
+            if ((length == deviceInstancePath.size()) && std::equal(deviceInstancePath.begin(), deviceInstancePath.end(), entry.begin(), [](wchar_t a, wchar_t b) { return (std::towupper(a) == std::towupper(b)); })) return (true);
+        }
+        *jailSessionId = 0;
+        return (false);
+    }
+}
+
+TEST(BlacklistBenchmark, CompiledVersusParsedLookup)
+{
+    for (const size_t entries : { size_t{ 10 }, size_t{ 100 }, size_t{ 1000 } })
+    {
+        // Keep the number of entries visited about the same for each blacklist size
+        const size_t lookups = (200000 / entries);
+        std::vector<std::wstring> blacklist;
+        for (size_t index = 0; index < entries; ++index) blacklist.push_back(DeviceInstancePath(index) + ((0 == (index % 2)) ? L"!1" : L""));
+        IndexedBlacklist compiled(blacklist);
+
+        // Alternate between the last entry (the worst case hit for the parsed lookup) and a device not on the blacklist
+        const std::vector<std::wstring> devices{ DeviceInstancePath(entries - 1), L"HID\\VID_045E&PID_028E\\7&2A1B4C&0&0000" };
+        std::vector<std::wstring> upcaseDevices;
+        std::vector<ULONG> hashes;
+        for (const auto& device : devices)
+        {
+            upcaseDevices.push_back(Upcase(device));
+            hashes.push_back(BlacklistHash(upcaseDevices.back().c_str(), static_cast<ULONG>(upcaseDevices.back().size())));
+        }
+
+        size_t parsedHits = 0;
+        ULONG jailSessionId;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i) parsedHits += ParsedBlacklisted(blacklist, devices[i % devices.size()], &jailSessionId) ? 1 : 0;
+        const auto parsedElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+        size_t compiledHits = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i) compiledHits += (nullptr != compiled.Find(upcaseDevices[i % devices.size()], hashes[i % devices.size()])) ? 1 : 0;
+        const auto compiledElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+        EXPECT_EQ(parsedHits, compiledHits);
+        std::printf("[ Blacklist ] %zu entries: parsed %lld ns per lookup; compiled %lld ns per lookup\n",
+            entries, static_cast<long long>(parsedElapsed.count() / lookups), static_cast<long long>(compiledElapsed.count() / lookups));
+    }
+}
+
+TEST(BlacklistBenchmark, IndexedVersusLinearLookupCrossover)
+{
+    size_t crossover = 0;
+    for (size_t entries = 1; entries <= 1024; entries <<= 1)
+    {
+        // Keep the number of entries visited about the same for each blacklist size
+        const size_t lookups = (std::max)(size_t{ 1000 }, (1000000 / entries));
+        std::vector<std::wstring> blacklist;
+        for (size_t index = 0; index < entries; ++index) blacklist.push_back(DeviceInstancePath(index));
+        IndexedBlacklist compiled(blacklist);
+
+        // The compiled records scanned one by one, as the blacklist was matched before it got indexed
+        const auto linearFind = [&compiled](const std::wstring& device, ULONG hash) -> PBLACKLIST_RECORD
+        {
+            for (auto& record : compiled.m_records) if (BlacklistPathMatch(record.hash, record.upcaseDeviceInstancePath, record.length, hash, device.c_str(), static_cast<ULONG>(device.size()))) return (&record);
+            return (nullptr);
+        };
+
+        // Alternate between the middle entry, the last entry, and a device not on the blacklist
+        std::vector<std::wstring> devices{ Upcase(DeviceInstancePath(entries / 2)), Upcase(DeviceInstancePath(entries - 1)), L"HID\\VID_045E&PID_028E\\7&2A1B4C&0&0000" };
+        std::vector<ULONG> hashes;
+        for (const auto& device : devices) hashes.push_back(BlacklistHash(device.c_str(), static_cast<ULONG>(device.size())));
+
+        size_t linearHits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i) linearHits += (nullptr != linearFind(devices[i % devices.size()], hashes[i % devices.size()])) ? 1 : 0;
+        const auto linearElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+        size_t indexedHits = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i) indexedHits += (nullptr != compiled.Find(devices[i % devices.size()], hashes[i % devices.size()])) ? 1 : 0;
+        const auto indexedElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+        EXPECT_EQ(linearHits, indexedHits);
+        if ((0 == crossover) && (indexedElapsed < linearElapsed)) crossover = entries;
+        std::printf("[ Blacklist ] %zu entries: linear %lld ns per lookup; indexed %lld ns per lookup\n",
+            entries, static_cast<long long>(linearElapsed.count() / lookups), static_cast<long long>(indexedElapsed.count() / lookups));
+    }
+    std::printf("[ Blacklist ] the index outperforms the linear scan from %zu entries onwards\n", crossover);
+}
+
+TEST(BlacklistBenchmark, PatternVersusEnumeratedInstances)
+{
+    // Covering every instance a controller model ever got when re-paired, as tooling does without patterns, versus a single pattern
+    const size_t instances = 1024;
+    const size_t lookups = 100000;
+    std::vector<std::wstring> entries;
+    for (size_t instance = 0; instance < instances; ++instance) entries.push_back(L"HID\\VID_054C&PID_0CE6&MI_03\\7&" + std::to_wstring(instance) + L"&0&0000");
+    IndexedBlacklist enumerated(entries);
+    const std::wstring pattern = L"HID\\VID_054C&PID_0CE6*";
+    BLACKLIST_RECORD record{ nullptr, pattern.c_str(), static_cast<ULONG>(pattern.size()), 0, 0 };
+
+    // A device that arrived on a port none of the enumerated instances covers
+    const std::wstring arrived = L"HID\\VID_054C&PID_0CE6&MI_03\\7&" + std::to_wstring(instances) + L"&0&0000";
+    const auto hash = BlacklistHash(arrived.c_str(), static_cast<ULONG>(arrived.size()));
+    size_t patternHits = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) patternHits += BlacklistPatternMatch(&record, arrived.c_str(), static_cast<ULONG>(arrived.size())) ? 1 : 0;
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+    std::printf("[ Blacklist ] a single pattern covers the new instance in %lld ns, %zu enumerated entries don't\n", static_cast<long long>(elapsed.count() / lookups), instances);
+    EXPECT_EQ(lookups, patternHits);
+    EXPECT_EQ(nullptr, enumerated.Find(arrived, hash));
+}
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "PathTrie.h"
+
+TEST(PathTrieBenchmark, FolderEntriesVersusExactEntries)
+{
+    // 10k exact entries (200 games with 50 executables each) versus the 50 folder entries covering the first 50 games
+    constexpr size_t games = 200;
+    constexpr size_t executablesPerGame = 50;
+    constexpr size_t folderEntries = 50;
+    constexpr size_t lookups = 200000;
+
+    const auto gameFolder = [](size_t game) { return L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\LIBRARY\\GAME" + std::to_wstring(game) + L"\\"; };
+    const auto gameImage = [&](size_t game, size_t executable) { return gameFolder(game) + L"BIN\\X64\\TOOL" + std::to_wstring(executable) + L".EXE"; };
+
+    std::unordered_set<std::wstring> exact;
+    std::vector<std::wstring> folders;
+    std::vector<std::wstring> images;
+    for (size_t game = 0; game < games; ++game)
+    {
+        for (size_t executable = 0; executable < executablesPerGame; ++executable) exact.insert(gameImage(game, executable));
+        if (game < folderEntries) folders.push_back(gameFolder(game));
+    }
+    for (size_t game = 0; game < folderEntries; ++game) images.push_back(gameImage(game, game % executablesPerGame));
+    images.push_back(L"\\DEVICE\\HARDDISKVOLUME3\\WINDOWS\\SYSTEM32\\SVCHOST.EXE");
+
+    // Size the trie the way the driver compiles its whitelist
+    ULONG nodeCount = 0;
+    for (const auto& folder : folders) nodeCount += PathTrieNodesNeeded(folder.c_str(), static_cast<ULONG>(folder.size()));
+    ULONG bucketCount = 1;
+    while ((bucketCount / 2) < nodeCount) bucketCount <<= 1;
+    std::vector<PPATH_TRIE_NODE> buckets(bucketCount);
+    std::vector<PATH_TRIE_NODE> nodes(nodeCount);
+    PATH_TRIE trie;
+    PathTrieInitialize(&trie, buckets.data(), bucketCount, nodes.data(), nodeCount);
+    for (const auto& folder : folders) ASSERT_TRUE(PathTrieInsertFolder(&trie, folder.c_str(), static_cast<ULONG>(folder.size())));
+
+    size_t exactHits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) exactHits += exact.count(images[i % images.size()]);
+    const auto exactElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+    size_t trieHits = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i)
+    {
+        const auto& image = images[i % images.size()];
+        trieHits += PathTrieMatch(&trie, image.c_str(), static_cast<ULONG>(image.size())) ? 1 : 0;
+    }
+    const auto trieElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+    EXPECT_EQ(exactHits, trieHits);
+    std::printf("[ PathTrie ] %zu exact entries: %lld ns per lookup; %zu folder entries (%u trie nodes): %lld ns per lookup\n",
+        exact.size(), static_cast<long long>(exactElapsed.count() / lookups),
+        folders.size(), trie.nodesUsed, static_cast<long long>(trieElapsed.count() / lookups));
+}
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "PidIndex.h"
+
+namespace
+{
+    // Mirrors a shard of the driver's process id administration (a reader/writer lock per index)
+    struct Shard
+    {
+        std::shared_mutex lock;
+        PID_INDEX         index;
+    };
+
+    // Register, look up and unregister the process ids owned by one thread, keeping the given number of them alive
+    void ChurnShards(std::vector<Shard>& shards, ULONG thread, ULONG threads, ULONG processes, ULONG liveProcesses)
+    {
+        const ULONG mask = static_cast<ULONG>(shards.size() - 1);
+        std::vector<PID_INDEX_NODE> nodes(processes, PID_INDEX_NODE{});
+        for (ULONG i = 0; i < (processes + liveProcesses); ++i)
+        {
+            if (i < processes)
+            {
+                nodes[i].key = 4u * (1u + thread + (threads * i));
+                auto& shard = shards[PID_INDEX_SHARD(nodes[i].key, mask)];
+                {
+                    std::unique_lock<std::shared_mutex> guard(shard.lock);
+                    PidIndexInsert(&shard.index, &nodes[i]);
+                }
+                {
+                    std::shared_lock<std::shared_mutex> guard(shard.lock);
+                    PidIndexLookup(&shard.index, nodes[i].key);
+                }
+            }
+            if ((i >= liveProcesses) && ((i - liveProcesses) < processes))
+            {
+                auto& retired = nodes[i - liveProcesses];
+                auto& shard = shards[PID_INDEX_SHARD(retired.key, mask)];
+                std::unique_lock<std::shared_mutex> guard(shard.lock);
+                PidIndexDelete(&shard.index, retired.key);
+            }
+        }
+    }
+}
+
+TEST(PidIndexBenchmark, MonotonicChurnLatency)
+{
+    // Replay the way the system hands out process ids: new ids are mostly increasing while older processes exit
+    constexpr ULONG liveProcesses = 4096;
+    constexpr ULONG totalProcesses = 262144;
+    PID_INDEX index;
+    std::vector<PID_INDEX_NODE> nodes(totalProcesses, PID_INDEX_NODE{});
+    std::deque<ULONG> live;
+    ULONG maximumHeight = 0;
+    auto worstInsert = std::chrono::nanoseconds::zero();
+    auto worstLookup = std::chrono::nanoseconds::zero();
+    auto worstDelete = std::chrono::nanoseconds::zero();
+
+    PidIndexInitialize(&index);
+    for (ULONG i = 0; i < totalProcesses; ++i)
+    {
+        const ULONG pid = 4u + (i * 4u);
+        nodes[i].key = pid;
+
+        auto start = std::chrono::steady_clock::now();
+        ASSERT_TRUE(PidIndexInsert(&index, &nodes[i]));
+        worstInsert = (std::max)(worstInsert, std::chrono::steady_clock::now() - start);
+        live.push_back(i);
+
+        start = std::chrono::steady_clock::now();
+        ASSERT_EQ(&nodes[i], PidIndexLookup(&index, pid));
+        worstLookup = (std::max)(worstLookup, std::chrono::steady_clock::now() - start);
+
+        if (live.size() > liveProcesses)
+        {
+            const ULONG retired = live.front();
+            live.pop_front();
+            start = std::chrono::steady_clock::now();
+            ASSERT_EQ(&nodes[retired], PidIndexDelete(&index, nodes[retired].key));
+            worstDelete = (std::max)(worstDelete, std::chrono::steady_clock::now() - start);
+        }
+
+        maximumHeight = (std::max)(maximumHeight, PidIndexHeight(&index));
+    }
+
+    std::printf("[ PidIndex ] %u processes churned, %u live, worst-case depth %u, worst-case insert/lookup/delete %lld/%lld/%lld ns\n",
+        totalProcesses, liveProcesses, maximumHeight,
+        static_cast<long long>(worstInsert.count()), static_cast<long long>(worstLookup.count()), static_cast<long long>(worstDelete.count()));
+}
+
+TEST(PidIndexBenchmark, ShardedChurnScaling)
+{
+    // The same amount of process churn is spread over a growing number of threads, both on a single shard and on the maximum number of shards
+    constexpr ULONG totalProcesses = 131072;
+    constexpr ULONG liveProcessesPerThread = 64;
+    for (ULONG shardCount : { 1u, 64u })
+    {
+        for (ULONG threadCount = 1; threadCount <= 64; threadCount *= 2)
+        {
+            std::vector<Shard> shards(shardCount);
+            for (auto& shard : shards) PidIndexInitialize(&shard.index);
+
+            std::vector<std::thread> threads;
+            const auto start = std::chrono::steady_clock::now();
+            for (ULONG thread = 0; thread < threadCount; ++thread)
+            {
+                threads.emplace_back(ChurnShards, std::ref(shards), thread, threadCount, totalProcesses / threadCount, liveProcessesPerThread);
+            }
+            for (auto& thread : threads) thread.join();
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+            for (auto& shard : shards) EXPECT_EQ(0u, shard.index.count);
+            std::printf("[ PidIndex ] %2u shards, %2u threads: %u processes churned in %lld us\n",
+                shardCount, threadCount, totalProcesses, static_cast<long long>(elapsed.count()));
+        }
+    }
+}
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "Blacklist.h"
+#include "SessionJail.h"
+
+TEST(SessionJailBenchmark, SessionCheckCostIndependentOfBindings)
+{
+    // A cloud-gaming host with a few controllers per session, checked for a device and session pair that is bound, and one that isn't
+    for (const size_t sessions : { size_t{ 1 }, size_t{ 16 }, size_t{ 128 } })
+    {
+        const size_t devicesPerSession = 4;
+        const size_t lookups = 1000000;
+        const ULONG bucketCount = 256;
+
+        // Bindings and buckets owned the way the control device context owns them
+        std::vector<PSESSION_JAIL_BINDING> deviceBuckets(bucketCount);
+        std::vector<PSESSION_JAIL_BINDING> sessionBuckets(bucketCount);
+        std::deque<std::wstring> paths;
+        std::deque<SESSION_JAIL_BINDING> bindings;
+        SESSION_JAIL_INDEX index;
+        SessionJailInitialize(&index, deviceBuckets.data(), sessionBuckets.data(), bucketCount);
+        for (size_t device = 0; device < (sessions * devicesPerSession); ++device)
+        {
+            paths.push_back(L"HID\\VID_054C&PID_0CE6&MI_03\\7&1C2F3B9A&0&" + std::to_wstring(device));
+            const auto& path = paths.back();
+            bindings.push_back(SESSION_JAIL_BINDING{ nullptr, nullptr, path.c_str(), static_cast<ULONG>(path.size()), BlacklistHash(path.c_str(), static_cast<ULONG>(path.size())), static_cast<ULONG>((device / devicesPerSession) + 1) });
+            SessionJailInsert(&index, &bindings.back());
+        }
+
+        const auto& binding = bindings[devicesPerSession * (sessions - 1)];
+        const ULONG sessionIds[] = { static_cast<ULONG>(sessions), static_cast<ULONG>(sessions + 1) };
+        size_t hits = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i) hits += (nullptr != SessionJailFind(&index, binding.hash, binding.upcaseDeviceInstancePath, binding.length, sessionIds[i % 2])) ? 1 : 0;
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+        EXPECT_EQ(lookups / 2, hits);
+        std::printf("[ SessionJail ] %zu sessions with %zu bindings: %lld ns per session check\n", sessions, sessions * devicesPerSession, static_cast<long long>(elapsed.count() / lookups));
+    }
+}
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "Snapshot.h"
+
+namespace
+{
+    struct TestSnapshot
+    {
+        SNAPSHOT_HEADER header;
+        ULONG           value;
+    };
+
+    VOID OnTestSnapshotCleanup(PSNAPSHOT_HEADER header)
+    {
+        delete CONTAINING_RECORD(header, TestSnapshot, header);
+    }
+
+    TestSnapshot* CreateSnapshot(ULONG value)
+    {
+        auto snapshot = new TestSnapshot{};
+        SnapshotInitialize(&snapshot->header, OnTestSnapshotCleanup);
+        snapshot->value = value;
+        return (snapshot);
+    }
+
+    TestSnapshot* Acquire(SNAPSHOT_SLOT& slot)
+    {
+        return (CONTAINING_RECORD(SnapshotAcquire(&slot), TestSnapshot, header));
+    }
+}
+
+TEST(SnapshotBenchmark, LockedVersusSnapshotRead)
+{
+    // Before the configuration snapshot, the open path took the configuration lock shared for the active state, the device blacklisted check, the whitelist check, and the inverse state
+    // This compares those reads with a single snapshot acquisition only; the locks the open path still takes on a verdict refresh or a cache miss aren't part of it
+    const size_t locksPerOpen = 4;
+    const size_t opensPerThread = 200000;
+
+    SNAPSHOT_SLOT slot;
+    SnapshotSlotInitialize(&slot, &CreateSnapshot(1)->header);
+    std::shared_mutex lock;
+    ULONG lockedValue = 1;
+
+    for (const unsigned threadCount : { 1u, 2u, 4u, 8u })
+    {
+        const auto run = [threadCount](const auto& open)
+        {
+            std::vector<std::thread> threads;
+            std::atomic<size_t> sum{ 0 };
+            const auto start = std::chrono::steady_clock::now();
+            for (unsigned thread = 0; thread < threadCount; ++thread)
+            {
+                threads.emplace_back([&]()
+                {
+                    size_t local = 0;
+                    for (size_t i = 0; i < opensPerThread; ++i) local += open();
+                    sum += local;
+                });
+            }
+            for (auto& thread : threads) thread.join();
+            EXPECT_EQ(threadCount * opensPerThread, sum);
+            return (std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start));
+        };
+
+        const auto locked = run([&]()
+        {
+            ULONG value = 0;
+            for (size_t i = 0; i < locksPerOpen; ++i)
+            {
+                std::shared_lock<std::shared_mutex> guard(lock);
+                value = lockedValue;
+            }
+            return (static_cast<size_t>(value));
+        });
+
+        const auto snapshot = run([&]()
+        {
+            const auto configuration = Acquire(slot);
+            const auto value = configuration->value;
+            SnapshotRelease(&configuration->header);
+            return (static_cast<size_t>(value));
+        });
+
+        std::printf("[ Snapshot ] %u threads: %zu shared lock acquisitions %lld ns per open; one snapshot acquisition %lld ns per open\n",
+            threadCount, locksPerOpen, static_cast<long long>(locked.count() / opensPerThread), static_cast<long long>(snapshot.count() / opensPerThread));
+    }
+
+    SnapshotRelease(slot.current);
+}
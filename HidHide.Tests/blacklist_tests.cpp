@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cwctype>
+#include <string>
+#include <vector>
+
+#include "Blacklist.h"
+
+namespace
+{
+    // Blacklist compiled into indexed records, mirroring the way the driver compiles the multi-string property
+    class CompiledBlacklist
+    {
+    public:
+        explicit CompiledBlacklist(const std::vector<std::wstring>& entries)
+        {
+            // Size the buckets the way the driver does, keeping the load factor below one half
+            ULONG bucketCount = 8;
+            while ((bucketCount / 2) < entries.size()) bucketCount <<= 1;
+            m_buckets.resize(bucketCount);
+            BlacklistIndexInitialize(&m_index, m_buckets.data(), bucketCount);
+
+            // The records are indexed hence shouldn't move once added
+            m_paths.reserve(entries.size());
+            m_records.reserve(entries.size());
+            for (const auto& entry : entries)
+            {
+                ULONG length;
+                ULONG jailSessionId;
+                BlacklistSplit(entry.c_str(), static_cast<ULONG>(entry.size()), &length, &jailSessionId);
+                m_paths.push_back(Upcase(entry.substr(0, length)));
+                const auto& path = m_paths.back();
+                const auto hash = BlacklistHash(path.c_str(), length);
+                if (nullptr != BlacklistIndexFind(&m_index, hash, path.c_str(), length)) continue;
+                m_records.push_back(BLACKLIST_RECORD{ nullptr, path.c_str(), length, hash, jailSessionId });
+                BlacklistIndexInsert(&m_index, &m_records.back());
+            }
+        }
+
+        PBLACKLIST_RECORD Find(const std::wstring& upcaseDeviceInstancePath, ULONG hash)
+        {
+            return (BlacklistIndexFind(&m_index, hash, upcaseDeviceInstancePath.c_str(), static_cast<ULONG>(upcaseDeviceInstancePath.size())));
+        }
+
+        static std::wstring Upcase(std::wstring path)
+        {
+            std::transform(path.begin(), path.end(), path.begin(), [](wchar_t c) { return static_cast<wchar_t>(std::towupper(c)); });
+            return (path);
+        }
+
+        std::vector<BLACKLIST_RECORD>  m_records;
+
+    private:
+        std::vector<std::wstring>      m_paths;
+        std::vector<PBLACKLIST_RECORD> m_buckets;
+        BLACKLIST_INDEX                m_index{};
+    };
+
+    std::wstring DeviceInstancePath(size_t index)
+    {
+        return L"HID\\VID_054C&PID_09CC&MI_03\\7&1c2f3b9a&0&" + std::to_wstring(index);
+    }
+}
+
+TEST(Blacklist, SplitsDeviceInstancePathFromJailSession)
+{
+    const auto split = [](const std::wstring& entry, ULONG expectedLength, ULONG expectedJailSessionId)
+    {
+        ULONG length = 0xFFFFFFFF;
+        ULONG jailSessionId = 0xFFFFFFFF;
+        BlacklistSplit(entry.c_str(), static_cast<ULONG>(entry.size()), &length, &jailSessionId);
+        EXPECT_EQ(expectedLength, length) << std::string(entry.begin(), entry.end());
+        EXPECT_EQ(expectedJailSessionId, jailSessionId) << std::string(entry.begin(), entry.end());
+    };
+
+    split(L"HID\\VID_054C&PID_09CC\\7&1C2F&0&0000", 35, 0);
+    split(L"HID\\VID_054C&PID_09CC\\7&1C2F&0&0000!2", 35, 2);
+    split(L"HID\\VID_054C&PID_09CC\\7&1C2F&0&0000! 17", 35, 17);
+    split(L"HID\\VID_054C&PID_09CC\\7&1C2F&0&0000!12X", 35, 12);
+    split(L"HID\\VID_054C&PID_09CC\\7&1C2F&0&0000!", 35, 0);
+
+    // A delimiter in front doesn't split the entry
+    split(L"!2", 2, 0);
+    split(L"", 0, 0);
+}
+
+TEST(Blacklist, FindsRecordsRegardlessOfCaseWithTheJailSessionOfTheFirstEntry)
+{
+    CompiledBlacklist blacklist({ DeviceInstancePath(1) + L"!3", CompiledBlacklist::Upcase(DeviceInstancePath(1)), DeviceInstancePath(2) });
+    ASSERT_EQ(2u, blacklist.m_records.size());
+
+    const auto first = CompiledBlacklist::Upcase(DeviceInstancePath(1));
+    const auto record = blacklist.Find(first, BlacklistHash(first.c_str(), static_cast<ULONG>(first.size())));
+    ASSERT_NE(nullptr, record);
+    EXPECT_EQ(3u, record->jailSessionId);
+
+    // Same length, different device
+    const auto other = CompiledBlacklist::Upcase(DeviceInstancePath(3));
+    EXPECT_EQ(nullptr, blacklist.Find(other, BlacklistHash(other.c_str(), static_cast<ULONG>(other.size()))));
+
+    // A prefix of a blacklisted device
+    const auto prefix = first.substr(0, first.size() - 1);
+    EXPECT_EQ(nullptr, blacklist.Find(prefix, BlacklistHash(prefix.c_str(), static_cast<ULONG>(prefix.size()))));
+}
+
+TEST(Blacklist, CompiledLookupFindsTheLastOfManyEntries)
+{
+    for (const size_t entries : { size_t{ 10 }, size_t{ 100 }, size_t{ 1000 } })
+    {
+        std::vector<std::wstring> blacklist;
+        for (size_t index = 0; index < entries; ++index) blacklist.push_back(DeviceInstancePath(index) + ((0 == (index % 2)) ? L"!1" : L""));
+        CompiledBlacklist compiled(blacklist);
+        ASSERT_EQ(entries, compiled.m_records.size());
+
+        // The last entry is found with its own jail session, whereas a device not on the blacklist isn't found at all
+        const auto last = CompiledBlacklist::Upcase(DeviceInstancePath(entries - 1));
+        const auto record = compiled.Find(last, BlacklistHash(last.c_str(), static_cast<ULONG>(last.size())));
+        ASSERT_NE(nullptr, record);
+        EXPECT_EQ((0 == ((entries - 1) % 2)) ? 1u : 0u, record->jailSessionId);
+        const std::wstring other = L"HID\\VID_045E&PID_028E\\7&2A1B4C&0&0000";
+        EXPECT_EQ(nullptr, compiled.Find(other, BlacklistHash(other.c_str(), static_cast<ULONG>(other.size()))));
+    }
+}
+
+TEST(Blacklist, IndexFindsInsertedRecordsAndForgetsRemovedOnes)
+{
+    // Two records for the same device (as session entries of two processes) and one for another device, sharing a single bucket
+    CompiledBlacklist blacklist({ DeviceInstancePath(1), DeviceInstancePath(2) });
+    std::vector<BLACKLIST_RECORD> records{ blacklist.m_records[0], blacklist.m_records[0], blacklist.m_records[1] };
+    std::vector<PBLACKLIST_RECORD> buckets(1);
+    BLACKLIST_INDEX index;
+    BlacklistIndexInitialize(&index, buckets.data(), static_cast<ULONG>(buckets.size()));
+    for (auto& record : records) BlacklistIndexInsert(&index, &record);
+    EXPECT_EQ(3u, index.count);
+
+    const auto find = [&index](size_t device)
+    {
+        const auto path = CompiledBlacklist::Upcase(DeviceInstancePath(device));
+        return (BlacklistIndexFind(&index, BlacklistHash(path.c_str(), static_cast<ULONG>(path.size())), path.c_str(), static_cast<ULONG>(path.size())));
+    };
+    EXPECT_NE(nullptr, find(1));
+    EXPECT_EQ(&records[2], find(2));
+    EXPECT_EQ(nullptr, find(3));
+
+    // The device remains blacklisted till the last record for it is removed
+    BlacklistIndexRemove(&index, &records[1]);
+    EXPECT_EQ(&records[0], find(1));
+    BlacklistIndexRemove(&index, &records[0]);
+    EXPECT_EQ(nullptr, find(1));
+    EXPECT_EQ(&records[2], find(2));
+    EXPECT_EQ(1u, index.count);
+
+    // Removing a record that isn't indexed is ignored
+    BlacklistIndexRemove(&index, &records[0]);
+    EXPECT_EQ(1u, index.count);
+}
+
+TEST(Blacklist, IndexFindsEntriesAtAnySize)
+{
+    for (size_t entries = 1; entries <= 1024; entries <<= 1)
+    {
+        std::vector<std::wstring> blacklist;
+        for (size_t index = 0; index < entries; ++index) blacklist.push_back(DeviceInstancePath(index));
+        CompiledBlacklist compiled(blacklist);
+        ASSERT_EQ(entries, compiled.m_records.size());
+
+        // The middle entry and the last entry are found, whereas a device not on the blacklist isn't
+        for (const auto& device : { CompiledBlacklist::Upcase(DeviceInstancePath(entries / 2)), CompiledBlacklist::Upcase(DeviceInstancePath(entries - 1)) })
+        {
+            const auto record = compiled.Find(device, BlacklistHash(device.c_str(), static_cast<ULONG>(device.size())));
+            ASSERT_NE(nullptr, record);
+            EXPECT_EQ(device, std::wstring(record->upcaseDeviceInstancePath, record->length));
+        }
+        const std::wstring other = L"HID\\VID_045E&PID_028E\\7&2A1B4C&0&0000";
+        EXPECT_EQ(nullptr, compiled.Find(other, BlacklistHash(other.c_str(), static_cast<ULONG>(other.size()))));
+    }
+}
+
+namespace
+{
+    // Pattern record over an upper-case pattern, owned by the caller
+    BLACKLIST_RECORD PatternRecord(const std::wstring& upcasePattern, ULONG jailSessionId = 0)
+    {
+        return (BLACKLIST_RECORD{ nullptr, upcasePattern.c_str(), static_cast<ULONG>(upcasePattern.size()), 0, jailSessionId });
+    }
+
+    bool PatternMatch(const std::wstring& upcasePattern, const std::wstring& upcaseDeviceInstancePath)
+    {
+        auto record = PatternRecord(upcasePattern);
+        return (FALSE != BlacklistPatternMatch(&record, upcaseDeviceInstancePath.c_str(), static_cast<ULONG>(upcaseDeviceInstancePath.size())));
+    }
+}
+
+TEST(Blacklist, RecognizesPatterns)
+{
+    const std::wstring prefix = L"HID\\VID_054C&PID_0CE6*";
+    const std::wstring single = L"HID\\VID_054C&PID_0CE?";
+    const auto plain = DeviceInstancePath(1);
+    EXPECT_TRUE(BlacklistIsPattern(prefix.c_str(), static_cast<ULONG>(prefix.size())));
+    EXPECT_TRUE(BlacklistIsPattern(single.c_str(), static_cast<ULONG>(single.size())));
+    EXPECT_FALSE(BlacklistIsPattern(plain.c_str(), static_cast<ULONG>(plain.size())));
+}
+
+TEST(Blacklist, PatternsMatchWildcards)
+{
+    const std::wstring dualSense = L"HID\\VID_054C&PID_0CE6&MI_03\\7&1C2F3B9A&0&0000";
+
+    // Any run of characters, including none, at the end, in the middle, or as a whole
+    EXPECT_TRUE(PatternMatch(L"HID\\VID_054C&PID_0CE6*", dualSense));
+    EXPECT_TRUE(PatternMatch(L"HID\\VID_054C&PID_0CE6&MI_03\\7&1C2F3B9A&0&0000*", dualSense));
+    EXPECT_TRUE(PatternMatch(L"HID\\VID_054C&*\\*&0000", dualSense));
+    EXPECT_TRUE(PatternMatch(L"*", dualSense));
+    EXPECT_TRUE(PatternMatch(L"**", L""));
+
+    // Any single character
+    EXPECT_TRUE(PatternMatch(L"HID\\VID_054C&PID_0CE?&MI_03\\*", dualSense));
+    EXPECT_FALSE(PatternMatch(L"HID\\VID_054C&PID_0CE6?", L"HID\\VID_054C&PID_0CE6"));
+
+    // Other devices, and a pattern without a trailing wildcard that only covers a prefix
+    EXPECT_FALSE(PatternMatch(L"HID\\VID_054C&PID_0CE6*", L"HID\\VID_054C&PID_09CC&MI_03\\7&1C2F3B9A&0&0000"));
+    EXPECT_FALSE(PatternMatch(L"HID\\VID_054C&PID_0CE?", dualSense));
+    EXPECT_FALSE(PatternMatch(L"*&0001", dualSense));
+
+    // A mismatch after a partial match backtracks to the last any-wildcard
+    EXPECT_TRUE(PatternMatch(L"*&0&0000", L"HID\\X&0&0&0&0000"));
+    EXPECT_TRUE(PatternMatch(L"A*AB", L"AAAAB"));
+    EXPECT_FALSE(PatternMatch(L"A*AB", L"AAAAA"));
+}
+
+TEST(Blacklist, FirstMatchingPatternDeterminesTheJailSession)
+{
+    const std::wstring anyDualSense = L"HID\\VID_054C&PID_0CE6*";
+    const std::wstring anySony = L"HID\\VID_054C&*";
+    auto first = PatternRecord(anyDualSense, 2);
+    auto second = PatternRecord(anySony, 3);
+    first.next = &second;
+
+    const std::wstring dualSense = L"HID\\VID_054C&PID_0CE6&MI_03\\7&1C2F3B9A&0&0000";
+    const std::wstring dualShock = L"HID\\VID_054C&PID_09CC&MI_03\\7&1C2F3B9A&0&0000";
+    const std::wstring xbox = L"HID\\VID_045E&PID_028E\\7&2A1B4C&0&0000";
+    const auto matchDualSense = BlacklistPatternFind(&first, dualSense.c_str(), static_cast<ULONG>(dualSense.size()));
+    const auto matchDualShock = BlacklistPatternFind(&first, dualShock.c_str(), static_cast<ULONG>(dualShock.size()));
+    ASSERT_NE(nullptr, matchDualSense);
+    ASSERT_NE(nullptr, matchDualShock);
+    EXPECT_EQ(2u, matchDualSense->jailSessionId);
+    EXPECT_EQ(3u, matchDualShock->jailSessionId);
+    EXPECT_EQ(nullptr, BlacklistPatternFind(&first, xbox.c_str(), static_cast<ULONG>(xbox.size())));
+    EXPECT_EQ(nullptr, BlacklistPatternFind(nullptr, xbox.c_str(), static_cast<ULONG>(xbox.size())));
+}
+
+TEST(Blacklist, PatternCoversInstancesNotEnumerated)
+{
+    // Covering every instance a controller model ever got when re-paired, as tooling does without patterns, versus a single pattern
+    const size_t instances = 1024;
+    std::vector<std::wstring> entries;
+    for (size_t instance = 0; instance < instances; ++instance) entries.push_back(L"HID\\VID_054C&PID_0CE6&MI_03\\7&" + std::to_wstring(instance) + L"&0&0000");
+    CompiledBlacklist enumerated(entries);
+
+    // A device that arrived on a port none of the enumerated instances covers
+    const std::wstring arrived = L"HID\\VID_054C&PID_0CE6&MI_03\\7&" + std::to_wstring(instances) + L"&0&0000";
+    EXPECT_TRUE(PatternMatch(L"HID\\VID_054C&PID_0CE6*", arrived));
+    EXPECT_EQ(nullptr, enumerated.Find(arrived, BlacklistHash(arrived.c_str(), static_cast<ULONG>(arrived.size()))));
+}
+
+TEST(Blacklist, FormatsContainerIdsAsTheDeviceManagerDoes)
+{
+    const GUID containerId{ 0x8c1d6e2a, 0x4f3b, 0x11ee, { 0xbe, 0x56, 0x02, 0x42, 0xac, 0x12, 0x00, 0x02 } };
+    WCHAR upcaseContainerId[BLACKLIST_CONTAINER_ID_LENGTH];
+    BlacklistFormatContainerId(&containerId, upcaseContainerId);
+    EXPECT_EQ(std::wstring(L"{8C1D6E2A-4F3B-11EE-BE56-0242AC120002}"), std::wstring(upcaseContainerId, BLACKLIST_CONTAINER_ID_LENGTH));
+
+    // Leading zeros are kept so that the length is fixed
+    const GUID small{ 0x1, 0x2, 0x3, { 0, 0, 0, 0, 0, 0, 0, 0x4 } };
+    BlacklistFormatContainerId(&small, upcaseContainerId);
+    EXPECT_EQ(std::wstring(L"{00000001-0002-0003-0000-000000000004}"), std::wstring(upcaseContainerId, BLACKLIST_CONTAINER_ID_LENGTH));
+}
+
+TEST(Blacklist, ContainerIdEntryCoversEveryDeviceOfTheContainer)
+{
+    // A DualSense shows up as several collections, all sharing the container id of the physical controller
+    CompiledBlacklist blacklist({ L"{8c1d6e2a-4f3b-11ee-be56-0242ac120002}!2" });
+    const GUID containerId{ 0x8c1d6e2a, 0x4f3b, 0x11ee, { 0xbe, 0x56, 0x02, 0x42, 0xac, 0x12, 0x00, 0x02 } };
+    const GUID otherContainerId{ 0x8c1d6e2a, 0x4f3b, 0x11ee, { 0xbe, 0x56, 0x02, 0x42, 0xac, 0x12, 0x00, 0x03 } };
+
+    WCHAR buffer[BLACKLIST_CONTAINER_ID_LENGTH];
+    BlacklistFormatContainerId(&containerId, buffer);
+    const std::wstring upcaseContainerId(buffer, BLACKLIST_CONTAINER_ID_LENGTH);
+    const auto record = blacklist.Find(upcaseContainerId, BlacklistHash(upcaseContainerId.c_str(), BLACKLIST_CONTAINER_ID_LENGTH));
+    ASSERT_NE(nullptr, record);
+    EXPECT_EQ(2u, record->jailSessionId);
+
+    BlacklistFormatContainerId(&otherContainerId, buffer);
+    const std::wstring upcaseOtherContainerId(buffer, BLACKLIST_CONTAINER_ID_LENGTH);
+    EXPECT_EQ(nullptr, blacklist.Find(upcaseOtherContainerId, BlacklistHash(upcaseOtherContainerId.c_str(), BLACKLIST_CONTAINER_ID_LENGTH)));
+}
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+#include "Histogram.h"
+
+TEST(Histogram, BucketsDoubleInRange)
+{
+    EXPECT_EQ(0u, HistogramBucket(0, 24));
+    EXPECT_EQ(1u, HistogramBucket(1, 24));
+    EXPECT_EQ(2u, HistogramBucket(2, 24));
+    EXPECT_EQ(2u, HistogramBucket(3, 24));
+    EXPECT_EQ(3u, HistogramBucket(4, 24));
+    EXPECT_EQ(10u, HistogramBucket(1000, 24));
+    EXPECT_EQ(11u, HistogramBucket(1024, 24));
+
+    // Values beyond the range of the histogram end up in the last bucket
+    EXPECT_EQ(23u, HistogramBucket(1ULL << 22, 24));
+    EXPECT_EQ(23u, HistogramBucket(1ULL << 40, 24));
+    EXPECT_EQ(23u, HistogramBucket(~0ULL, 24));
+}
+
+TEST(Histogram, ConcurrentRecordsAreAllCounted)
+{
+    std::vector<LONG64> buckets(24, 0);
+    const unsigned threadCount = 4;
+    const ULONG64 recordsPerThread = 100000;
+    std::vector<std::thread> threads;
+
+    for (unsigned thread = 0; thread < threadCount; ++thread)
+    {
+        threads.emplace_back([&]()
+        {
+            for (ULONG64 i = 0; i < recordsPerThread; ++i) HistogramRecord(buckets.data(), 24, i % 4);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    // The values 0, 1, 2, and 3 map on the buckets 0, 1, 2, and 2
+    EXPECT_EQ(static_cast<LONG64>(threadCount * recordsPerThread / 4), buckets[0]);
+    EXPECT_EQ(static_cast<LONG64>(threadCount * recordsPerThread / 4), buckets[1]);
+    EXPECT_EQ(static_cast<LONG64>(threadCount * recordsPerThread / 2), buckets[2]);
+    EXPECT_EQ(0, buckets[3]);
+}
@@ -3,6 +3,8 @@
 
 #include <gtest/gtest.h>
 
+#include <cstddef>
+
 #include "HidHideIoctlContract.h"
 
 namespace
@@ -32,4 +34,21 @@ TEST(IoctlContract, IoctlCodesMatchHistoricAbi)
     EXPECT_EQ(GoldenCtlCode(2055u), static_cast<ULONG>(IOCTL_SET_WLINVERSE));
     EXPECT_EQ(GoldenCtlCode(2056u), static_cast<ULONG>(IOCTL_ADD_SESSION_BLACKLIST));
     EXPECT_EQ(GoldenCtlCode(2057u), static_cast<ULONG>(IOCTL_CLR_SESSION_BLACKLIST));
+    EXPECT_EQ(GoldenCtlCode(2058u), static_cast<ULONG>(IOCTL_ADD_SESSION_JAIL));
+    EXPECT_EQ(GoldenCtlCode(2059u), static_cast<ULONG>(IOCTL_DEL_SESSION_JAIL));
+    EXPECT_EQ(GoldenCtlCode(2060u), static_cast<ULONG>(IOCTL_CLR_SESSION_JAIL));
+    EXPECT_EQ(GoldenCtlCode(2061u), static_cast<ULONG>(IOCTL_GET_DEVICE_STATISTICS));
+    EXPECT_EQ(GoldenCtlCode(2062u), static_cast<ULONG>(IOCTL_DEL_SESSION_BLACKLIST));
+}
+
+TEST(IoctlContract, DeviceStatisticsRecordLayout)
+{
+    EXPECT_EQ(24u, static_cast<unsigned>(HIDHIDE_LATENCY_BUCKETS));
+    EXPECT_EQ(0u, offsetof(HIDHIDE_DEVICE_STATISTICS, recordSize));
+    EXPECT_EQ(4u, offsetof(HIDHIDE_DEVICE_STATISTICS, deviceInstancePathLength));
+    EXPECT_EQ(8u, offsetof(HIDHIDE_DEVICE_STATISTICS, opens));
+    EXPECT_EQ(48u, offsetof(HIDHIDE_DEVICE_STATISTICS, verdictCacheMisses));
+    EXPECT_EQ(56u, offsetof(HIDHIDE_DEVICE_STATISTICS, decisionLatency));
+    EXPECT_EQ(248u, offsetof(HIDHIDE_DEVICE_STATISTICS, forwardLatency));
+    EXPECT_EQ(440u, sizeof(HIDHIDE_DEVICE_STATISTICS));
 }
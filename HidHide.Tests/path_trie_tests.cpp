@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "PathTrie.h"
+
+namespace
+{
+    // Trie with storage sized for the folders provided, mirroring the way the driver compiles its whitelist
+    class Trie
+    {
+    public:
+        explicit Trie(const std::vector<std::wstring>& folders)
+            : m_folders(folders)
+        {
+            ULONG nodeCount = 0;
+            for (const auto& folder : m_folders) nodeCount += PathTrieNodesNeeded(folder.c_str(), static_cast<ULONG>(folder.size()));
+            ULONG bucketCount = 1;
+            while ((bucketCount / 2) < nodeCount) bucketCount <<= 1;
+            m_buckets.resize(bucketCount);
+            m_nodes.resize((std::max)(nodeCount, ULONG{ 1 }));
+            PathTrieInitialize(&m_trie, m_buckets.data(), bucketCount, m_nodes.data(), nodeCount);
+            for (const auto& folder : m_folders) m_inserted.push_back(PathTrieInsertFolder(&m_trie, folder.c_str(), static_cast<ULONG>(folder.size())));
+        }
+
+        bool Match(const std::wstring& path)
+        {
+            return (FALSE != PathTrieMatch(&m_trie, path.c_str(), static_cast<ULONG>(path.size())));
+        }
+
+        PATH_TRIE                    m_trie{};
+        std::vector<BOOLEAN>         m_inserted;
+
+    private:
+        std::vector<std::wstring>    m_folders;
+        std::vector<PPATH_TRIE_NODE> m_buckets;
+        std::vector<PATH_TRIE_NODE>  m_nodes;
+    };
+
+    std::wstring GameFolder(size_t index)
+    {
+        return L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\LIBRARY\\GAME" + std::to_wstring(index) + L"\\";
+    }
+
+    std::wstring GameImage(size_t index, size_t executable)
+    {
+        return GameFolder(index) + L"BIN\\X64\\TOOL" + std::to_wstring(executable) + L".EXE";
+    }
+}
+
+TEST(PathTrie, EmptyTrieMatchesNothing)
+{
+    Trie trie({});
+    EXPECT_EQ(0u, trie.m_trie.folders);
+    EXPECT_FALSE(trie.Match(L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\GAME.EXE"));
+    EXPECT_FALSE(trie.Match(L""));
+}
+
+TEST(PathTrie, RejectsPathsThatArentFolders)
+{
+    Trie trie({ L"\\DEVICE\\HARDDISKVOLUME3\\GAMES", L"" });
+    EXPECT_FALSE(trie.m_inserted[0]);
+    EXPECT_FALSE(trie.m_inserted[1]);
+    EXPECT_EQ(0u, trie.m_trie.folders);
+}
+
+TEST(PathTrie, MatchesImagesWithinAFolderAtAnyDepth)
+{
+    Trie trie({ L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\", L"\\DEVICE\\HARDDISKVOLUME4\\TOOLS\\X64\\" });
+    ASSERT_TRUE(trie.m_inserted[0]);
+    ASSERT_TRUE(trie.m_inserted[1]);
+    EXPECT_EQ(2u, trie.m_trie.folders);
+
+    EXPECT_TRUE(trie.Match(L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\GAME.EXE"));
+    EXPECT_TRUE(trie.Match(L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\LIBRARY\\GAME\\BIN\\GAME.EXE"));
+    EXPECT_TRUE(trie.Match(L"\\DEVICE\\HARDDISKVOLUME4\\TOOLS\\X64\\TOOL.EXE"));
+
+    // Neither the folder's parent, a sibling sharing a prefix, nor a file named like the folder is covered
+    EXPECT_FALSE(trie.Match(L"\\DEVICE\\HARDDISKVOLUME4\\TOOLS\\TOOL.EXE"));
+    EXPECT_FALSE(trie.Match(L"\\DEVICE\\HARDDISKVOLUME3\\GAMESX\\GAME.EXE"));
+    EXPECT_FALSE(trie.Match(L"\\DEVICE\\HARDDISKVOLUME3\\GAMES"));
+    EXPECT_FALSE(trie.Match(L"\\DEVICE\\HARDDISKVOLUME5\\GAMES\\GAME.EXE"));
+}
+
+TEST(PathTrie, SharesCommonPrefixesAndCountsDuplicatesOnce)
+{
+    Trie trie({ L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\", L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\", L"\\DEVICE\\HARDDISKVOLUME3\\APPS\\" });
+    EXPECT_EQ(2u, trie.m_trie.folders);
+
+    // Root, device, volume, and the two folders
+    EXPECT_EQ(5u, trie.m_trie.nodesUsed);
+}
+
+TEST(PathTrie, FolderEntriesCoverTheSameImagesAsExactEntries)
+{
+    // 10k exact entries (200 games with 50 executables each) versus the 50 folder entries covering the first 50 games
+    constexpr size_t games = 200;
+    constexpr size_t executablesPerGame = 50;
+    constexpr size_t folderEntries = 50;
+
+    std::unordered_set<std::wstring> exact;
+    std::vector<std::wstring> folders;
+    std::vector<std::wstring> images;
+    for (size_t game = 0; game < games; ++game)
+    {
+        for (size_t executable = 0; executable < executablesPerGame; ++executable) exact.insert(GameImage(game, executable));
+        if (game < folderEntries) folders.push_back(GameFolder(game));
+    }
+    for (size_t game = 0; game < folderEntries; ++game) images.push_back(GameImage(game, game % executablesPerGame));
+    images.push_back(L"\\DEVICE\\HARDDISKVOLUME3\\WINDOWS\\SYSTEM32\\SVCHOST.EXE");
+    ASSERT_EQ(games * executablesPerGame, exact.size());
+
+    Trie trie(folders);
+    ASSERT_EQ(folderEntries, trie.m_trie.folders);
+
+    // Both should whitelist the same images, being all but the system image
+    for (const auto& image : images) EXPECT_EQ(0u != exact.count(image), trie.Match(image));
+    EXPECT_FALSE(trie.Match(images.back()));
+}
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "PidIndex.h"
+
+namespace
+{
+    // Upper bound on the height of an AVL tree holding the given number of nodes
+    ULONG MaximumAvlHeight(ULONG count)
+    {
+        return static_cast<ULONG>(1.4405 * std::log2(static_cast<double>(count) + 2.0));
+    }
+
+    std::vector<PID_INDEX_NODE> MakeNodes(size_t count)
+    {
+        return std::vector<PID_INDEX_NODE>(count, PID_INDEX_NODE{});
+    }
+
+    // Mirrors a shard of the driver's process id administration (a reader/writer lock per index)
+    struct Shard
+    {
+        std::shared_mutex lock;
+        PID_INDEX         index;
+    };
+
+    // Churn the process ids owned by one thread through the shards: register, look up, and unregister the oldest
+    void ChurnShards(std::vector<Shard>& shards, ULONG thread, ULONG threads, ULONG processes, ULONG liveProcesses)
+    {
+        const ULONG mask = static_cast<ULONG>(shards.size() - 1);
+        auto nodes = MakeNodes(processes);
+        for (ULONG i = 0; i < processes; ++i)
+        {
+            const ULONG pid = 4u * (1u + thread + (threads * i));
+            auto& shard = shards[PID_INDEX_SHARD(pid, mask)];
+            nodes[i].key = pid;
+            {
+                std::unique_lock<std::shared_mutex> guard(shard.lock);
+                ASSERT_TRUE(PidIndexInsert(&shard.index, &nodes[i]));
+            }
+            {
+                std::shared_lock<std::shared_mutex> guard(shard.lock);
+                ASSERT_EQ(&nodes[i], PidIndexLookup(&shard.index, pid));
+            }
+            if (i >= liveProcesses)
+            {
+                auto& retired = nodes[i - liveProcesses];
+                auto& retiredShard = shards[PID_INDEX_SHARD(retired.key, mask)];
+                std::unique_lock<std::shared_mutex> guard(retiredShard.lock);
+                ASSERT_EQ(&retired, PidIndexDelete(&retiredShard.index, retired.key));
+            }
+        }
+
+        // Unregister the processes still alive before the nodes go out of scope
+        for (ULONG i = (processes > liveProcesses) ? (processes - liveProcesses) : 0; i < processes; ++i)
+        {
+            auto& shard = shards[PID_INDEX_SHARD(nodes[i].key, mask)];
+            std::unique_lock<std::shared_mutex> guard(shard.lock);
+            ASSERT_EQ(&nodes[i], PidIndexDelete(&shard.index, nodes[i].key));
+        }
+    }
+}
+
+TEST(PidIndex, EmptyIndex)
+{
+    PID_INDEX index;
+    PidIndexInitialize(&index);
+    EXPECT_EQ(0u, PidIndexHeight(&index));
+    EXPECT_EQ(nullptr, PidIndexFirst(&index));
+    EXPECT_EQ(nullptr, PidIndexLookup(&index, 4u));
+    EXPECT_EQ(nullptr, PidIndexDelete(&index, 4u));
+    EXPECT_TRUE(PidIndexVerify(&index));
+}
+
+TEST(PidIndex, RejectsDuplicateKeys)
+{
+    PID_INDEX index;
+    auto nodes = MakeNodes(2);
+    PidIndexInitialize(&index);
+    nodes[0].key = 8u;
+    nodes[1].key = 8u;
+    EXPECT_TRUE(PidIndexInsert(&index, &nodes[0]));
+    EXPECT_FALSE(PidIndexInsert(&index, &nodes[1]));
+    EXPECT_EQ(1u, index.count);
+    EXPECT_EQ(&nodes[0], PidIndexLookup(&index, 8u));
+}
+
+TEST(PidIndex, WalksKeysInAscendingOrder)
+{
+    static const ULONG pattern[] = { 5, 11, 15, 10, 8, 9, 3, 4, 1, 2 };
+    PID_INDEX index;
+    auto nodes = MakeNodes(_countof(pattern));
+    PidIndexInitialize(&index);
+    for (size_t i = 0; i < _countof(pattern); ++i)
+    {
+        nodes[i].key = pattern[i];
+        ASSERT_TRUE(PidIndexInsert(&index, &nodes[i]));
+    }
+    ASSERT_TRUE(PidIndexVerify(&index));
+
+    std::vector<ULONG> keys;
+    for (auto node = PidIndexFirst(&index); node != nullptr; node = PidIndexNext(&index, node->key)) keys.push_back(node->key);
+    EXPECT_EQ((std::vector<ULONG>{ 1, 2, 3, 4, 5, 8, 9, 10, 11, 15 }), keys);
+
+    // Deleting a node with two children keeps the index consistent
+    auto deleted = PidIndexDelete(&index, 5u);
+    ASSERT_NE(nullptr, deleted);
+    EXPECT_EQ(5u, deleted->key);
+    EXPECT_EQ(nullptr, PidIndexLookup(&index, 5u));
+    EXPECT_EQ(nullptr, PidIndexDelete(&index, 5u));
+    EXPECT_TRUE(PidIndexVerify(&index));
+    EXPECT_EQ(_countof(pattern) - 1, index.count);
+}
+
+TEST(PidIndex, MonotonicChurnStaysBalanced)
+{
+    // Replay the way the system hands out process ids: new ids are mostly increasing while older processes exit
+    constexpr ULONG liveProcesses = 4096;
+    constexpr ULONG totalProcesses = 262144;
+    PID_INDEX index;
+    auto nodes = MakeNodes(totalProcesses);
+    std::deque<ULONG> live;
+    ULONG maximumHeight = 0;
+
+    PidIndexInitialize(&index);
+    for (ULONG i = 0; i < totalProcesses; ++i)
+    {
+        const ULONG pid = 4u + (i * 4u);
+        nodes[i].key = pid;
+
+        ASSERT_TRUE(PidIndexInsert(&index, &nodes[i]));
+        live.push_back(i);
+        ASSERT_EQ(&nodes[i], PidIndexLookup(&index, pid));
+
+        if (live.size() > liveProcesses)
+        {
+            const ULONG retired = live.front();
+            live.pop_front();
+            ASSERT_EQ(&nodes[retired], PidIndexDelete(&index, nodes[retired].key));
+        }
+
+        maximumHeight = (std::max)(maximumHeight, PidIndexHeight(&index));
+        ASSERT_LE(PidIndexHeight(&index), MaximumAvlHeight(index.count));
+    }
+
+    EXPECT_TRUE(PidIndexVerify(&index));
+    EXPECT_EQ(liveProcesses, index.count);
+    EXPECT_LE(maximumHeight, MaximumAvlHeight(liveProcesses));
+}
+
+TEST(PidIndex, DrainsThroughTheRoot)
+{
+    constexpr ULONG count = 1000;
+    PID_INDEX index;
+    auto nodes = MakeNodes(count);
+    PidIndexInitialize(&index);
+    for (ULONG i = 0; i < count; ++i)
+    {
+        nodes[i].key = (count - i) * 4u;
+        ASSERT_TRUE(PidIndexInsert(&index, &nodes[i]));
+    }
+    while (index.root != nullptr)
+    {
+        ASSERT_NE(nullptr, PidIndexDelete(&index, index.root->key));
+        ASSERT_LE(PidIndexHeight(&index), MaximumAvlHeight(index.count));
+    }
+    EXPECT_EQ(0u, index.count);
+    EXPECT_TRUE(PidIndexVerify(&index));
+}
+
+TEST(PidIndex, ShardSelectionSpreadsConsecutiveProcessIds)
+{
+    constexpr ULONG shards = 64;
+    std::vector<ULONG> hits(shards, 0);
+    for (ULONG i = 0; i < (shards * 16); ++i) hits[PID_INDEX_SHARD(4u * (i + 1u), shards - 1u)]++;
+    for (auto hit : hits) EXPECT_EQ(16u, hit);
+    EXPECT_EQ(0u, PID_INDEX_SHARD(4u * 12345u, 0u));
+}
+
+TEST(PidIndex, ShardedChurnLeavesConsistentEmptyShards)
+{
+    // Process churn spread over a growing number of threads, both on a single shard and on the maximum number of shards, should leave every shard consistent and empty
+    constexpr ULONG totalProcesses = 131072;
+    constexpr ULONG liveProcessesPerThread = 64;
+    for (ULONG shardCount : { 1u, 64u })
+    {
+        for (ULONG threadCount = 1; threadCount <= 64; threadCount *= 2)
+        {
+            std::vector<Shard> shards(shardCount);
+            for (auto& shard : shards) PidIndexInitialize(&shard.index);
+
+            std::vector<std::thread> threads;
+            for (ULONG thread = 0; thread < threadCount; ++thread)
+            {
+                threads.emplace_back(ChurnShards, std::ref(shards), thread, threadCount, totalProcesses / threadCount, liveProcessesPerThread);
+            }
+            for (auto& thread : threads) thread.join();
+
+            for (auto& shard : shards)
+            {
+                EXPECT_TRUE(PidIndexVerify(&shard.index));
+                EXPECT_EQ(0u, shard.index.count);
+            }
+        }
+    }
+}
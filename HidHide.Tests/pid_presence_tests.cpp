@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "PidPresence.h"
+
+namespace
+{
+    std::unique_ptr<PID_PRESENCE> CreatePresence()
+    {
+        auto presence = std::make_unique<PID_PRESENCE>();
+        PidPresenceInitialize(presence.get());
+        return (presence);
+    }
+}
+
+TEST(PidPresence, TracksProcessIdsAsTheSystemHandsThemOut)
+{
+    EXPECT_TRUE(PID_PRESENCE_TRACKED(4u));
+    EXPECT_TRUE(PID_PRESENCE_TRACKED(PID_PRESENCE_LIMIT - 4));
+    EXPECT_FALSE(PID_PRESENCE_TRACKED(6u));
+    EXPECT_FALSE(PID_PRESENCE_TRACKED(PID_PRESENCE_LIMIT));
+}
+
+TEST(PidPresence, MarksProcessIdsPresentAndAbsent)
+{
+    auto presence = CreatePresence();
+    EXPECT_FALSE(PidPresenceTest(presence.get(), 4096));
+
+    // Neighbouring process ids share a word of the bitmap but not a bit
+    PidPresenceUpdate(presence.get(), 4096, TRUE);
+    PidPresenceUpdate(presence.get(), 4100, TRUE);
+    EXPECT_TRUE(PidPresenceTest(presence.get(), 4096));
+    EXPECT_TRUE(PidPresenceTest(presence.get(), 4100));
+    EXPECT_FALSE(PidPresenceTest(presence.get(), 4092));
+    EXPECT_FALSE(PidPresenceTest(presence.get(), 4104));
+
+    PidPresenceUpdate(presence.get(), 4096, FALSE);
+    EXPECT_FALSE(PidPresenceTest(presence.get(), 4096));
+    EXPECT_TRUE(PidPresenceTest(presence.get(), 4100));
+
+    // The highest process id tracked lands in the last word
+    PidPresenceUpdate(presence.get(), PID_PRESENCE_LIMIT - 4, TRUE);
+    EXPECT_TRUE(PidPresenceTest(presence.get(), PID_PRESENCE_LIMIT - 4));
+}
+
+TEST(PidPresence, ConcurrentUpdatesOfSharedWordsKeepEveryBit)
+{
+    auto presence = CreatePresence();
+    const unsigned threadCount = (std::max)(4u, std::thread::hardware_concurrency());
+    const ULONG processesPerThread = 1024;
+    std::atomic<size_t> failures{ 0 };
+    std::vector<std::thread> threads;
+
+    // Each thread owns the process ids congruent to its index, as a shard does, hence all threads update the same words
+    for (unsigned thread = 0; thread < threadCount; ++thread)
+    {
+        threads.emplace_back([&, thread]()
+        {
+            for (ULONG round = 0; round < 16; ++round)
+            {
+                for (ULONG process = 0; process < processesPerThread; ++process) PidPresenceUpdate(presence.get(), 4 * ((process * threadCount) + thread), TRUE);
+                for (ULONG process = 0; process < processesPerThread; ++process)
+                {
+                    if (!PidPresenceTest(presence.get(), 4 * ((process * threadCount) + thread))) ++failures;
+                }
+                for (ULONG process = 0; process < processesPerThread; process += 2) PidPresenceUpdate(presence.get(), 4 * ((process * threadCount) + thread), FALSE);
+                for (ULONG process = 0; process < processesPerThread; ++process)
+                {
+                    if ((0 == (process % 2)) == (FALSE != PidPresenceTest(presence.get(), 4 * ((process * threadCount) + thread)))) ++failures;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    EXPECT_EQ(0u, failures);
+}
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "Blacklist.h"
+#include "SessionJail.h"
+
+namespace
+{
+    // Session jail owning its bindings and buckets, the way the control device context does
+    class SessionJail
+    {
+    public:
+        explicit SessionJail(ULONG bucketCount = 256) : m_deviceBuckets(bucketCount), m_sessionBuckets(bucketCount)
+        {
+            SessionJailInitialize(&m_index, m_deviceBuckets.data(), m_sessionBuckets.data(), bucketCount);
+        }
+
+        PSESSION_JAIL_BINDING Bind(const std::wstring& upcaseDeviceInstancePath, ULONG sessionId)
+        {
+            m_paths.push_back(upcaseDeviceInstancePath);
+            const auto& path = m_paths.back();
+            m_bindings.push_back(SESSION_JAIL_BINDING{ nullptr, nullptr, path.c_str(), static_cast<ULONG>(path.size()), Hash(path), sessionId });
+            SessionJailInsert(&m_index, &m_bindings.back());
+            return (&m_bindings.back());
+        }
+
+        PSESSION_JAIL_BINDING Find(const std::wstring& upcaseDeviceInstancePath, ULONG sessionId)
+        {
+            return (SessionJailFind(&m_index, Hash(upcaseDeviceInstancePath), upcaseDeviceInstancePath.c_str(), static_cast<ULONG>(upcaseDeviceInstancePath.size()), sessionId));
+        }
+
+        bool Bound(const std::wstring& upcaseDeviceInstancePath)
+        {
+            return (FALSE != SessionJailBound(&m_index, Hash(upcaseDeviceInstancePath), upcaseDeviceInstancePath.c_str(), static_cast<ULONG>(upcaseDeviceInstancePath.size())));
+        }
+
+        static ULONG Hash(const std::wstring& upcaseDeviceInstancePath)
+        {
+            return (BlacklistHash(upcaseDeviceInstancePath.c_str(), static_cast<ULONG>(upcaseDeviceInstancePath.size())));
+        }
+
+        SESSION_JAIL_INDEX m_index;
+
+    private:
+        std::vector<PSESSION_JAIL_BINDING> m_deviceBuckets;
+        std::vector<PSESSION_JAIL_BINDING> m_sessionBuckets;
+        std::deque<std::wstring>           m_paths;
+        std::deque<SESSION_JAIL_BINDING>   m_bindings;
+    };
+
+    std::wstring DeviceInstancePath(size_t index)
+    {
+        return L"HID\\VID_054C&PID_0CE6&MI_03\\7&1C2F3B9A&0&" + std::to_wstring(index);
+    }
+}
+
+TEST(SessionJail, BindsADeviceToSeveralSessions)
+{
+    SessionJail jail;
+    jail.Bind(DeviceInstancePath(1), 2);
+    jail.Bind(DeviceInstancePath(1), 3);
+    jail.Bind(DeviceInstancePath(2), 3);
+    EXPECT_EQ(3u, jail.m_index.count);
+
+    EXPECT_NE(nullptr, jail.Find(DeviceInstancePath(1), 2));
+    EXPECT_NE(nullptr, jail.Find(DeviceInstancePath(1), 3));
+    EXPECT_EQ(nullptr, jail.Find(DeviceInstancePath(1), 4));
+    EXPECT_EQ(nullptr, jail.Find(DeviceInstancePath(2), 2));
+    EXPECT_TRUE(jail.Bound(DeviceInstancePath(1)));
+    EXPECT_TRUE(jail.Bound(DeviceInstancePath(2)));
+    EXPECT_FALSE(jail.Bound(DeviceInstancePath(3)));
+
+    // A prefix of a bound device isn't bound
+    const auto prefix = DeviceInstancePath(1).substr(0, DeviceInstancePath(1).size() - 1);
+    EXPECT_EQ(nullptr, jail.Find(prefix, 2));
+}
+
+TEST(SessionJail, RebindsADeviceToAnotherSession)
+{
+    SessionJail jail;
+    const auto binding = jail.Bind(DeviceInstancePath(1), 2);
+
+    // Bind the new session before unbinding the old one so that the device is never exposed meanwhile
+    jail.Bind(DeviceInstancePath(1), 5);
+    SessionJailRemove(&jail.m_index, binding);
+    EXPECT_EQ(nullptr, jail.Find(DeviceInstancePath(1), 2));
+    EXPECT_NE(nullptr, jail.Find(DeviceInstancePath(1), 5));
+    EXPECT_EQ(1u, jail.m_index.count);
+
+    // Removing a binding that isn't indexed is ignored
+    SessionJailRemove(&jail.m_index, binding);
+    EXPECT_EQ(1u, jail.m_index.count);
+}
+
+TEST(SessionJail, ClearsAllBindingsOfASession)
+{
+    // A single bucket puts the bindings of all sessions in the same chains
+    SessionJail jail(1);
+    for (size_t device = 0; device < 8; ++device) jail.Bind(DeviceInstancePath(device), 2 + static_cast<ULONG>(device % 2));
+
+    size_t removed = 0;
+    PSESSION_JAIL_BINDING binding;
+    while (nullptr != (binding = SessionJailFirstOfSession(&jail.m_index, 2)))
+    {
+        EXPECT_EQ(2u, binding->sessionId);
+        SessionJailRemove(&jail.m_index, binding);
+        ++removed;
+    }
+    EXPECT_EQ(4u, removed);
+    EXPECT_EQ(4u, jail.m_index.count);
+    EXPECT_EQ(nullptr, SessionJailFirstOfSession(&jail.m_index, 2));
+    for (size_t device = 1; device < 8; device += 2) EXPECT_NE(nullptr, jail.Find(DeviceInstancePath(device), 3));
+}
+
+TEST(SessionJail, SessionCheckFindsOnlyTheBoundSessionAtAnyScale)
+{
+    // A cloud-gaming host with a few controllers per session, checked for a device and session pair that is bound, and one that isn't
+    for (const size_t sessions : { size_t{ 1 }, size_t{ 16 }, size_t{ 128 } })
+    {
+        const size_t devicesPerSession = 4;
+        SessionJail jail;
+        for (size_t session = 0; session < sessions; ++session)
+        {
+            for (size_t device = 0; device < devicesPerSession; ++device) jail.Bind(DeviceInstancePath((session * devicesPerSession) + device), static_cast<ULONG>(session + 1));
+        }
+        EXPECT_EQ(sessions * devicesPerSession, jail.m_index.count);
+
+        const auto path = DeviceInstancePath(devicesPerSession * (sessions - 1));
+        EXPECT_NE(nullptr, jail.Find(path, static_cast<ULONG>(sessions)));
+        EXPECT_EQ(nullptr, jail.Find(path, static_cast<ULONG>(sessions + 1)));
+    }
+}
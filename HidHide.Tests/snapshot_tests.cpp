@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "Snapshot.h"
+
+namespace
+{
+    // Configuration snapshot as published by the driver, with a marker that is wiped on cleanup so that a use after cleanup shows
+    struct TestSnapshot
+    {
+        SNAPSHOT_HEADER header;
+        ULONG           value;
+        ULONG           marker;
+    };
+
+    constexpr ULONG LiveMarker = 0x4C495645;
+
+    std::atomic<size_t> s_cleanups{ 0 };
+
+    VOID OnTestSnapshotCleanup(PSNAPSHOT_HEADER header)
+    {
+        auto snapshot = CONTAINING_RECORD(header, TestSnapshot, header);
+        snapshot->marker = 0;
+        ++s_cleanups;
+        delete snapshot;
+    }
+
+    TestSnapshot* CreateSnapshot(ULONG value)
+    {
+        auto snapshot = new TestSnapshot{};
+        SnapshotInitialize(&snapshot->header, OnTestSnapshotCleanup);
+        snapshot->value = value;
+        snapshot->marker = LiveMarker;
+        return (snapshot);
+    }
+
+    TestSnapshot* Acquire(SNAPSHOT_SLOT& slot)
+    {
+        return (CONTAINING_RECORD(SnapshotAcquire(&slot), TestSnapshot, header));
+    }
+}
+
+TEST(Snapshot, PreviousSnapshotIsReleasedAfterItsLastReader)
+{
+    s_cleanups = 0;
+    SNAPSHOT_SLOT slot;
+    SnapshotSlotInitialize(&slot, &CreateSnapshot(1)->header);
+
+    // A reader holding the first snapshot keeps it alive after publishing the second
+    const auto reader = Acquire(slot);
+    EXPECT_EQ(1u, reader->value);
+    SnapshotRelease(SnapshotPublish(&slot, &CreateSnapshot(2)->header));
+    EXPECT_EQ(0u, s_cleanups);
+    EXPECT_EQ(LiveMarker, reader->marker);
+
+    // New readers see the second snapshot
+    const auto next = Acquire(slot);
+    EXPECT_EQ(2u, next->value);
+    SnapshotRelease(&next->header);
+
+    SnapshotRelease(&reader->header);
+    EXPECT_EQ(1u, s_cleanups);
+
+    // Releasing the slot releases the snapshot published
+    SnapshotRelease(slot.current);
+    EXPECT_EQ(2u, s_cleanups);
+}
+
+TEST(Snapshot, OnlyTheSnapshotPublishedIsCurrent)
+{
+    s_cleanups = 0;
+    SNAPSHOT_SLOT slot;
+    SnapshotSlotInitialize(&slot, &CreateSnapshot(1)->header);
+
+    // A reader holding on to a snapshot learns when it got replaced
+    const auto reader = Acquire(slot);
+    EXPECT_TRUE(SnapshotIsCurrent(&slot, &reader->header));
+    SnapshotRelease(SnapshotPublish(&slot, &CreateSnapshot(2)->header));
+    EXPECT_FALSE(SnapshotIsCurrent(&slot, &reader->header));
+    EXPECT_TRUE(SnapshotIsCurrent(&slot, slot.current));
+
+    SnapshotRelease(&reader->header);
+    SnapshotRelease(slot.current);
+    EXPECT_EQ(2u, s_cleanups);
+}
+
+TEST(Snapshot, ConcurrentReadersNeverSeeAReleasedSnapshot)
+{
+    s_cleanups = 0;
+    SNAPSHOT_SLOT slot;
+    SnapshotSlotInitialize(&slot, &CreateSnapshot(0)->header);
+
+    const size_t publishes = 20000;
+    const unsigned readers = (std::max)(2u, std::thread::hardware_concurrency());
+    std::atomic<bool> done{ false };
+    std::atomic<size_t> failures{ 0 };
+    std::vector<std::thread> threads;
+    for (unsigned thread = 0; thread < readers; ++thread)
+    {
+        threads.emplace_back([&]()
+        {
+            ULONG last = 0;
+            while (!done)
+            {
+                // Values are published in increasing order hence a reader should never go back in time
+                const auto snapshot = Acquire(slot);
+                if ((LiveMarker != snapshot->marker) || (snapshot->value < last)) ++failures;
+                last = snapshot->value;
+                SnapshotRelease(&snapshot->header);
+            }
+        });
+    }
+
+    for (ULONG value = 1; value <= publishes; ++value) SnapshotRelease(SnapshotPublish(&slot, &CreateSnapshot(value)->header));
+    done = true;
+    for (auto& thread : threads) thread.join();
+
+    EXPECT_EQ(0u, failures);
+    EXPECT_EQ(publishes, s_cleanups);
+    SnapshotRelease(slot.current);
+    EXPECT_EQ(publishes + 1, s_cleanups);
+}
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: MIT
+#include <windows.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "VerdictCache.h"
+
+namespace
+{
+    VERDICT_CACHE_KEY Key(ULONG processId, LONGLONG processCreateTime = 132000000000000000LL, LONG configurationGeneration = 1, LONG blacklistGeneration = 1)
+    {
+        return (VERDICT_CACHE_KEY{ processId, processCreateTime, configurationGeneration, blacklistGeneration });
+    }
+
+    std::unique_ptr<VERDICT_CACHE> CreateCache()
+    {
+        auto cache = std::make_unique<VERDICT_CACHE>();
+        VerdictCacheInitialize(cache.get());
+        return (cache);
+    }
+}
+
+TEST(VerdictCache, RemembersTheVerdictPerProcess)
+{
+    auto cache = CreateCache();
+    BOOLEAN accessDenied = TRUE;
+
+    auto denied = Key(1000);
+    auto allowed = Key(1004);
+    EXPECT_FALSE(VerdictCacheLookup(cache.get(), &denied, &accessDenied));
+    VerdictCacheStore(cache.get(), &denied, TRUE);
+    VerdictCacheStore(cache.get(), &allowed, FALSE);
+
+    ASSERT_TRUE(VerdictCacheLookup(cache.get(), &denied, &accessDenied));
+    EXPECT_TRUE(accessDenied);
+    ASSERT_TRUE(VerdictCacheLookup(cache.get(), &allowed, &accessDenied));
+    EXPECT_FALSE(accessDenied);
+
+    EXPECT_EQ(2, cache->hits);
+    EXPECT_EQ(1, cache->misses);
+}
+
+TEST(VerdictCache, IgnoresVerdictsOfAnotherConfigurationOrProcessInstance)
+{
+    auto cache = CreateCache();
+    BOOLEAN accessDenied;
+
+    auto key = Key(1000);
+    VerdictCacheStore(cache.get(), &key, TRUE);
+
+    // A configuration or blacklist change makes the verdict stale
+    auto configurationChanged = Key(1000, key.processCreateTime, 2, 1);
+    auto blacklistChanged = Key(1000, key.processCreateTime, 1, 2);
+    EXPECT_FALSE(VerdictCacheLookup(cache.get(), &configurationChanged, &accessDenied));
+    EXPECT_FALSE(VerdictCacheLookup(cache.get(), &blacklistChanged, &accessDenied));
+
+    // A process reusing the process id of one that exited isn't given its verdict
+    auto reused = Key(1000, key.processCreateTime + 1);
+    EXPECT_FALSE(VerdictCacheLookup(cache.get(), &reused, &accessDenied));
+
+    // The verdict remembered last for an entry replaces the one before
+    VerdictCacheStore(cache.get(), &reused, FALSE);
+    EXPECT_FALSE(VerdictCacheLookup(cache.get(), &key, &accessDenied));
+    ASSERT_TRUE(VerdictCacheLookup(cache.get(), &reused, &accessDenied));
+    EXPECT_FALSE(accessDenied);
+}
+
+TEST(VerdictCache, ConcurrentStoresAndLookupsNeverMixUpVerdicts)
+{
+    auto cache = CreateCache();
+    const unsigned threadCount = (std::max)(4u, std::thread::hardware_concurrency());
+    std::atomic<size_t> failures{ 0 };
+    std::vector<std::thread> threads;
+
+    // The verdict is a function of the process id hence a lookup returning another process's verdict shows
+    for (unsigned thread = 0; thread < threadCount; ++thread)
+    {
+        threads.emplace_back([&, thread]()
+        {
+            for (ULONG i = 0; i < 200000; ++i)
+            {
+                auto key = Key(4 * ((i * 7 + thread) % 64), 1000 + (i % 64));
+                const BOOLEAN expected = (0 == ((key.processId / 4) % 3)) ? TRUE : FALSE;
+                BOOLEAN accessDenied;
+                if (VerdictCacheLookup(cache.get(), &key, &accessDenied))
+                {
+                    if (expected != accessDenied) ++failures;
+                }
+                else
+                {
+                    VerdictCacheStore(cache.get(), &key, expected);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    EXPECT_EQ(0u, failures);
+    EXPECT_EQ(static_cast<LONG64>(threadCount) * 200000, cache->hits + cache->misses);
+}
+
+TEST(VerdictCache, RepeatedOpensOfAHandfulOfProcessesAllHit)
+{
+    auto cache = CreateCache();
+    const size_t lookups = 1000;
+
+    // A handful of processes re-opening the same device, as games and input stacks do when polling
+    std::vector<VERDICT_CACHE_KEY> keys;
+    for (ULONG process = 0; process < 4; ++process) keys.push_back(Key(1000 + (4 * process)));
+    for (auto& key : keys) VerdictCacheStore(cache.get(), &key, FALSE);
+
+    size_t hits = 0;
+    BOOLEAN accessDenied;
+    for (size_t i = 0; i < lookups; ++i) hits += VerdictCacheLookup(cache.get(), &keys[i % keys.size()], &accessDenied) ? 1 : 0;
+    EXPECT_EQ(lookups, hits);
+    EXPECT_EQ(static_cast<LONG64>(lookups), cache->hits);
+    EXPECT_EQ(0, cache->misses);
+}
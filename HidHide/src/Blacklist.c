@@ -0,0 +1,179 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// Blacklist.c
+#include "Blacklist.h"
+
+// FNV-1a parameters
+#define BLACKLIST_HASH_BASIS 2166136261UL
+#define BLACKLIST_HASH_PRIME 16777619UL
+
+_Use_decl_annotations_
+VOID BlacklistSplit(const WCHAR* entry, ULONG length, ULONG* deviceInstancePathLength, ULONG* jailSessionId)
+{
+    ULONG   index;
+    ULONG   value;
+    BOOLEAN negative;
+
+    // A delimiter in front (or none at all) means the whole entry is the device instance path
+    for (index = 0; ((index < length) && (BLACKLIST_DELIMITER != entry[index])); index++);
+    *jailSessionId = 0;
+    if ((0 == index) || (length == index))
+    {
+        *deviceInstancePathLength = length;
+        return;
+    }
+    *deviceInstancePathLength = index;
+
+    // Parse the session id the same way RtlUnicodeStringToInteger does in base 10 (leading white space and sign, digits till the first non-digit)
+    for (index++; ((index < length) && (L' ' >= entry[index])); index++);
+    negative = ((index < length) && (L'-' == entry[index]));
+    if ((index < length) && ((L'-' == entry[index]) || (L'+' == entry[index]))) index++;
+    for (value = 0; ((index < length) && (L'0' <= entry[index]) && (L'9' >= entry[index])); index++) value = ((value * 10) + (ULONG)(entry[index] - L'0'));
+    *jailSessionId = (negative ? (ULONG)(0 - value) : value);
+}
+
+_Use_decl_annotations_
+ULONG BlacklistHash(const WCHAR* upcaseDeviceInstancePath, ULONG length)
+{
+    ULONG hash = BLACKLIST_HASH_BASIS;
+
+    for (ULONG index = 0; (index < length); index++) hash = ((hash ^ (ULONG)upcaseDeviceInstancePath[index]) * BLACKLIST_HASH_PRIME);
+    return (hash);
+}
+
+_Use_decl_annotations_
+BOOLEAN BlacklistPathMatch(ULONG hash, const WCHAR* upcaseDeviceInstancePath, ULONG length, ULONG otherHash, const WCHAR* otherUpcaseDeviceInstancePath, ULONG otherLength)
+{
+    ULONG index;
+
+    // Both sides are in upper-case already hence compare the characters as-is, and only when the hashes and lengths match
+    if ((hash != otherHash) || (length != otherLength)) return (FALSE);
+    for (index = 0; ((index < length) && (upcaseDeviceInstancePath[index] == otherUpcaseDeviceInstancePath[index])); index++);
+    return ((index == length) ? TRUE : FALSE);
+}
+
+// Append the upper-case hexadecimal digits of a value of the number of digits provided
+static WCHAR* BlacklistFormatHex(_Out_writes_(digits) WCHAR* buffer, _In_ ULONG value, _In_ ULONG digits)
+{
+    for (ULONG digit = digits; (0 != digit); digit--) buffer[digits - digit] = L"0123456789ABCDEF"[(value >> (4 * (digit - 1))) & 0xF];
+    return (buffer + digits);
+}
+
+_Use_decl_annotations_
+VOID BlacklistFormatContainerId(const GUID* containerId, WCHAR* upcaseContainerId)
+{
+    WCHAR* next;
+
+    // The registry format of a GUID, hence the format of RtlStringFromGUID and of the device manager
+    next = upcaseContainerId;
+    *next++ = L'{';
+    next = BlacklistFormatHex(next, containerId->Data1, 8);
+    *next++ = L'-';
+    next = BlacklistFormatHex(next, containerId->Data2, 4);
+    *next++ = L'-';
+    next = BlacklistFormatHex(next, containerId->Data3, 4);
+    *next++ = L'-';
+    for (ULONG index = 0; (index < 8); index++)
+    {
+        if (2 == index) *next++ = L'-';
+        next = BlacklistFormatHex(next, containerId->Data4[index], 2);
+    }
+    *next = L'}';
+}
+
+_Use_decl_annotations_
+BOOLEAN BlacklistIsPattern(const WCHAR* deviceInstancePath, ULONG length)
+{
+    for (ULONG index = 0; (index < length); index++) if ((BLACKLIST_WILDCARD_ANY == deviceInstancePath[index]) || (BLACKLIST_WILDCARD_ONE == deviceInstancePath[index])) return (TRUE);
+    return (FALSE);
+}
+
+_Use_decl_annotations_
+BOOLEAN BlacklistPatternMatch(PBLACKLIST_RECORD record, const WCHAR* upcaseDeviceInstancePath, ULONG length)
+{
+    const WCHAR* pattern;
+    ULONG        patternIndex;
+    ULONG        index;
+    ULONG        anyIndex;
+    ULONG        anyMark;
+
+    // Advance on both sides while the characters match, and on a mismatch let the last any-wildcard seen absorb one more character
+    pattern = record->upcaseDeviceInstancePath;
+    patternIndex = 0;
+    anyIndex = MAXULONG;
+    anyMark = 0;
+    for (index = 0; (index < length);)
+    {
+        if ((patternIndex < record->length) && ((BLACKLIST_WILDCARD_ONE == pattern[patternIndex]) || (upcaseDeviceInstancePath[index] == pattern[patternIndex])))
+        {
+            patternIndex++;
+            index++;
+        }
+        else if ((patternIndex < record->length) && (BLACKLIST_WILDCARD_ANY == pattern[patternIndex]))
+        {
+            anyIndex = patternIndex++;
+            anyMark = index;
+        }
+        else if (MAXULONG != anyIndex)
+        {
+            patternIndex = (anyIndex + 1);
+            index = ++anyMark;
+        }
+        else
+        {
+            return (FALSE);
+        }
+    }
+
+    // Trailing any-wildcards match the empty remainder
+    for (; ((patternIndex < record->length) && (BLACKLIST_WILDCARD_ANY == pattern[patternIndex])); patternIndex++);
+    return ((patternIndex == record->length) ? TRUE : FALSE);
+}
+
+_Use_decl_annotations_
+PBLACKLIST_RECORD BlacklistPatternFind(PBLACKLIST_RECORD patterns, const WCHAR* upcaseDeviceInstancePath, ULONG length)
+{
+    for (PBLACKLIST_RECORD record = patterns; (NULL != record); record = record->next) if (BlacklistPatternMatch(record, upcaseDeviceInstancePath, length)) return (record);
+    return (NULL);
+}
+
+_Use_decl_annotations_
+VOID BlacklistIndexInitialize(PBLACKLIST_INDEX index, PBLACKLIST_RECORD* buckets, ULONG bucketCount)
+{
+    for (ULONG bucket = 0; (bucket < bucketCount); bucket++) buckets[bucket] = NULL;
+    index->buckets    = buckets;
+    index->bucketMask = (bucketCount - 1);
+    index->count      = 0;
+}
+
+_Use_decl_annotations_
+VOID BlacklistIndexInsert(PBLACKLIST_INDEX index, PBLACKLIST_RECORD record)
+{
+    record->next = index->buckets[record->hash & index->bucketMask];
+    index->buckets[record->hash & index->bucketMask] = record;
+    index->count++;
+}
+
+_Use_decl_annotations_
+VOID BlacklistIndexRemove(PBLACKLIST_INDEX index, PBLACKLIST_RECORD record)
+{
+    PBLACKLIST_RECORD* link;
+
+    for (link = &index->buckets[record->hash & index->bucketMask]; (NULL != *link); link = &(*link)->next)
+    {
+        if (record != *link) continue;
+        *link = record->next;
+        record->next = NULL;
+        index->count--;
+        return;
+    }
+}
+
+_Use_decl_annotations_
+PBLACKLIST_RECORD BlacklistIndexFind(PBLACKLIST_INDEX index, ULONG hash, const WCHAR* upcaseDeviceInstancePath, ULONG length)
+{
+    PBLACKLIST_RECORD record;
+
+    for (record = index->buckets[hash & index->bucketMask]; (NULL != record); record = record->next) if (BlacklistPathMatch(record->hash, record->upcaseDeviceInstancePath, record->length, hash, upcaseDeviceInstancePath, length)) return (record);
+    return (NULL);
+}
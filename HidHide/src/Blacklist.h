@@ -0,0 +1,83 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// Blacklist.h
+#pragma once
+#include "Portable.h"
+
+// Blacklist records split into their upper-case device instance path and jail session id
+
+// Delimiter between the device instance path and the jail session id of a blacklist entry (e.g. HID\VID_054C&PID_09CC\7&1C2F3B9A&0&0000!2)
+#define BLACKLIST_DELIMITER L'!'
+
+// Wildcards turning a blacklist entry into a pattern covering several devices (e.g. HID\VID_054C&PID_0CE6*)
+// The first matches any run of characters (including none), the second any single character
+#define BLACKLIST_WILDCARD_ANY L'*'
+#define BLACKLIST_WILDCARD_ONE L'?'
+
+// The number of characters of a container id in its textual form (e.g. {8C1D6E2A-4F3B-11EE-BE56-0242AC120002})
+// A blacklist entry holding a container id covers every device of the physical device it denotes
+#define BLACKLIST_CONTAINER_ID_LENGTH 38
+
+// Blacklist entry split into its device instance path and jail session id, ready for matching without parsing it again
+typedef struct _BLACKLIST_RECORD
+{
+    struct _BLACKLIST_RECORD* next;                   // Next record in the same hash bucket of an index, or the next pattern
+    const WCHAR*            upcaseDeviceInstancePath; // Device instance path in its upper-case form (not terminated)
+    ULONG                   length;                   // Number of characters of the device instance path
+    ULONG                   hash;                     // Hash over the upper-case device instance path
+    ULONG                   jailSessionId;            // The session still granted access, or zero when there is none
+} BLACKLIST_RECORD, *PBLACKLIST_RECORD;
+
+// Hash index over blacklist records, keyed on the hash of the upper-case device instance path
+// With the load factor kept low, looking up a device instance path costs the same regardless of the number of records
+typedef struct _BLACKLIST_INDEX
+{
+    PBLACKLIST_RECORD*      buckets;
+    ULONG                   bucketMask;
+    ULONG                   count;
+} BLACKLIST_INDEX, *PBLACKLIST_INDEX;
+
+EXTERN_C_START
+
+// Split a blacklist entry into the length of its device instance path and its jail session id (zero when absent)
+VOID BlacklistSplit(_In_reads_(length) const WCHAR* entry, _In_ ULONG length, _Out_ ULONG* deviceInstancePathLength, _Out_ ULONG* jailSessionId);
+
+// Get the hash over an upper-case device instance path
+ULONG BlacklistHash(_In_reads_(length) const WCHAR* upcaseDeviceInstancePath, _In_ ULONG length);
+
+// Are two upper-case device instance paths, given their hashes, the same ?
+_Must_inspect_result_
+BOOLEAN BlacklistPathMatch(_In_ ULONG hash, _In_reads_(length) const WCHAR* upcaseDeviceInstancePath, _In_ ULONG length, _In_ ULONG otherHash, _In_reads_(otherLength) const WCHAR* otherUpcaseDeviceInstancePath, _In_ ULONG otherLength);
+
+// Format a container id in the upper-case textual form, as a blacklist entry holding it reads after folding its case
+VOID BlacklistFormatContainerId(_In_ const GUID* containerId, _Out_writes_(BLACKLIST_CONTAINER_ID_LENGTH) WCHAR* upcaseContainerId);
+
+// Does the device instance path of a blacklist entry hold a wildcard, hence is the entry a pattern ?
+_Must_inspect_result_
+BOOLEAN BlacklistIsPattern(_In_reads_(length) const WCHAR* deviceInstancePath, _In_ ULONG length);
+
+// Does an upper-case device instance path match the upper-case pattern of a record ?
+// Matching takes no recursion, and backtracks to the last any-wildcard seen only
+_Must_inspect_result_
+BOOLEAN BlacklistPatternMatch(_In_ PBLACKLIST_RECORD record, _In_reads_(length) const WCHAR* upcaseDeviceInstancePath, _In_ ULONG length);
+
+// Look for the first pattern matching an upper-case device instance path, on a list of pattern records chained on their next field
+// Returns the record matching, or NULL when none of the patterns match
+_Must_inspect_result_
+PBLACKLIST_RECORD BlacklistPatternFind(_In_opt_ PBLACKLIST_RECORD patterns, _In_reads_(length) const WCHAR* upcaseDeviceInstancePath, _In_ ULONG length);
+
+// Initialize an empty index using the buckets (a power of two) provided
+VOID BlacklistIndexInitialize(_Out_ PBLACKLIST_INDEX index, _Out_writes_(bucketCount) PBLACKLIST_RECORD* buckets, _In_ ULONG bucketCount);
+
+// Add a record to the index (records with the same device instance path are all kept)
+VOID BlacklistIndexInsert(_Inout_ PBLACKLIST_INDEX index, _Inout_ PBLACKLIST_RECORD record);
+
+// Remove a record added earlier from the index
+VOID BlacklistIndexRemove(_Inout_ PBLACKLIST_INDEX index, _In_ PBLACKLIST_RECORD record);
+
+// Look for an upper-case device instance path in the index, given its hash
+// Returns the record matching, or NULL when the device instance path isn't present
+_Must_inspect_result_
+PBLACKLIST_RECORD BlacklistIndexFind(_In_ PBLACKLIST_INDEX index, _In_ ULONG hash, _In_reads_(length) const WCHAR* upcaseDeviceInstancePath, _In_ ULONG length);
+
+EXTERN_C_END
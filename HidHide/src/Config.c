@@ -3,6 +3,10 @@
 // Config.h
 #include "stdafx.h"
 #include "Config.h"
+#include "PidIndex.h"
+#include "PidPresence.h"
+#include "PathTrie.h"
+#include "Blacklist.h"
 #include "Logging.h"
 
 // Assuming that the Lookup collection is constant and not subject to change, some performance can be gained by caching the lookup result
@@ -13,435 +17,1088 @@ typedef enum
     EvaluationCacheNotFound
 } EvaluationCache;
 
-// Binary-tree structure with data payload
-typedef struct _PROCESSIDTREE
+// Every whitelist compiled takes the next whitelist generation hence cached results stamped with another generation are considered empty
+// A cached result is stored as the generation shifted left by two bits combined with the evaluation result
+#define EVALUATION_CACHE_STAMP(generation, evaluationCache) ((((ULONG)(generation)) << 2) | (ULONG)(evaluationCache))
+
+// Interned full image name shared by all processes running the same image
+// The full image name is stored inline at its actual length hence the entry size varies with the image name registered
+// The full image name is followed by its upper-case form so that the whitelist can be matched without case folding
+// As the whitelist is matched on the full image name, the evaluation result is cached here rather than per process
+typedef struct _IMAGENAME
 {
-    ULONG                  pid;
-    WCHAR                  fullImageName[NTSTRSAFE_UNICODE_STRING_MAX_CCH];
+    struct _IMAGENAME*     next;
+    ULONG                  hash;
+    ULONG                  referenceCount;
+    ULONG                  entrySize;
+    volatile LONG          evaluationCache;
     UNICODE_STRING         fullImageNameUnicodeString;
-    EvaluationCache        evaluationCache;
-    struct _PROCESSIDTREE* left;
-    struct _PROCESSIDTREE* right;
-} PROCESSIDTREE, * PPROCESSIDTREE;
+    UNICODE_STRING         upcaseFullImageNameUnicodeString;
+    WCHAR                  fullImageName[ANYSIZE_ARRAY];
+} IMAGENAME, * PIMAGENAME;
+
+// The number of hash buckets of the image name table (a power of two)
+#define IMAGENAME_TABLE_BUCKETS 128
+
+// Hash table with the interned full image names, keyed on the case-insensitive hash of the full image name
+typedef struct _IMAGENAME_TABLE
+{
+    PIMAGENAME             buckets[IMAGENAME_TABLE_BUCKETS];
+    ULONG                  count;
+} IMAGENAME_TABLE, * PIMAGENAME_TABLE;
+
+// Whitelisted full image name in its upper-case form
+typedef struct _WHITELISTENTRY
+{
+    struct _WHITELISTENTRY* next;
+    ULONG                   hash;
+    UNICODE_STRING          upcaseFullImageNameUnicodeString;
+    WCHAR                   upcaseFullImageName[ANYSIZE_ARRAY];
+} WHITELISTENTRY, * PWHITELISTENTRY;
+
+// The whitelist is compiled into a single allocation holding the hash buckets, the folder trie, and the entries
+// The hash is the case-insensitive hash of the full image name, the same hash the image name table is keyed on
+// Entries ending with a separator denote a folder and cover all images within that folder and its sub-folders
+struct _HIDHIDE_WHITELIST
+{
+    volatile LONG          referenceCount;
+    LONG                   generation;
+    PATH_TRIE              folders;
+    ULONG                  count;
+    ULONG                  bucketMask;
+    PWHITELISTENTRY        buckets[ANYSIZE_ARRAY];
+};
+
+// The minimum number of hash buckets of a whitelist (a power of two)
+#define WHITELIST_BUCKETS_MINIMUM 8
+
+// The size needed for a whitelist entry holding a full image name of a given length (incl. terminator), aligned for the next entry
+#define WHITELISTENTRY_SIZE(fullImageNameLengthInBytes) ALIGN_UP_BY((FIELD_OFFSET(WHITELISTENTRY, upcaseFullImageName) + (size_t)(fullImageNameLengthInBytes) + sizeof(WCHAR)), MEMORY_ALLOCATION_ALIGNMENT)
+
+// The blacklist is compiled into a single allocation holding the records, the hash buckets of their index, and their upper-case device instance paths
+struct _HIDHIDE_BLACKLIST
+{
+    volatile LONG          referenceCount;
+    BLACKLIST_INDEX        index;
+    PBLACKLIST_RECORD      patterns; // The records holding a wildcard, in the order of the entries, as these can't be indexed
+    ULONG                  count;
+    BLACKLIST_RECORD       records[ANYSIZE_ARRAY];
+};
+
+// The minimum number of hash buckets of a blacklist (a power of two)
+#define BLACKLIST_BUCKETS_MINIMUM 8
+
+// Process id index node with data payload
+typedef struct _PROCESSIDNODE
+{
+    PID_INDEX_NODE         indexNode;
+    PIMAGENAME             imageName;
+} PROCESSIDNODE, * PPROCESSIDNODE;
+
+// Partition of the process id administration with its own lock and index
+// Lock order: the control device lock, then a shard lock, then the image name table lock
+typedef struct _PROCESSIDSHARD
+{
+    ERESOURCE              resource;
+    PID_INDEX              index;
+} PROCESSIDSHARD, * PPROCESSIDSHARD;
+
+// The static shards used for registering a full load image with a process id
+PROCESSIDSHARD s_ProcessIdShards[HIDHIDE_PROCESS_ID_SHARDS_MAXIMUM];
 
-// The static b-tree used for registering a full load image with a process id
-PPROCESSIDTREE s_ProcessIdToFullLoadImageNameMappingTree = NULL;
+// The number of shards initialized (a power of two) and the mask for selecting a shard
+ULONG s_ProcessIdShardCount = 0;
+ULONG s_ProcessIdShardMask = 0;
+
+// The static table with the full image names referenced by the process id shards, and its lock
+IMAGENAME_TABLE s_ImageNameTable = { { NULL }, 0 };
+ERESOURCE       s_ImageNameTableLock;
+BOOLEAN         s_ImageNameTableLockInitialized = FALSE;
+
+// The last whitelist generation handed out
+volatile LONG s_WhitelistGeneration = 0;
+
+// Pool accounting for the nodes currently allocated (indexed nodes and nodes pending insertion)
+volatile LONG64 s_ProcessIdTreeNodesAllocated = 0;
+volatile LONG64 s_ProcessIdTreeBytesAllocated = 0;
+volatile LONG64 s_ProcessIdTreeNodesHighWaterMark = 0;
+volatile LONG64 s_ProcessIdTreeNodeAllocations = 0;
+
+// Lock-free presence bitmap with a bit per process id registered
+// The bits are only altered while holding the lock on the shard of the process id, but they may be read without holding it
+PID_PRESENCE s_ProcessIdPresence;
+
+// Process id nodes are of a fixed size and allocated and released at the rate processes come and go hence use a dedicated lookaside list
+LOOKASIDE_LIST_EX s_ProcessIdTreeLookasideList;
+BOOLEAN           s_ProcessIdTreeLookasideListInitialized = FALSE;
+
+// Pool accounting for the interned full image names currently allocated
+volatile LONG64 s_ImageNamesAllocated = 0;
+volatile LONG64 s_ImageNameBytesAllocated = 0;
+
+// The entry size needed for holding a full image name of a given length and its upper-case form (both incl. terminator)
+#define IMAGENAME_SIZE(fullImageNameLengthInBytes) (FIELD_OFFSET(IMAGENAME, fullImageName) + (2 * ((size_t)(fullImageNameLengthInBytes) + sizeof(WCHAR))))
+
+// Get the shard responsible for a process id
+static __inline PPROCESSIDSHARD ProcessIdShard(_In_ ULONG pid)
+{
+    return (&s_ProcessIdShards[PID_INDEX_SHARD(pid, s_ProcessIdShardMask)]);
+}
+
+// Get the process id node that embeds the index node provided (NULL when the index node is NULL)
+static __inline PPROCESSIDNODE BstNodeFromIndexNode(_In_opt_ PPID_INDEX_NODE indexNode)
+{
+    return ((NULL == indexNode) ? NULL : CONTAINING_RECORD(indexNode, PROCESSIDNODE, indexNode));
+}
 
 // Unique memory pool tag for the tree
 #define CONFIG_TAG 'fCHH'
 
-// Insert the new node in the tree
-// On success, the tree takes ownership of the node and its cleanup
+// Unique memory pool tag for the image name table
+#define IMAGENAME_TAG 'nIHH'
+
+// Unique memory pool tag for the compiled whitelist
+#define WHITELIST_TAG 'lWHH'
+
+// Unique memory pool tag for the compiled blacklist
+#define BLACKLIST_TAG 'lBHH'
+
+// Look for the full image name in the table and take a reference on it, or add it to the table when not yet present
+// On success, the caller becomes responsible for releasing the reference obtained
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS ImageNameAcquire(_Inout_ PIMAGENAME_TABLE table, _In_ PCUNICODE_STRING fullImageName, _Out_ PIMAGENAME* imageName);
+
+// Release a reference obtained earlier and remove the full image name from the table when it was the last reference
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID ImageNameRelease(_Inout_ PIMAGENAME_TABLE table, _In_ PIMAGENAME imageName);
+
+// Get the cached evaluation result, or EvaluationCacheEmpty when it was evaluated against an older whitelist generation
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+EvaluationCache ImageNameGetEvaluationCache(_In_ PIMAGENAME imageName, _In_ LONG generation);
+
+// Cache the evaluation result for the whitelist generation it was evaluated against
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID ImageNameSetEvaluationCache(_Inout_ PIMAGENAME imageName, _In_ LONG generation, _In_ EvaluationCache evaluationCache);
+
+// Look for the upper-case full image name in the whitelist, given the case-insensitive hash of the full image name
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN WhitelistContains(_In_ PHIDHIDE_WHITELIST whitelist, _In_ ULONG hash, _In_ PCUNICODE_STRING upcaseFullImageName);
+
+// Insert the new node in the index
+// On success, the index takes ownership of the node and its cleanup
 // Return STATUS_ALREADY_INITIALIZED (Error) when the key wasn't unique
 //
 // When memory allocation/deallocation is time consuming, its may be more efficient
 // to first try to lookup an exiting node and then attempt the insert
 //
 // When the change of failure is minimal, it may be more efficent not to do the double
-// overhead of iterating the tree twice but instead do the memory allocation upfront
+// overhead of iterating the index twice but instead do the memory allocation upfront
 // and immediately attempt to insert it
 
 _Must_inspect_result_
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS BstInsert(_Inout_ PPROCESSIDTREE* tree, _In_ PPROCESSIDTREE node);
+NTSTATUS BstInsert(_Inout_ PPID_INDEX index, _In_ PPROCESSIDNODE node);
 
-// Delete a node from the tree (when present)
+// Delete a node from the index (when present)
 // Returns STATUS_PROCESS_IN_JOB (Success) when the key is found and deleted
 // Returns STATUS_PROCESS_NOT_IN_JOB (Success) when the key isn't found
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS BstDelete(_Inout_ PPROCESSIDTREE* tree, _In_ ULONG pid);
+NTSTATUS BstDelete(_Inout_ PPID_INDEX index, _Inout_ PIMAGENAME_TABLE table, _In_ ULONG pid);
 
-// Create a new node for subsequent adding to the tree
+// Create a new node for subsequent adding to the index
+// The node takes over the image name reference provided
 // Returns the node on success or NULL on memory errors
 _Must_inspect_result_
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS BstNewNode(_In_ ULONG pid, _In_ PUNICODE_STRING fullImageName, _Out_ PPROCESSIDTREE* node);
+NTSTATUS BstNewNode(_In_ ULONG pid, _In_ PIMAGENAME imageName, _Out_ PPROCESSIDNODE* node);
+
+// Release a node created earlier along with its image name reference
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID BstFreeNode(_Inout_ PIMAGENAME_TABLE table, _In_ PPROCESSIDNODE node);
 
-// Look for a pid in the tree
+// Look for a pid in the index
 // Returns the node when found or NULL when not found
 _Must_inspect_result_
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-PPROCESSIDTREE BstLookup(_In_opt_ PPROCESSIDTREE tree, _In_ ULONG pid);
+PPROCESSIDNODE BstLookup(_In_ PPID_INDEX index, _In_ ULONG pid);
 
-// To the counter provider add the number of nodes found in the tree provided
+// Cleanup the whole index
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS BstAddCount(_In_opt_ PPROCESSIDTREE tree, _Inout_ rsize_t* count);
+VOID BstCleanup(_Inout_ PPID_INDEX index, _Inout_ PIMAGENAME_TABLE table);
 
-// Cleanup the whole tree
+// Release a node detached from its shard while holding the lock on the image name table
 _IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-VOID BstCleanup(_Inout_ PPROCESSIDTREE* tree);
+_IRQL_requires_max_(APC_LEVEL)
+VOID ProcessIdFreeNode(_In_ PPROCESSIDNODE node);
 
-// Flush the cached results
+// Unregister all process ids of a shard
 _IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-VOID BstFlushEvaluationCache(_In_ PPROCESSIDTREE tree);
+_IRQL_requires_max_(APC_LEVEL)
+VOID ProcessIdShardCleanup(_Inout_ PPROCESSIDSHARD shard);
+
+// Delete the locks on the shards and the image name table initialized so far
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+VOID ProcessIdsDeleteLocks();
 
 _Use_decl_annotations_
-NTSTATUS BstInsert(PPROCESSIDTREE* tree, PPROCESSIDTREE node)
+NTSTATUS ImageNameAcquire(PIMAGENAME_TABLE table, PCUNICODE_STRING fullImageName, PIMAGENAME* imageName)
 {
     TRACE_PERFORMANCE(L"");
 
-    // Validate arguments
-    if ((NULL == tree) || (NULL == node)) return (STATUS_INVALID_PARAMETER);
+    PIMAGENAME temp;
+    ULONG      hash;
+    size_t     size;
+    NTSTATUS   ntstatus;
+
+    // Hash the full image name while ignoring case as that is how the whitelist is matched
+    ntstatus = RtlHashUnicodeString(fullImageName, TRUE, HASH_STRING_ALGORITHM_DEFAULT, &hash);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"RtlHashUnicodeString", ntstatus);
 
-    // When the tree isn't yet containing any nodes then the new node becomes the root
-    if (NULL == *tree)
+    // When the full image name is already known then share the existing entry
+    for (temp = table->buckets[hash & (IMAGENAME_TABLE_BUCKETS - 1)]; (NULL != temp); temp = temp->next)
     {
-        *tree = node;
-        return (STATUS_SUCCESS);
+        if ((hash == temp->hash) && (RtlEqualUnicodeString(fullImageName, &temp->fullImageNameUnicodeString, TRUE)))
+        {
+            temp->referenceCount++;
+            *imageName = temp;
+            return (STATUS_SUCCESS);
+        }
     }
 
-    // Lower nodes go to the left
-    if (node->pid < (*tree)->pid)
+    // Size the entry for the image name provided instead of for the largest image name possible
+    size = IMAGENAME_SIZE(fullImageName->Length);
+
+    // Bail out when memory allocation failed
+#pragma warning(disable: 4996)
+    temp = ExAllocatePoolWithTag(NonPagedPoolNx, size, IMAGENAME_TAG);
+#pragma warning(default: 4996)
+    if (NULL == temp) LOG_AND_RETURN_NTSTATUS(L"ExAllocatePoolWithTag", STATUS_NO_MEMORY);
+
+    // Ensure that the string is terminated
+    RtlZeroMemory(temp, size);
+    temp->hash = hash;
+    temp->referenceCount = 1;
+    temp->entrySize = (ULONG)size;
+
+    // Preserve the string content and append a string terminator
+    ntstatus = RtlStringCchCopyUnicodeStringEx(&temp->fullImageName[0], ((fullImageName->Length / sizeof(WCHAR)) + 1), fullImageName, NULL, NULL, (STRSAFE_NO_TRUNCATION | STRSAFE_NULL_ON_FAILURE));
+    if (!NT_SUCCESS(ntstatus))
+    {
+        ExFreePoolWithTag(temp, IMAGENAME_TAG);
+        LOG_AND_RETURN_NTSTATUS(L"RtlStringCchCopyUnicodeStringEx", ntstatus);
+    }
+    // Construct the unicode string (not an actual copy but a reference to the existing string)
+    ntstatus = RtlUnicodeStringInit(&temp->fullImageNameUnicodeString, &temp->fullImageName[0]);
+    if (!NT_SUCCESS(ntstatus))
     {
-        return (BstInsert(&(*tree)->left, node));
+        ExFreePoolWithTag(temp, IMAGENAME_TAG);
+        LOG_AND_RETURN_NTSTATUS(L"RtlUnicodeStringInit", ntstatus);
     }
 
-    // Higher nodes go to the right
-    if (node->pid > (*tree)->pid)
+    // Fold the case once, here, rather than on every whitelist evaluation (the terminator following it is already in place)
+    temp->upcaseFullImageNameUnicodeString.Buffer = &temp->fullImageName[(fullImageName->Length / sizeof(WCHAR)) + 1];
+    temp->upcaseFullImageNameUnicodeString.Length = 0;
+    temp->upcaseFullImageNameUnicodeString.MaximumLength = temp->fullImageNameUnicodeString.Length;
+    ntstatus = RtlUpcaseUnicodeString(&temp->upcaseFullImageNameUnicodeString, &temp->fullImageNameUnicodeString, FALSE);
+    if (!NT_SUCCESS(ntstatus))
     {
-        return (BstInsert(&(*tree)->right, node));
+        ExFreePoolWithTag(temp, IMAGENAME_TAG);
+        LOG_AND_RETURN_NTSTATUS(L"RtlUpcaseUnicodeString", ntstatus);
     }
 
-    // Not left nor right then its a match and an error as the key needs to be unique
-    return (STATUS_ALREADY_INITIALIZED);
+    // Add the entry to the head of its bucket
+    temp->next = table->buckets[hash & (IMAGENAME_TABLE_BUCKETS - 1)];
+    table->buckets[hash & (IMAGENAME_TABLE_BUCKETS - 1)] = temp;
+    table->count++;
+    InterlockedIncrement64(&s_ImageNamesAllocated);
+    InterlockedExchangeAdd64(&s_ImageNameBytesAllocated, (LONG64)size);
+
+    *imageName = temp;
+    return (STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
-NTSTATUS BstDelete(PPROCESSIDTREE* tree, ULONG pid)
+VOID ImageNameRelease(PIMAGENAME_TABLE table, PIMAGENAME imageName)
 {
     TRACE_PERFORMANCE(L"");
 
-    PPROCESSIDTREE node;
+    PIMAGENAME* link;
 
-    // Validate arguments
-    if (NULL == tree) return (STATUS_INVALID_PARAMETER);
+    // Keep the entry as long as other processes are referring to it
+    if (0 != --imageName->referenceCount) return;
 
-    // When the tree isn't yet containing any nodes then we are done quickly
-    if (NULL == (*tree)) return (STATUS_PROCESS_NOT_IN_JOB);
+    // Unlink the entry from its bucket
+    for (link = &table->buckets[imageName->hash & (IMAGENAME_TABLE_BUCKETS - 1)]; (NULL != *link); link = &(*link)->next)
+    {
+        if (imageName == *link)
+        {
+            *link = imageName->next;
+            table->count--;
+            break;
+        }
+    }
 
-    // All lower keys go to the left
-    if (pid < (*tree)->pid) return (BstDelete(&(*tree)->left, pid));
+    InterlockedDecrement64(&s_ImageNamesAllocated);
+    InterlockedExchangeAdd64(&s_ImageNameBytesAllocated, -(LONG64)imageName->entrySize);
+    ExFreePoolWithTag(imageName, IMAGENAME_TAG);
+}
 
-    // All higher keys go to the right
-    if (pid > (*tree)->pid) return (BstDelete(&(*tree)->right, pid));
+_Use_decl_annotations_
+EvaluationCache ImageNameGetEvaluationCache(PIMAGENAME imageName, LONG generation)
+{
+    TRACE_PERFORMANCE(L"");
+
+    ULONG stamp = (ULONG)ReadAcquire(&imageName->evaluationCache);
 
-    // Not left nor right then its a match
+    // A result cached for another generation is stale
+    if (EVALUATION_CACHE_STAMP(generation, 0) != (stamp & ~3UL)) return (EvaluationCacheEmpty);
+    return ((EvaluationCache)(stamp & 3UL));
+}
 
-    // When the left tree is empty we can detach the node by altering its parent and replace
-    // the reference to the node being deleted by its right tree (which could be empty)
-    // New process ids are typically higher than the previous so better keep the right tree small
-    if (NULL == (*tree)->left)
+_Use_decl_annotations_
+VOID ImageNameSetEvaluationCache(PIMAGENAME imageName, LONG generation, EvaluationCache evaluationCache)
+{
+    TRACE_PERFORMANCE(L"");
+
+    InterlockedExchange(&imageName->evaluationCache, (LONG)EVALUATION_CACHE_STAMP(generation, evaluationCache));
+}
+
+_Use_decl_annotations_
+NTSTATUS HidHideWhitelistCreate(WDFCOLLECTION wdfCollection, PHIDHIDE_WHITELIST* whitelist)
+{
+    TRACE_ALWAYS(L"");
+
+    PHIDHIDE_WHITELIST temp;
+    PWHITELISTENTRY    entry;
+    PPATH_TRIE_NODE*   trieBuckets;
+    PPATH_TRIE_NODE    trieNodes;
+    PUCHAR             next;
+    UNICODE_STRING     fullImageName;
+    ULONG              size;
+    ULONG              buckets;
+    ULONG              trieBucketCount;
+    ULONG              trieNodeCount;
+    ULONG              hash;
+    size_t             allocationSize;
+    NTSTATUS           ntstatus;
+
+    // Size a single allocation for all entries, and count the trie nodes the folder entries may need
+    size = WdfCollectionGetCount(wdfCollection);
+    allocationSize = 0;
+    trieNodeCount = 0;
+    for (ULONG index = 0; (index < size); index++)
     {
-        node = *tree;
-        (*tree) = (*tree)->right;
-        ExFreePoolWithTag(node, CONFIG_TAG);
-        return (STATUS_PROCESS_IN_JOB);
+        WdfStringGetUnicodeString(WdfCollectionGetItem(wdfCollection, index), &fullImageName); // PASSIVE_LEVEL
+        allocationSize += WHITELISTENTRY_SIZE(fullImageName.Length);
+        if (PATH_TRIE_IS_FOLDER(fullImageName.Buffer, (fullImageName.Length / sizeof(WCHAR)))) trieNodeCount += PathTrieNodesNeeded(fullImageName.Buffer, (fullImageName.Length / sizeof(WCHAR)));
     }
 
-    // When the right tree is empty we can detach the node by altering its parent and replace
-    // the reference to the node being deleted by its left tree (which could be empty)
-    if (NULL == (*tree)->right)
+    // Keep the load factor below one half, for both the exact entries and the trie nodes
+    for (buckets = WHITELIST_BUCKETS_MINIMUM; ((buckets / 2) < size); buckets <<= 1);
+    for (trieBucketCount = 1; ((trieBucketCount / 2) < trieNodeCount); trieBucketCount <<= 1);
+
+    // Add the buckets and the trie in front of the entries
+    allocationSize += ALIGN_UP_BY((FIELD_OFFSET(HIDHIDE_WHITELIST, buckets) + (buckets * sizeof(PWHITELISTENTRY))), MEMORY_ALLOCATION_ALIGNMENT);
+    allocationSize += ALIGN_UP_BY((trieBucketCount * sizeof(PPATH_TRIE_NODE)), MEMORY_ALLOCATION_ALIGNMENT);
+    allocationSize += ALIGN_UP_BY((trieNodeCount * sizeof(PATH_TRIE_NODE)), MEMORY_ALLOCATION_ALIGNMENT);
+
+    // Bail out when memory allocation failed
+#pragma warning(disable: 4996)
+    temp = ExAllocatePoolWithTag(NonPagedPoolNx, allocationSize, WHITELIST_TAG);
+#pragma warning(default: 4996)
+    if (NULL == temp) LOG_AND_RETURN_NTSTATUS(L"ExAllocatePoolWithTag", STATUS_NO_MEMORY);
+    RtlZeroMemory(temp, allocationSize);
+    temp->referenceCount = 1;
+    temp->generation = InterlockedIncrement(&s_WhitelistGeneration);
+    temp->bucketMask = (buckets - 1);
+    next = ((PUCHAR)temp + ALIGN_UP_BY((FIELD_OFFSET(HIDHIDE_WHITELIST, buckets) + (buckets * sizeof(PWHITELISTENTRY))), MEMORY_ALLOCATION_ALIGNMENT));
+    trieBuckets = (PPATH_TRIE_NODE*)next;
+    next += ALIGN_UP_BY((trieBucketCount * sizeof(PPATH_TRIE_NODE)), MEMORY_ALLOCATION_ALIGNMENT);
+    trieNodes = (PPATH_TRIE_NODE)next;
+    next += ALIGN_UP_BY((trieNodeCount * sizeof(PATH_TRIE_NODE)), MEMORY_ALLOCATION_ALIGNMENT);
+    PathTrieInitialize(&temp->folders, trieBuckets, trieBucketCount, trieNodes, trieNodeCount);
+
+    // Fold the case of every full image name once and file it under the same hash the image name table uses
+    for (ULONG index = 0; (index < size); index++)
     {
-        node = *tree;
-        (*tree) = (*tree)->left;
-        ExFreePoolWithTag(node, CONFIG_TAG);
-        return (STATUS_PROCESS_IN_JOB);
+        WdfStringGetUnicodeString(WdfCollectionGetItem(wdfCollection, index), &fullImageName); // PASSIVE_LEVEL
+        ntstatus = RtlHashUnicodeString(&fullImageName, TRUE, HASH_STRING_ALGORITHM_DEFAULT, &hash);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            ExFreePoolWithTag(temp, WHITELIST_TAG);
+            LOG_AND_RETURN_NTSTATUS(L"RtlHashUnicodeString", ntstatus);
+        }
+
+        entry = (PWHITELISTENTRY)next;
+        entry->hash = hash;
+        entry->upcaseFullImageNameUnicodeString.Buffer = &entry->upcaseFullImageName[0];
+        entry->upcaseFullImageNameUnicodeString.MaximumLength = fullImageName.Length;
+        ntstatus = RtlUpcaseUnicodeString(&entry->upcaseFullImageNameUnicodeString, &fullImageName, FALSE);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            ExFreePoolWithTag(temp, WHITELIST_TAG);
+            LOG_AND_RETURN_NTSTATUS(L"RtlUpcaseUnicodeString", ntstatus);
+        }
+
+        // Folder entries go into the trie, which refers to the upper-case path kept in the entry
+        if (PATH_TRIE_IS_FOLDER(entry->upcaseFullImageName, (fullImageName.Length / sizeof(WCHAR))))
+        {
+            if (!PathTrieInsertFolder(&temp->folders, entry->upcaseFullImageName, (fullImageName.Length / sizeof(WCHAR))))
+            {
+                ExFreePoolWithTag(temp, WHITELIST_TAG);
+                LOG_AND_RETURN_NTSTATUS(L"PathTrieInsertFolder", STATUS_INTERNAL_ERROR);
+            }
+            next += WHITELISTENTRY_SIZE(fullImageName.Length);
+            continue;
+        }
+
+        // Skip duplicates (the space reserved for them remains unused)
+        if (WhitelistContains(temp, hash, &entry->upcaseFullImageNameUnicodeString)) continue;
+        entry->next = temp->buckets[hash & temp->bucketMask];
+        temp->buckets[hash & temp->bucketMask] = entry;
+        temp->count++;
+        next += WHITELISTENTRY_SIZE(fullImageName.Length);
     }
 
-    // The node to delete has a left and right tree so in its right branch find the lowest node,
-    // attach the left tree to it, and move the root to the first node on the right
-    for (node = (*tree)->right; (NULL != node->left); node = node->left);
-    node->left = (*tree)->left;
-    node = (*tree);
-    (*tree) = (*tree)->right;
-    ExFreePoolWithTag(node, CONFIG_TAG);
-    return (STATUS_PROCESS_IN_JOB);
+    *whitelist = temp;
+    return (STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
- NTSTATUS BstNewNode(ULONG pid, PUNICODE_STRING fullImageName, PPROCESSIDTREE* node)
+PHIDHIDE_WHITELIST HidHideWhitelistReference(PHIDHIDE_WHITELIST whitelist)
 {
     TRACE_PERFORMANCE(L"");
 
-    PPROCESSIDTREE temp;
-    NTSTATUS       ntstatus;
+    InterlockedIncrement(&whitelist->referenceCount);
+    return (whitelist);
+}
+
+_Use_decl_annotations_
+VOID HidHideWhitelistDelete(PHIDHIDE_WHITELIST whitelist)
+{
+    TRACE_ALWAYS(L"");
+
+    if ((NULL != whitelist) && (0 == InterlockedDecrement(&whitelist->referenceCount))) ExFreePoolWithTag(whitelist, WHITELIST_TAG);
+}
+
+_Use_decl_annotations_
+NTSTATUS HidHideBlacklistCreate(WDFCOLLECTION wdfCollection, PHIDHIDE_BLACKLIST* blacklist)
+{
+    TRACE_ALWAYS(L"");
+
+    PHIDHIDE_BLACKLIST temp;
+    PBLACKLIST_RECORD  record;
+    PBLACKLIST_RECORD* patternTail;
+    PWCHAR             next;
+    UNICODE_STRING     entry;
+    UNICODE_STRING     deviceInstancePath;
+    UNICODE_STRING     upcaseDeviceInstancePath;
+    ULONG              size;
+    ULONG              buckets;
+    ULONG              length;
+    ULONG              jailSessionId;
+    size_t             allocationSize;
+    NTSTATUS           ntstatus;
+
+    // Size a single allocation for the records, the buckets (keeping the load factor below one half), and the device instance paths (the jail session ids aren't kept as text)
+    size = WdfCollectionGetCount(wdfCollection);
+    for (buckets = BLACKLIST_BUCKETS_MINIMUM; ((buckets / 2) < size); buckets <<= 1);
+    allocationSize = ALIGN_UP_BY((FIELD_OFFSET(HIDHIDE_BLACKLIST, records) + (size * sizeof(BLACKLIST_RECORD))), MEMORY_ALLOCATION_ALIGNMENT);
+    allocationSize += ALIGN_UP_BY((buckets * sizeof(PBLACKLIST_RECORD)), MEMORY_ALLOCATION_ALIGNMENT);
+    for (ULONG index = 0; (index < size); index++)
+    {
+        WdfStringGetUnicodeString(WdfCollectionGetItem(wdfCollection, index), &entry); // PASSIVE_LEVEL
+        allocationSize += entry.Length;
+    }
 
     // Bail out when memory allocation failed
 #pragma warning(disable: 4996)
-    temp = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(*temp), CONFIG_TAG);
+    temp = ExAllocatePoolWithTag(NonPagedPoolNx, allocationSize, BLACKLIST_TAG);
 #pragma warning(default: 4996)
     if (NULL == temp) LOG_AND_RETURN_NTSTATUS(L"ExAllocatePoolWithTag", STATUS_NO_MEMORY);
+    RtlZeroMemory(temp, allocationSize);
+    temp->referenceCount = 1;
+    next = (PWCHAR)((PUCHAR)temp + ALIGN_UP_BY((FIELD_OFFSET(HIDHIDE_BLACKLIST, records) + (size * sizeof(BLACKLIST_RECORD))), MEMORY_ALLOCATION_ALIGNMENT));
+    BlacklistIndexInitialize(&temp->index, (PBLACKLIST_RECORD*)next, buckets);
+    next = (PWCHAR)((PUCHAR)next + ALIGN_UP_BY((buckets * sizeof(PBLACKLIST_RECORD)), MEMORY_ALLOCATION_ALIGNMENT));
+    patternTail = &temp->patterns;
+
+    // Split every entry once, fold the case of its device instance path, and hash it
+    for (ULONG index = 0; (index < size); index++)
+    {
+        WdfStringGetUnicodeString(WdfCollectionGetItem(wdfCollection, index), &entry); // PASSIVE_LEVEL
+        BlacklistSplit(entry.Buffer, (entry.Length / sizeof(WCHAR)), &length, &jailSessionId);
+        if (0 == length) continue;
+        deviceInstancePath.Buffer = entry.Buffer;
+        deviceInstancePath.Length = (USHORT)(length * sizeof(WCHAR));
+        deviceInstancePath.MaximumLength = deviceInstancePath.Length;
+        upcaseDeviceInstancePath.Buffer = next;
+        upcaseDeviceInstancePath.Length = 0;
+        upcaseDeviceInstancePath.MaximumLength = deviceInstancePath.Length;
+        ntstatus = RtlUpcaseUnicodeString(&upcaseDeviceInstancePath, &deviceInstancePath, FALSE);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            ExFreePoolWithTag(temp, BLACKLIST_TAG);
+            LOG_AND_RETURN_NTSTATUS(L"RtlUpcaseUnicodeString", ntstatus);
+        }
 
-    // Ensure that the left and right pointers are NULL and the string is terminated
-    RtlZeroMemory(temp, sizeof(*temp));
-    temp->pid = pid;
+        record = &temp->records[temp->count];
+        record->upcaseDeviceInstancePath = next;
+        record->length = length;
+        record->hash = BlacklistHash(next, length);
+        record->jailSessionId = jailSessionId;
 
-    // Preserve the string content and append a string terminator
-    ntstatus = RtlStringCchCopyUnicodeStringEx(&temp->fullImageName[0], _countof(temp->fullImageName), fullImageName, NULL, NULL, (STRSAFE_NO_TRUNCATION | STRSAFE_NULL_ON_FAILURE));
-    if (!NT_SUCCESS(ntstatus))
-    {
-        ExFreePoolWithTag(temp, CONFIG_TAG);
-        LOG_AND_RETURN_NTSTATUS(L"RtlStringCchCopyUnicodeStringEx", ntstatus);
+        // Patterns are kept aside, in the order of the entries and duplicates included, and only consulted when no entry matches exactly
+        if (BlacklistIsPattern(next, length))
+        {
+            *patternTail = record;
+            patternTail = &record->next;
+            temp->count++;
+            next += length;
+            continue;
+        }
+
+        // Skip duplicate device instance paths as the first entry for a path determines its jail session (the space reserved for them remains unused)
+        if (NULL != BlacklistIndexFind(&temp->index, record->hash, next, length)) continue;
+        BlacklistIndexInsert(&temp->index, record);
+        temp->count++;
+        next += length;
     }
-    // Construct the unicode string (not an actual copy but a reference to the existing string)
-    ntstatus = RtlUnicodeStringInit(&temp->fullImageNameUnicodeString, &temp->fullImageName[0]);
-    if (!NT_SUCCESS(ntstatus))
+
+    *blacklist = temp;
+    return (STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+PHIDHIDE_BLACKLIST HidHideBlacklistReference(PHIDHIDE_BLACKLIST blacklist)
+{
+    TRACE_PERFORMANCE(L"");
+
+    InterlockedIncrement(&blacklist->referenceCount);
+    return (blacklist);
+}
+
+_Use_decl_annotations_
+VOID HidHideBlacklistDelete(PHIDHIDE_BLACKLIST blacklist)
+{
+    TRACE_ALWAYS(L"");
+
+    if ((NULL != blacklist) && (0 == InterlockedDecrement(&blacklist->referenceCount))) ExFreePoolWithTag(blacklist, BLACKLIST_TAG);
+}
+
+_Use_decl_annotations_
+BOOLEAN HidHideBlacklistContains(PHIDHIDE_BLACKLIST blacklist, ULONG hash, PCUNICODE_STRING upcaseDeviceInstancePath, ULONG* jailSessionId)
+{
+    TRACE_PERFORMANCE(L"");
+
+    PBLACKLIST_RECORD record;
+
+    // An entry matching exactly takes precedence over the patterns, which are tried in the order of the entries
+    record = BlacklistIndexFind(&blacklist->index, hash, upcaseDeviceInstancePath->Buffer, (upcaseDeviceInstancePath->Length / sizeof(WCHAR)));
+    if (NULL == record) record = BlacklistPatternFind(blacklist->patterns, upcaseDeviceInstancePath->Buffer, (upcaseDeviceInstancePath->Length / sizeof(WCHAR)));
+    *jailSessionId = ((NULL == record) ? 0 : record->jailSessionId);
+    return ((NULL == record) ? FALSE : TRUE);
+}
+
+_Use_decl_annotations_
+BOOLEAN WhitelistContains(PHIDHIDE_WHITELIST whitelist, ULONG hash, PCUNICODE_STRING upcaseFullImageName)
+{
+    TRACE_PERFORMANCE(L"");
+
+    PWHITELISTENTRY entry;
+
+    // Both sides are in upper-case already hence compare case-sensitive, and only when the hashes match
+    for (entry = whitelist->buckets[hash & whitelist->bucketMask]; (NULL != entry); entry = entry->next)
     {
-        ExFreePoolWithTag(temp, CONFIG_TAG);
-        LOG_AND_RETURN_NTSTATUS(L"RtlUnicodeStringInit", ntstatus);
+        if ((hash == entry->hash) && (RtlEqualUnicodeString(upcaseFullImageName, &entry->upcaseFullImageNameUnicodeString, FALSE))) return (TRUE);
     }
 
-    *node = temp;
+    return (FALSE);
+}
+
+_Use_decl_annotations_
+NTSTATUS BstInsert(PPID_INDEX index, PPROCESSIDNODE node)
+{
+    TRACE_PERFORMANCE(L"");
+
+    // Validate arguments
+    if ((NULL == index) || (NULL == node)) return (STATUS_INVALID_PARAMETER);
+
+    // The index rebalances itself hence monotonic increasing process ids don't degrade it into a list
+    if (!PidIndexInsert(index, &node->indexNode)) return (STATUS_ALREADY_INITIALIZED);
+
     return (STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
-PPROCESSIDTREE BstLookup(PPROCESSIDTREE tree, ULONG pid)
+NTSTATUS BstDelete(PPID_INDEX index, PIMAGENAME_TABLE table, ULONG pid)
 {
     TRACE_PERFORMANCE(L"");
 
-    if ((NULL != tree) && (tree->pid < pid)) return (BstLookup(tree->right, pid));
-    if ((NULL != tree) && (tree->pid > pid)) return (BstLookup(tree->left, pid));
-    return (tree);
+    PPROCESSIDNODE node;
+
+    // Validate arguments
+    if (NULL == index) return (STATUS_INVALID_PARAMETER);
+
+    // Detach the node from the index and release it
+    node = BstNodeFromIndexNode(PidIndexDelete(index, pid));
+    if (NULL == node) return (STATUS_PROCESS_NOT_IN_JOB);
+    BstFreeNode(table, node);
+
+    return (STATUS_PROCESS_IN_JOB);
 }
 
 _Use_decl_annotations_
-NTSTATUS BstAddCount(PPROCESSIDTREE tree, rsize_t* count)
+NTSTATUS BstNewNode(ULONG pid, PIMAGENAME imageName, PPROCESSIDNODE* node)
 {
     TRACE_PERFORMANCE(L"");
 
-    if (NULL != tree)
+    PPROCESSIDNODE temp;
+    LONG64         nodesAllocated;
+    LONG64         highWaterMark;
+
+    // Bail out when memory allocation failed
+    temp = ExAllocateFromLookasideListEx(&s_ProcessIdTreeLookasideList);
+    if (NULL == temp) LOG_AND_RETURN_NTSTATUS(L"ExAllocateFromLookasideListEx", STATUS_NO_MEMORY);
+
+    // Initialize the fields explicitly as the node may be recycled
+    temp->indexNode.left = NULL;
+    temp->indexNode.right = NULL;
+    temp->indexNode.key = pid;
+    temp->indexNode.height = 0;
+    temp->imageName = imageName;
+    nodesAllocated = InterlockedIncrement64(&s_ProcessIdTreeNodesAllocated);
+    InterlockedExchangeAdd64(&s_ProcessIdTreeBytesAllocated, (LONG64)sizeof(PROCESSIDNODE));
+    InterlockedIncrement64(&s_ProcessIdTreeNodeAllocations);
+
+    // Keep track of the highest number of nodes in use at the same time
+    for (highWaterMark = ReadNoFence64(&s_ProcessIdTreeNodesHighWaterMark); (nodesAllocated > highWaterMark); highWaterMark = ReadNoFence64(&s_ProcessIdTreeNodesHighWaterMark))
     {
-        (*count)++;
-        BstAddCount(tree->left, count);
-        BstAddCount(tree->right, count);
+        if (highWaterMark == InterlockedCompareExchange64(&s_ProcessIdTreeNodesHighWaterMark, nodesAllocated, highWaterMark)) break;
     }
+
+    *node = temp;
     return (STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
-VOID BstCleanup(PPROCESSIDTREE* tree)
+VOID BstFreeNode(PIMAGENAME_TABLE table, PPROCESSIDNODE node)
+{
+    TRACE_PERFORMANCE(L"");
+
+    ImageNameRelease(table, node->imageName);
+    InterlockedDecrement64(&s_ProcessIdTreeNodesAllocated);
+    InterlockedExchangeAdd64(&s_ProcessIdTreeBytesAllocated, -(LONG64)sizeof(PROCESSIDNODE));
+    ExFreeToLookasideListEx(&s_ProcessIdTreeLookasideList, node);
+}
+
+_Use_decl_annotations_
+PPROCESSIDNODE BstLookup(PPID_INDEX index, ULONG pid)
+{
+    TRACE_PERFORMANCE(L"");
+
+    return (BstNodeFromIndexNode(PidIndexLookup(index, pid)));
+}
+
+_Use_decl_annotations_
+VOID BstCleanup(PPID_INDEX index, PIMAGENAME_TABLE table)
 {
     TRACE_PERFORMANCE(L"");
 
-    if (NULL != *tree)
+    PPROCESSIDNODE node;
+
+    // Repeatedly detach the root as that never requires rebalancing a deep path
+    while (NULL != index->root)
     {
-        BstCleanup(&(*tree)->left);
-        BstCleanup(&(*tree)->right);
-        ExFreePoolWithTag(*tree, CONFIG_TAG);
-        *tree = NULL;
+        node = BstNodeFromIndexNode(PidIndexDelete(index, index->root->key));
+        if (NULL == node) break;
+        BstFreeNode(table, node);
     }
 }
 
 _Use_decl_annotations_
-VOID BstFlushEvaluationCache(PPROCESSIDTREE tree)
+VOID ProcessIdFreeNode(PPROCESSIDNODE node)
 {
     TRACE_PERFORMANCE(L"");
 
-    if (NULL != tree)
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_ImageNameTableLock);
+    BstFreeNode(&s_ImageNameTable, node);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_ImageNameTableLock);
+}
+
+_Use_decl_annotations_
+VOID ProcessIdShardCleanup(PPROCESSIDSHARD shard)
+{
+    TRACE_PERFORMANCE(L"");
+
+    PPROCESSIDNODE node;
+
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&shard->resource);
+
+    // Repeatedly detach the root as that never requires rebalancing a deep path
+    while (NULL != shard->index.root)
     {
-        BstFlushEvaluationCache(tree->left);
-        BstFlushEvaluationCache(tree->right);
-        tree->evaluationCache = EvaluationCacheEmpty;
+        node = BstNodeFromIndexNode(PidIndexDelete(&shard->index, shard->index.root->key));
+        if (NULL == node) break;
+        if (PID_PRESENCE_TRACKED(node->indexNode.key)) PidPresenceUpdate(&s_ProcessIdPresence, node->indexNode.key, FALSE);
+        ProcessIdFreeNode(node);
     }
+
+    ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
 }
 
 _Use_decl_annotations_
-NTSTATUS HidHideProcessIdRegister(WDFWAITLOCK wdfWaitLock, HANDLE processId, PUNICODE_STRING fullImageName)
+VOID ProcessIdsDeleteLocks()
 {
-    TRACE_PERFORMANCE(L"");
+    TRACE_ALWAYS(L"");
 
-    PPROCESSIDTREE node;
-    NTSTATUS       ntstatus;
+    for (; (s_ProcessIdShardCount > 0); s_ProcessIdShardCount--) ExDeleteResourceLite(&s_ProcessIdShards[s_ProcessIdShardCount - 1].resource);
+    s_ProcessIdShardMask = 0;
+    if (s_ImageNameTableLockInitialized)
+    {
+        ExDeleteResourceLite(&s_ImageNameTableLock);
+        s_ImageNameTableLockInitialized = FALSE;
+    }
+}
 
-    WdfWaitLockAcquire(wdfWaitLock, NULL);
+_Use_decl_annotations_
+NTSTATUS HidHideProcessIdsInitialize(ULONG shardCount)
+{
+    TRACE_ALWAYS(L"");
+
+    ULONG    count;
+    WCHAR    message[LOGGING_MESSAGE_MAXIMUM_SIZE];
+    NTSTATUS ntstatus;
 
-    // Do nothing when the pid is already registered
-    node = BstLookup(s_ProcessIdToFullLoadImageNameMappingTree, PROCESS_HANDLE_TO_PROCESS_ID(processId));
-    if (NULL != node)
+    // Round the shard count requested up to a power of two so that a shard can be selected with a mask
+    for (count = 1; ((count < shardCount) && (count < HIDHIDE_PROCESS_ID_SHARDS_MAXIMUM)); count <<= 1);
+
+    // The image name table is shared by all shards hence has a lock of its own
+    ntstatus = ExInitializeResourceLite(&s_ImageNameTableLock);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"ExInitializeResourceLite", ntstatus);
+    s_ImageNameTableLockInitialized = TRUE;
+
+    // Prepare the shards, each with its own lock and index
+    for (s_ProcessIdShardCount = 0; (s_ProcessIdShardCount < count); s_ProcessIdShardCount++)
     {
-        WdfWaitLockRelease(wdfWaitLock);
-        return (STATUS_PROCESS_IN_JOB);
+        ntstatus = ExInitializeResourceLite(&s_ProcessIdShards[s_ProcessIdShardCount].resource);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            ProcessIdsDeleteLocks();
+            LOG_AND_RETURN_NTSTATUS(L"ExInitializeResourceLite", ntstatus);
+        }
+        PidIndexInitialize(&s_ProcessIdShards[s_ProcessIdShardCount].index);
     }
+    s_ProcessIdShardMask = (count - 1);
 
-    // Create a new node for storage
-    ntstatus = BstNewNode(PROCESS_HANDLE_TO_PROCESS_ID(processId), fullImageName, &node);
+    // Use the system default depth as the system tunes it to the actual allocation rate
+    ntstatus = ExInitializeLookasideListEx(&s_ProcessIdTreeLookasideList, NULL, NULL, NonPagedPoolNx, 0, sizeof(PROCESSIDNODE), CONFIG_TAG, 0);
     if (!NT_SUCCESS(ntstatus))
     {
-        WdfWaitLockRelease(wdfWaitLock);
-        return (ntstatus);
+        ProcessIdsDeleteLocks();
+        LOG_AND_RETURN_NTSTATUS(L"ExInitializeLookasideListEx", ntstatus);
     }
+    s_ProcessIdTreeLookasideListInitialized = TRUE;
 
-    // Attempt to insert the node
-    ntstatus = BstInsert(&s_ProcessIdToFullLoadImageNameMappingTree, node);
+    if (NT_SUCCESS(RtlStringCchPrintfW(&message[0], _countof(message), L"Process id administration partitioned into %u shards", count))) TRACE_ALWAYS(message);
+
+    return (STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+VOID HidHideProcessIdsTerminate()
+{
+    TRACE_ALWAYS(L"");
+
+    HIDHIDE_PROCESS_ID_STATISTICS statistics;
+    WCHAR                         message[LOGGING_MESSAGE_MAXIMUM_SIZE];
+
+    if (!s_ProcessIdTreeLookasideListInitialized) return;
+
+    // Report how well the lookaside list performed over the lifetime of the driver
+    HidHideProcessIdsGetStatistics(&statistics);
+    if (NT_SUCCESS(RtlStringCchPrintfW(&message[0], _countof(message), L"Process id nodes high-water mark %I64d, allocations %I64d", statistics.nodesHighWaterMark, statistics.allocations))) TRACE_ALWAYS(message);
+
+    // The notifications are no longer active hence the shards can be drained one after the other
+    HidHideProcessIdsCleanup();
+    PidPresenceInitialize(&s_ProcessIdPresence);
+    ExDeleteLookasideListEx(&s_ProcessIdTreeLookasideList);
+    s_ProcessIdTreeLookasideListInitialized = FALSE;
+    ProcessIdsDeleteLocks();
+}
+
+_Use_decl_annotations_
+VOID HidHideProcessIdsGetStatistics(HIDHIDE_PROCESS_ID_STATISTICS* statistics)
+{
+    TRACE_PERFORMANCE(L"");
+
+    statistics->nodesAllocated = ReadNoFence64(&s_ProcessIdTreeNodesAllocated);
+    statistics->nodesHighWaterMark = ReadNoFence64(&s_ProcessIdTreeNodesHighWaterMark);
+    statistics->allocations = ReadNoFence64(&s_ProcessIdTreeNodeAllocations);
+    statistics->shards = s_ProcessIdShardCount;
+}
+
+_Use_decl_annotations_
+NTSTATUS HidHideProcessIdRegister(HANDLE processId, PUNICODE_STRING fullImageName)
+{
+    TRACE_PERFORMANCE(L"");
+
+    PPROCESSIDSHARD shard;
+    PPROCESSIDNODE  node;
+    PIMAGENAME      imageName;
+    ULONG           pid;
+    NTSTATUS        ntstatus;
+
+    // Do nothing when the pid is already registered, and avoid taking the lock for finding out
+    pid = PROCESS_HANDLE_TO_PROCESS_ID(processId);
+    if ((PID_PRESENCE_TRACKED(pid)) && (PidPresenceTest(&s_ProcessIdPresence, pid))) return (STATUS_PROCESS_IN_JOB);
+
+    // Do nothing when the pid is already registered (process ids outside the presence bitmap)
+    shard = ProcessIdShard(pid);
+    ExEnterCriticalRegionAndAcquireResourceShared(&shard->resource);
+    node = BstLookup(&shard->index, pid);
+    ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
+    if (NULL != node) return (STATUS_PROCESS_IN_JOB);
+
+    // Share the full image name with the other processes running the same image
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_ImageNameTableLock);
+    ntstatus = ImageNameAcquire(&s_ImageNameTable, fullImageName, &imageName);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_ImageNameTableLock);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+
+    // Create a new node for storage before taking the shard lock so that the lock is held as short as possible
+    ntstatus = BstNewNode(pid, imageName, &node);
     if (!NT_SUCCESS(ntstatus))
     {
-        ExFreePoolWithTag(node, CONFIG_TAG);
-        WdfWaitLockRelease(wdfWaitLock);
+        ExEnterCriticalRegionAndAcquireResourceExclusive(&s_ImageNameTableLock);
+        ImageNameRelease(&s_ImageNameTable, imageName);
+        ExReleaseResourceAndLeaveCriticalRegion(&s_ImageNameTableLock);
         return (ntstatus);
     }
 
-    WdfWaitLockRelease(wdfWaitLock);
+    // Attempt to insert the node
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&shard->resource);
+    ntstatus = BstInsert(&shard->index, node);
+    if ((NT_SUCCESS(ntstatus)) && (PID_PRESENCE_TRACKED(pid))) PidPresenceUpdate(&s_ProcessIdPresence, pid, TRUE);
+    ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
+
+    // Another thread may have registered the same pid in the meantime
+    if (!NT_SUCCESS(ntstatus))
+    {
+        ProcessIdFreeNode(node);
+        return ((STATUS_ALREADY_INITIALIZED == ntstatus) ? STATUS_PROCESS_IN_JOB : ntstatus);
+    }
 
     return (STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
-NTSTATUS HidHideProcessIdUnregister(WDFWAITLOCK wdfWaitLock, HANDLE processId)
+NTSTATUS HidHideProcessIdUnregister(HANDLE processId)
 {
     TRACE_PERFORMANCE(L"");
 
-    NTSTATUS ntstatus;
+    PPROCESSIDSHARD shard;
+    PPROCESSIDNODE  node;
+    ULONG           pid;
+
+    // Processes that were never registered needn't take the lock
+    pid = PROCESS_HANDLE_TO_PROCESS_ID(processId);
+    if ((PID_PRESENCE_TRACKED(pid)) && (!PidPresenceTest(&s_ProcessIdPresence, pid))) return (STATUS_SUCCESS);
 
-    WdfWaitLockAcquire(wdfWaitLock, NULL);
-    ntstatus = BstDelete(&s_ProcessIdToFullLoadImageNameMappingTree, PROCESS_HANDLE_TO_PROCESS_ID(processId));
-    WdfWaitLockRelease(wdfWaitLock);
-    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"BstDelete", ntstatus);
+    // Detach the node while holding the shard lock, and release it after the shard lock is released
+    shard = ProcessIdShard(pid);
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&shard->resource);
+    node = BstNodeFromIndexNode(PidIndexDelete(&shard->index, pid));
+    if ((NULL != node) && (PID_PRESENCE_TRACKED(pid))) PidPresenceUpdate(&s_ProcessIdPresence, pid, FALSE);
+    ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
+    if (NULL != node) ProcessIdFreeNode(node);
 
     return (STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
-NTSTATUS HidHideProcessIdCheckFullImageNameAgainstWhitelist(WDFWAITLOCK wdfWaitLock, HANDLE processId, WDFCOLLECTION wdfCollection, BOOLEAN* cacheHit)
+NTSTATUS HidHideProcessIdCheckFullImageNameAgainstWhitelist(HANDLE processId, PHIDHIDE_WHITELIST whitelist, BOOLEAN* cacheHit)
 {
     TRACE_PERFORMANCE(L"");
 
-    PPROCESSIDTREE node;
-    UNICODE_STRING fullImageName;
+    PPROCESSIDSHARD shard;
+    PPROCESSIDNODE  node;
+    PIMAGENAME      imageName;
+    ULONG           pid;
+    LONG            generation;
+    EvaluationCache evaluationCache;
 
     // Validate arguments
-    if (NULL == cacheHit) return (STATUS_INVALID_PARAMETER);
+    if ((NULL == whitelist) || (NULL == cacheHit)) return (STATUS_INVALID_PARAMETER);
+
+    // When the process id isn't known there is no need to take the lock
+    pid = PROCESS_HANDLE_TO_PROCESS_ID(processId);
+    if ((PID_PRESENCE_TRACKED(pid)) && (!PidPresenceTest(&s_ProcessIdPresence, pid)))
+    {
+        (*cacheHit) = FALSE;
+        return (STATUS_SUCCESS);
+    }
 
-    WdfWaitLockAcquire(wdfWaitLock, NULL);
+    // The node, and the image name it references, remain valid as long as the shard lock is held
+    shard = ProcessIdShard(pid);
+    ExEnterCriticalRegionAndAcquireResourceShared(&shard->resource);
+
+    // The results are cached for the whitelist evaluated against, hence a reader still evaluating a previous whitelist doesn't pollute the cache of the next one
+    generation = whitelist->generation;
 
     // Is a full image name registered for this process id ?
-    node = BstLookup(s_ProcessIdToFullLoadImageNameMappingTree, PROCESS_HANDLE_TO_PROCESS_ID(processId));
-    (*cacheHit) = ((NULL != node) && (EvaluationCacheEmpty != node->evaluationCache));
+    node = BstLookup(&shard->index, pid);
     if (NULL == node)
     {
         // Its not known (this is acceptable behavior and not an error, hence return success)
-        WdfWaitLockRelease(wdfWaitLock);
+        (*cacheHit) = FALSE;
+        ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
         return (STATUS_SUCCESS);
     }
 
-    // When we are allowed to use the cache return not-found where applicable 
-    if (EvaluationCacheFound == node->evaluationCache)
+    // The evaluation result is shared by all processes running the same image
+    imageName = node->imageName;
+    evaluationCache = ImageNameGetEvaluationCache(imageName, generation);
+    (*cacheHit) = (EvaluationCacheEmpty != evaluationCache);
+
+    // When we are allowed to use the cache return found where applicable
+    if (EvaluationCacheFound == evaluationCache)
     {
-        WdfWaitLockRelease(wdfWaitLock);
+        ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
         return (STATUS_PROCESS_IN_JOB);
     }
 
-    // When we are allowed to use the cache return not-found where applicable 
-    if (EvaluationCacheNotFound == node->evaluationCache)
+    // When we are allowed to use the cache return not-found where applicable
+    if (EvaluationCacheNotFound == evaluationCache)
     {
-        WdfWaitLockRelease(wdfWaitLock);
+        ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
         return (STATUS_PROCESS_NOT_IN_JOB);
     }
 
     // The process is known so indicate for tracing purposes its full image name
-    TRACE_ALWAYS(node->fullImageName);
+    TRACE_ALWAYS(imageName->fullImageName);
 
-    // Iterate all entries in the collection and look for a match while ignore case
-    for (ULONG index = 0, size = WdfCollectionGetCount(wdfCollection); (index < size); index++)
+    // The image name table and the whitelist are keyed on the same case-insensitive hash hence a single bucket needs to be visited
+    // When not listed by name, the image may still lie within a whitelisted folder
+    if ((WhitelistContains(whitelist, imageName->hash, &imageName->upcaseFullImageNameUnicodeString)) || (PathTrieMatch(&whitelist->folders, imageName->upcaseFullImageNameUnicodeString.Buffer, (imageName->upcaseFullImageNameUnicodeString.Length / sizeof(WCHAR)))))
     {
-        WdfStringGetUnicodeString(WdfCollectionGetItem(wdfCollection, index), &fullImageName); // PASSIVE_LEVEL
-        if (0 == RtlCompareUnicodeString(&fullImageName, &node->fullImageNameUnicodeString, TRUE))
-        {
-            // Found the process id
-            node->evaluationCache = EvaluationCacheFound;
-            WdfWaitLockRelease(wdfWaitLock);
-            return (STATUS_PROCESS_IN_JOB);
-        }
+        // Found the process id
+        ImageNameSetEvaluationCache(imageName, generation, EvaluationCacheFound);
+        ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
+        return (STATUS_PROCESS_IN_JOB);
     }
 
-    node->evaluationCache = EvaluationCacheNotFound;
-    WdfWaitLockRelease(wdfWaitLock);
+    ImageNameSetEvaluationCache(imageName, generation, EvaluationCacheNotFound);
+    ExReleaseResourceAndLeaveCriticalRegion(&shard->resource);
 
     // Process id was found but no matching full image name
     return (STATUS_PROCESS_NOT_IN_JOB);
 }
 
 _Use_decl_annotations_
-VOID HidHideProcessIdsCleanup(WDFWAITLOCK wdfWaitLock)
-{
-    TRACE_ALWAYS(L"");
-
-    WdfWaitLockAcquire(wdfWaitLock, NULL);
-    BstCleanup(&s_ProcessIdToFullLoadImageNameMappingTree);
-    WdfWaitLockRelease(wdfWaitLock);
-}
-
-_Use_decl_annotations_
-VOID HidHideProcessIdsFlushWhitelistEvaluationCache(WDFWAITLOCK wdfWaitLock)
+VOID HidHideProcessIdsCleanup()
 {
     TRACE_ALWAYS(L"");
 
-    WdfWaitLockAcquire(wdfWaitLock, NULL);
-    BstFlushEvaluationCache(s_ProcessIdToFullLoadImageNameMappingTree);
-    WdfWaitLockRelease(wdfWaitLock);
+    // Drain one shard at a time so that the other shards remain available meanwhile
+    for (ULONG shardIndex = 0; (shardIndex < s_ProcessIdShardCount); shardIndex++) ProcessIdShardCleanup(&s_ProcessIdShards[shardIndex]);
 }
 
 ULONG s_testPattern[] = { 5, 11, 15, 10, 8, 9, 3, 4, 1, 2 };
 
+// Process id used by the self-test on the presence bitmap coverage and the shard distribution
+#define PROCESSID_PRESENCE_TEST_PID 4096
+
 _Use_decl_annotations_
 NTSTATUS HidHideVerifyInternalConsistency()
 {
     TRACE_ALWAYS(L"");
 
-    PPROCESSIDTREE tree;
-    PPROCESSIDTREE node;
-    rsize_t        count;
-    ULONG          index;
-    NTSTATUS       ntstatus;
+    PID_INDEX       index;
+    IMAGENAME_TABLE table;
+    PPROCESSIDNODE  node;
+    PIMAGENAME      imageName;
+    PIMAGENAME      sharedImageName;
+    ULONG           count;
+    ULONG           previousKey;
+    ULONG           maximumHeight;
+    ULONG           shardHits[HIDHIDE_PROCESS_ID_SHARDS_MAXIMUM];
+    LONG64          nodesAllocated;
+    LONG64          bytesAllocated;
+    LONG64          imageNamesAllocated;
+    LONG64          imageNameBytesAllocated;
+    WCHAR           message[LOGGING_MESSAGE_MAXIMUM_SIZE];
+    NTSTATUS        ntstatus;
 
     DECLARE_UNICODE_STRING_SIZE(dummy, 5);
+    DECLARE_CONST_UNICODE_STRING(sample, L"\\Device\\HarddiskVolume3\\Program Files\\HidHide\\x64\\HidHideClient.exe");
+    DECLARE_CONST_UNICODE_STRING(sampleUpperCase, L"\\DEVICE\\HARDDISKVOLUME3\\PROGRAM FILES\\HIDHIDE\\X64\\HIDHIDECLIENT.EXE");
+
+    // Memorize the pool accounting so that we can check the allocations done by the test
+    nodesAllocated = s_ProcessIdTreeNodesAllocated;
+    bytesAllocated = s_ProcessIdTreeBytesAllocated;
+    imageNamesAllocated = s_ImageNamesAllocated;
+    imageNameBytesAllocated = s_ImageNameBytesAllocated;
 
-    tree = NULL;
+    PidIndexInitialize(&index);
+    RtlZeroMemory(&table, sizeof(table));
     ntstatus = STATUS_SUCCESS;
-    for (index = 0; (index < _countof(s_testPattern)); index++)
+    for (ULONG patternIndex = 0; (patternIndex < _countof(s_testPattern)); patternIndex++)
     {
         // The initial lookup should fail
-        ntstatus = ((NULL == BstLookup(tree, s_testPattern[index])) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        ntstatus = ((NULL == BstLookup(&index, s_testPattern[patternIndex])) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
             TRACE_ALWAYS(L"Initial lookup should fail");
             break;
         }
 
-        // Create new btree node
-        ntstatus = BstNewNode(s_testPattern[index], &dummy, &node);
+        // Create new index node
+        ntstatus = ImageNameAcquire(&table, &dummy, &imageName);
+        if (NT_SUCCESS(ntstatus))
+        {
+            ntstatus = BstNewNode(s_testPattern[patternIndex], imageName, &node);
+            if (!NT_SUCCESS(ntstatus)) ImageNameRelease(&table, imageName);
+        }
         if (!NT_SUCCESS(ntstatus))
         {
             TRACE_ALWAYS(L"Node creation should succeed");
             break;
         }
 
-        // Add it to the tree
-        ntstatus = BstInsert(&tree, node);
+        // Add it to the index
+        ntstatus = BstInsert(&index, node);
         if (!NT_SUCCESS(ntstatus))
         {
-            ExFreePoolWithTag(node, CONFIG_TAG);
+            BstFreeNode(&table, node);
             TRACE_ALWAYS(L"Adding a unique node should succeed");
             break;
         }
 
-        // The tree cannot be empty anymore
-        ntstatus = ((NULL != tree) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        // The index cannot be empty anymore
+        ntstatus = ((NULL != index.root) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
-            TRACE_ALWAYS(L"After adding at least one node the tree can't be empty");
+            TRACE_ALWAYS(L"After adding at least one node the index can't be empty");
             break;
         }
 
         // The lookup after the insert should succeed
-        ntstatus = ((NULL != BstLookup(tree, s_testPattern[index])) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        ntstatus = ((node == BstLookup(&index, s_testPattern[patternIndex])) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
             TRACE_ALWAYS(L"Looking up a key after it is inserted should succeed");
@@ -449,7 +1106,7 @@ NTSTATUS HidHideVerifyInternalConsistency()
         }
 
         // Add it again should fail
-        ntstatus = ((STATUS_ALREADY_INITIALIZED == BstInsert(&tree, node)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        ntstatus = ((STATUS_ALREADY_INITIALIZED == BstInsert(&index, node)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
             TRACE_ALWAYS(L"Attempting to insert the same key again should fail");
@@ -457,32 +1114,77 @@ NTSTATUS HidHideVerifyInternalConsistency()
         }
     }
 
-    // The node count for left should be 4 (1,2,3,4)
+    // The pool accounting should reflect the nodes created and a single full image name shared by all of them
     if (NT_SUCCESS(ntstatus))
     {
-        count = 0;
-        ntstatus = ((NULL != tree) && (NULL != tree->left) && (NT_SUCCESS(BstAddCount(tree->left, &count)) && (4 == count)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        ntstatus = (((nodesAllocated + _countof(s_testPattern)) == s_ProcessIdTreeNodesAllocated) && ((bytesAllocated + (LONG64)(_countof(s_testPattern) * sizeof(PROCESSIDNODE))) == s_ProcessIdTreeBytesAllocated) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            TRACE_ALWAYS(L"After an insert, the pool accounting should match the nodes created");
+        }
+    }
+    if (NT_SUCCESS(ntstatus))
+    {
+        ntstatus = (((1 == table.count) && (_countof(s_testPattern) == BstLookup(&index, s_testPattern[0])->imageName->referenceCount) && ((imageNamesAllocated + 1) == s_ImageNamesAllocated) && ((imageNameBytesAllocated + (LONG64)IMAGENAME_SIZE(0)) == s_ImageNameBytesAllocated)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            TRACE_ALWAYS(L"After an insert, processes running the same image should share a single full image name");
+        }
+    }
+
+    // A full image name should be sized for the name it holds and be shared regardless of case
+    if (NT_SUCCESS(ntstatus))
+    {
+        ntstatus = ImageNameAcquire(&table, &sample, &imageName);
+        if (NT_SUCCESS(ntstatus))
+        {
+            ntstatus = ImageNameAcquire(&table, &sampleUpperCase, &sharedImageName);
+            if (NT_SUCCESS(ntstatus))
+            {
+                ntstatus = (((imageName == sharedImageName) && (2 == imageName->referenceCount) && (2 == table.count) && (((LONG64)IMAGENAME_SIZE(sample.Length) + imageNameBytesAllocated + (LONG64)IMAGENAME_SIZE(0)) == s_ImageNameBytesAllocated) && (0 == RtlCompareUnicodeString(&sample, &imageName->fullImageNameUnicodeString, FALSE))) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+                ImageNameRelease(&table, sharedImageName);
+            }
+            if (NT_SUCCESS(RtlStringCchPrintfW(&message[0], _countof(message), L"Bytes per tracked process %Iu plus %Iu per distinct image", sizeof(PROCESSIDNODE), (size_t)IMAGENAME_SIZE(sample.Length)))) TRACE_ALWAYS(message);
+            ImageNameRelease(&table, imageName);
+        }
         if (!NT_SUCCESS(ntstatus))
         {
-            TRACE_ALWAYS(L"After an insert, the left branch should have the correct number of entries");
+            TRACE_ALWAYS(L"A full image name should be sized for the name it holds and be shared regardless of case");
         }
     }
 
-    // The node count for right should be 5 (8,9,10,11,15)
+    // After an insert, the index should be ordered, balanced, and hold all nodes
+    if (NT_SUCCESS(ntstatus))
+    {
+        ntstatus = ((PidIndexVerify(&index) && (_countof(s_testPattern) == index.count)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            TRACE_ALWAYS(L"After an insert, the index should be consistent");
+        }
+    }
+
+    // Walking the index should visit all nodes in ascending order (1,2,3,4,5,8,9,10,11,15)
     if (NT_SUCCESS(ntstatus))
     {
         count = 0;
-        ntstatus = ((NULL != tree) && (NULL != tree->right) && (NT_SUCCESS(BstAddCount(tree->right, &count)) && (5 == count)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        previousKey = 0;
+        for (PPID_INDEX_NODE indexNode = PidIndexFirst(&index); (NULL != indexNode); indexNode = PidIndexNext(&index, indexNode->key))
+        {
+            if ((0 != count) && (indexNode->key <= previousKey)) break;
+            previousKey = indexNode->key;
+            count++;
+        }
+        ntstatus = ((_countof(s_testPattern) == count) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
-            TRACE_ALWAYS(L"After an insert, the right branch should have the correct number of entries");
+            TRACE_ALWAYS(L"Walking the index should visit all nodes in ascending order");
         }
     }
 
-    // Delete the tree root (5)
+    // Delete the root (a node with two children)
     if (NT_SUCCESS(ntstatus))
     {
-        ntstatus = BstDelete(&tree, 5);
+        ntstatus = BstDelete(&index, &table, 5);
         ntstatus = ((STATUS_PROCESS_IN_JOB == ntstatus) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
@@ -493,7 +1195,7 @@ NTSTATUS HidHideVerifyInternalConsistency()
     // Attempt to delete a non-existing node (5)
     if (NT_SUCCESS(ntstatus))
     {
-        ntstatus = BstDelete(&tree, 5);
+        ntstatus = BstDelete(&index, &table, 5);
         ntstatus = ((STATUS_PROCESS_NOT_IN_JOB == ntstatus) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
@@ -501,36 +1203,70 @@ NTSTATUS HidHideVerifyInternalConsistency()
         }
     }
 
-    // The left branch should now contain 7 nodes (1,2,3,4,8,9,10)
+    // After a delete, the index should be consistent and the remaining nodes should still be found
     if (NT_SUCCESS(ntstatus))
     {
-        count = 0;
-        ntstatus = ((NULL != tree) && (NULL != tree->left) && (NT_SUCCESS(BstAddCount(tree->left, &count)) && (7 == count)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        ntstatus = ((PidIndexVerify(&index) && ((_countof(s_testPattern) - 1) == index.count) && (NULL != BstLookup(&index, 4)) && (NULL != BstLookup(&index, 8))) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
-            TRACE_ALWAYS(L"After a delete, the left branch should have the correct number of entries");
+            TRACE_ALWAYS(L"After a delete, the index should be consistent");
         }
     }
 
-    // The right branch should now contain 1 node (15)
+    // The presence bitmap should cover the process ids as the system hands them out, while the bits themselves are exercised by the unit tests
     if (NT_SUCCESS(ntstatus))
     {
-        count = 0;
-        ntstatus = ((NULL != tree) && (NULL != tree->right) && (NT_SUCCESS(BstAddCount(tree->right, &count)) && (1 == count)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        ntstatus = ((PID_PRESENCE_TRACKED(PROCESSID_PRESENCE_TEST_PID)) && (!PID_PRESENCE_TRACKED(PROCESSID_PRESENCE_TEST_PID + 1)) && (!PID_PRESENCE_TRACKED(PID_PRESENCE_LIMIT)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            TRACE_ALWAYS(L"The presence bitmap should cover the process ids that are a multiple of four");
+        }
+    }
+
+    // Consecutive process ids should be spread evenly over the shards
+    if (NT_SUCCESS(ntstatus))
+    {
+        RtlZeroMemory(&shardHits[0], sizeof(shardHits));
+        for (count = 0; (count < (s_ProcessIdShardCount * 4)); count++) shardHits[PID_INDEX_SHARD((PROCESSID_PRESENCE_TEST_PID + (count * 4)), s_ProcessIdShardMask)]++;
+        for (count = 0; ((count < s_ProcessIdShardCount) && (4 == shardHits[count])); count++);
+        ntstatus = (((0 != s_ProcessIdShardCount) && (s_ProcessIdShardCount == count)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            TRACE_ALWAYS(L"Consecutive process ids should be spread evenly over the shards");
+        }
+    }
+
+    // An AVL tree holding n nodes is never higher than 1.44 * log2(n + 2)
+    if (NT_SUCCESS(ntstatus))
+    {
+        for (maximumHeight = 0, count = (index.count + 2); (count > 1); count >>= 1) maximumHeight++;
+        maximumHeight = (((maximumHeight + 1) * 144) / 100);
+        ntstatus = ((PidIndexVerify(&index) && (PidIndexHeight(&index) <= maximumHeight)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        if (NT_SUCCESS(RtlStringCchPrintfW(&message[0], _countof(message), L"Index holds %u processes at height %u (bound %u)", index.count, PidIndexHeight(&index), maximumHeight))) TRACE_ALWAYS(message);
         if (!NT_SUCCESS(ntstatus))
         {
-            TRACE_ALWAYS(L"After a delete, the right branch should have the correct number of entries");
+            TRACE_ALWAYS(L"After a delete, the index should remain balanced");
         }
     }
 
     // Release the allocated memory
+    BstCleanup(&index, &table);
+    if (NT_SUCCESS(ntstatus))
+    {
+        ntstatus = (((NULL == index.root) && (0 == index.count) && (0 == table.count)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            TRACE_ALWAYS(L"After a clear the index and image name table should be empty");
+        }
+    }
+
+    // All memory allocated by the test should be returned
     if (NT_SUCCESS(ntstatus))
     {
-        BstCleanup(&tree);
-        ntstatus = ((NULL == tree) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+        ntstatus = (((nodesAllocated == s_ProcessIdTreeNodesAllocated) && (bytesAllocated == s_ProcessIdTreeBytesAllocated) && (imageNamesAllocated == s_ImageNamesAllocated) && (imageNameBytesAllocated == s_ImageNameBytesAllocated)) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
         if (!NT_SUCCESS(ntstatus))
         {
-            TRACE_ALWAYS(L"After a clear the tree should be empty");
+            TRACE_ALWAYS(L"After a clear the pool accounting should be back at its initial value");
         }
     }
 
@@ -540,6 +1276,35 @@ NTSTATUS HidHideVerifyInternalConsistency()
     return (ntstatus);
 }
 
+_Use_decl_annotations_
+NTSTATUS HidHideDriverGetULongProperty(PCUNICODE_STRING valueName, ULONG* value)
+{
+    TRACE_ALWAYS(L"");
+
+    WDFKEY   wdfKey;
+    NTSTATUS ntstatus;
+
+    // Initialize return value
+    *value = 0;
+
+    // Get the filter drivers parameter key
+    ntstatus = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), STANDARD_RIGHTS_READ, WDF_NO_OBJECT_ATTRIBUTES, &wdfKey); // PASSIVE_LEVEL
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"WdfDriverOpenParametersRegistryKey", ntstatus);
+
+    // Query property value
+    ntstatus = WdfRegistryQueryULong(wdfKey, valueName, value);
+    WdfRegistryClose(wdfKey);
+    if (!NT_SUCCESS(ntstatus))
+    {
+        // Intercept error parameter-not-found and convert it into a success condition (we have a default)
+        *value = 0;
+        if (STATUS_OBJECT_NAME_NOT_FOUND == ntstatus) return (STATUS_PROCESS_NOT_IN_JOB);
+        LOG_AND_RETURN_NTSTATUS(L"WdfRegistryQueryULong", ntstatus);
+    }
+
+    return (STATUS_PROCESS_IN_JOB);
+}
+
 _Use_decl_annotations_
 NTSTATUS HidHideDriverGetBooleanProperty(PCUNICODE_STRING valueName, BOOLEAN* value)
 {
@@ -736,6 +1501,28 @@ NTSTATUS HidHideDeviceInstancePath(WDFDEVICE wdfDevice, WDFSTRING* deviceInstanc
     return (STATUS_SUCCESS);
 }
 
+_Use_decl_annotations_
+NTSTATUS HidHideDeviceContainerId(WDFDEVICE wdfDevice, GUID* containerId)
+{
+    TRACE_ALWAYS(L"");
+
+    WDF_DEVICE_PROPERTY_DATA wdfDevicePropertyData;
+    DEVPROPTYPE              devPropType;
+    ULONG                    requiredSize;
+    NTSTATUS                 ntstatus;
+
+    // Initialize the result
+    RtlZeroMemory(containerId, sizeof(GUID));
+
+    // The property has a fixed size hence query it in place
+    WDF_DEVICE_PROPERTY_DATA_INIT(&wdfDevicePropertyData, &DEVPKEY_Device_ContainerId);
+    ntstatus = WdfDeviceQueryPropertyEx(wdfDevice, &wdfDevicePropertyData, sizeof(GUID), containerId, &requiredSize, &devPropType);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+    if (DEVPROP_TYPE_GUID != devPropType) LOG_AND_RETURN_NTSTATUS(L"WdfDeviceQueryPropertyEx", STATUS_INVALID_PARAMETER);
+
+    return (STATUS_SUCCESS);
+}
+
 _Use_decl_annotations_
 NTSTATUS HidHideCollectionToMultiString(WDFCOLLECTION wdfCollection, LPWSTR buffer, size_t bufferSizeInCharacters, size_t* neededSizeInCharacters)
 {
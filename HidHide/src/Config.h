@@ -6,40 +6,126 @@
 // Conversion from HANDLE to PID
 #define PROCESS_HANDLE_TO_PROCESS_ID(handle) (ULONG)((ULONG_PTR)handle & 0xFFFFFFFF)
 
+// The maximum number of shards the process id administration is partitioned into
+#define HIDHIDE_PROCESS_ID_SHARDS_MAXIMUM 64
+
+// Statistics on the allocation of process id administration
+typedef struct _HIDHIDE_PROCESS_ID_STATISTICS
+{
+    // The number of process id nodes currently allocated
+    LONG64 nodesAllocated;
+
+    // The highest number of process id nodes allocated at the same time
+    LONG64 nodesHighWaterMark;
+
+    // The number of process id node allocations done
+    LONG64 allocations;
+
+    // The number of shards the process id administration is partitioned into
+    LONG64 shards;
+} HIDHIDE_PROCESS_ID_STATISTICS, *PHIDHIDE_PROCESS_ID_STATISTICS;
+
+// Whitelist compiled into a hash set on the upper-case full image names, hence matched without case folding
+// Entries ending with a backslash denote a folder and are compiled into a path trie covering all images within that folder
+typedef struct _HIDHIDE_WHITELIST HIDHIDE_WHITELIST, *PHIDHIDE_WHITELIST;
+
+// Blacklist compiled into records holding the upper-case device instance path, its hash, and the jail session id
+// The entries are split once when compiled hence matching never parses the blacklist text again
+// The records are hash indexed hence matching costs the same regardless of the number of entries
+// Entries holding a wildcard (e.g. HID\VID_054C&PID_0CE6*) are kept as patterns, only tried when no entry matches exactly
+// Entries holding a container id (e.g. {8C1D6E2A-4F3B-11EE-BE56-0242AC120002}) cover all devices of a physical device, each matched on its container id too
+typedef struct _HIDHIDE_BLACKLIST HIDHIDE_BLACKLIST, *PHIDHIDE_BLACKLIST;
+
 EXTERN_C_START
 
+// Prepare the process id administration; to be called before any process id is registered
+// The administration is partitioned into shards, each with its own lock, so that process churn on different processors doesn't contend
+// The shard count requested is rounded up to a power of two and capped at HIDHIDE_PROCESS_ID_SHARDS_MAXIMUM
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS HidHideProcessIdsInitialize(_In_ ULONG shardCount);
+
+// Release the process id administration; to be called once the process notifications are stopped
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+VOID HidHideProcessIdsTerminate();
+
+// Get the statistics on the allocation of process id administration
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID HidHideProcessIdsGetStatistics(_Out_ HIDHIDE_PROCESS_ID_STATISTICS* statistics);
+
 // Register a PID and its load image
 // Returns STATUS_PROCESS_IN_JOB (success) when the process id is already registered
-// Returns STATUS_SUCCESS when the process id is registered, and the root of the tree may have changed
+// Returns STATUS_SUCCESS when the process id is registered
 _IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS HidHideProcessIdRegister(_In_ WDFWAITLOCK wdfWaitLock, _In_ HANDLE processId, _In_ PUNICODE_STRING fullImageName);
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS HidHideProcessIdRegister(_In_ HANDLE processId, _In_ PUNICODE_STRING fullImageName);
 
 // Unregister a PID
 // When the PID isn't registered, the operation is ignored silently (STATUS_SUCCESS)
-// When the PID is unregistered, the root of the tree may have changed
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS HidHideProcessIdUnregister(_In_ HANDLE processId);
+
+// Compile a string collection with full image names into a whitelist
+// On success the caller becomes responsible for calling HidHideWhitelistDelete on the whitelist when it is no longer needed
+// Each whitelist compiled takes a new whitelist generation, hence results cached for another whitelist are considered stale
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS HidHideWhitelistCreate(_In_ WDFCOLLECTION wdfCollection, _Out_ PHIDHIDE_WHITELIST* whitelist);
+
+// Take an additional reference on a whitelist, to be released with HidHideWhitelistDelete
+// Returns the whitelist provided
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS HidHideProcessIdUnregister(_In_ WDFWAITLOCK wdfWaitLock, _In_ HANDLE processId);
+PHIDHIDE_WHITELIST HidHideWhitelistReference(_In_ PHIDHIDE_WHITELIST whitelist);
 
-// Lookup the full image name associated with a registered process id and check it against the list of white-listed full image names provided
-// cache-hit is TRUE when the result could be taken from the evaluation cache, or FALSE when the result had to be evaluated
-// Returns STATUS_PROCESS_IN_JOB (Success) when the process id is known and the full image name is found in the string list provided
-// Returns STATUS_PROCESS_NOT_IN_JOB (Success) when the process id is known and the full image name is not found in the string list provided
-// Returns STATUS_SUCCESS when the process id isn't known
+// Release a reference on a whitelist created earlier, and delete it when it was the last reference
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID HidHideWhitelistDelete(_In_opt_ PHIDHIDE_WHITELIST whitelist);
+
+// Compile a string collection with device instance paths, each optionally followed by a jail session id, into a blacklist
+// On success the caller becomes responsible for calling HidHideBlacklistDelete on the blacklist when it is no longer needed
+_Must_inspect_result_
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
-NTSTATUS HidHideProcessIdCheckFullImageNameAgainstWhitelist(_In_ WDFWAITLOCK wdfWaitLock, _In_ HANDLE processId, _In_ WDFCOLLECTION wdfCollection, _Out_ BOOLEAN* cacheHit);
+NTSTATUS HidHideBlacklistCreate(_In_ WDFCOLLECTION wdfCollection, _Out_ PHIDHIDE_BLACKLIST* blacklist);
 
-// Unregister all PIDs and return the new root (NULL)
+// Take an additional reference on a blacklist, to be released with HidHideBlacklistDelete
+// Returns the blacklist provided
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-VOID HidHideProcessIdsCleanup(_In_ WDFWAITLOCK wdfWaitLock);
+PHIDHIDE_BLACKLIST HidHideBlacklistReference(_In_ PHIDHIDE_BLACKLIST blacklist);
 
-// Flush the currently cached evaluation results
+// Release a reference on a blacklist created earlier, and delete it when it was the last reference
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-VOID HidHideProcessIdsFlushWhitelistEvaluationCache(_In_ WDFWAITLOCK wdfWaitLock);
+VOID HidHideBlacklistDelete(_In_opt_ PHIDHIDE_BLACKLIST blacklist);
+
+// Look for an upper-case device instance path in the blacklist, given its hash (see BlacklistHash)
+// Returns TRUE when found, along with the jail session id of the entry (zero when there is none)
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN HidHideBlacklistContains(_In_ PHIDHIDE_BLACKLIST blacklist, _In_ ULONG hash, _In_ PCUNICODE_STRING upcaseDeviceInstancePath, _Out_ ULONG* jailSessionId);
+
+// Lookup the full image name associated with a registered process id and check it against the whitelist provided
+// cache-hit is TRUE when the result could be taken from the evaluation cache, or FALSE when the result had to be evaluated
+// Returns STATUS_PROCESS_IN_JOB (Success) when the process id is known and the full image name is found in the whitelist provided
+// Returns STATUS_PROCESS_NOT_IN_JOB (Success) when the process id is known and the full image name is not found in the whitelist provided
+// Returns STATUS_SUCCESS when the process id isn't known
+// The caller is responsible for keeping the whitelist alive during the check
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS HidHideProcessIdCheckFullImageNameAgainstWhitelist(_In_ HANDLE processId, _In_ PHIDHIDE_WHITELIST whitelist, _Out_ BOOLEAN* cacheHit);
+
+// Unregister all PIDs
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+VOID HidHideProcessIdsCleanup();
 
 // Run-time check on the btree algorithm
 // Returns STATUS_SUCCESS when the algorithm passes the tests
@@ -47,6 +133,13 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS HidHideVerifyInternalConsistency();
 
+// Get an unsigned long driver property (DWORD)
+// Returns STATUS_PROCESS_IN_JOB (Success) when the parameter is available
+// Returns STATUS_PROCESS_NOT_IN_JOB (Success) when the parameter isn't available (the value returned is zero)
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS HidHideDriverGetULongProperty(_In_ PCUNICODE_STRING valueName, _Out_ ULONG* value);
+
 // Get a boolean driver property (DWORD)
 // Returns STATUS_OBJECT_NAME_NOT_FOUND (Error) when the parameter is isn't found
 _IRQL_requires_same_
@@ -77,6 +170,12 @@ _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NTSTATUS HidHideDeviceInstancePath(_In_ WDFDEVICE wdfDevice, _Out_ WDFSTRING* deviceInstancePath);
 
+// Get the container id of a given device, shared by all devices of the same physical device
+// Fails when the device doesn't report a container id
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS HidHideDeviceContainerId(_In_ WDFDEVICE wdfDevice, _Out_ GUID* containerId);
+
 // Get the multi-string from a string collection
 // When the supplied buffer is NULL, the method returns STATUS_SUCCESS and indicates the buffer size needed for the multi-string (incl. terminator)
 // When the supplied buffer isn't NULL, the whitelist will be copied into the buffer, providing the buffer is large enough for holding the result
@@ -26,6 +26,10 @@ NTSTATUS HidHideCreateDevice(PWDFDEVICE_INIT wdfDeviceInit)
     WDF_FILEOBJECT_CONFIG_INIT(&wdfFileObjectConfig, OnDeviceFileCreate, WDF_NO_EVENT_CALLBACK, OnDeviceFileCleanup);
     WdfDeviceInitSetFileObjectConfig(wdfDeviceInit, &wdfFileObjectConfig, &wdfObjectAttributes);
 
+    // The requests forwarded carry the time they were sent down the stack at
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&wdfObjectAttributes, REQUEST_CONTEXT);
+    WdfDeviceInitSetRequestAttributes(wdfDeviceInit, &wdfObjectAttributes);
+
     // Create the device
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&wdfObjectAttributes, DEVICE_CONTEXT);
     wdfObjectAttributes.EvtCleanupCallback = OnDeviceContextCleanup;
@@ -40,7 +40,9 @@ _Use_decl_annotations_
 VOID HidHideDriverEvtUnload(WDFDRIVER wdfDriver)
 {
     TRACE_ALWAYS(L"");
-    UNREFERENCED_PARAMETER(wdfDriver);
+
+    // Allow logic to act
+    OnDriverUnload(wdfDriver);
 
     LogUnregisterProviders();
 }
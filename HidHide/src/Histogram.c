@@ -0,0 +1,21 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// Histogram.c
+#include "Histogram.h"
+
+_Use_decl_annotations_
+ULONG HistogramBucket(ULONG64 value, ULONG bucketCount)
+{
+    ULONG index;
+
+    // The position of the highest bit set determines the bucket, so that each bucket spans twice the range of the one before
+    if (0 == value) return (0);
+    BitScanReverse64(&index, value);
+    return (((index + 1) < bucketCount) ? (index + 1) : (bucketCount - 1));
+}
+
+_Use_decl_annotations_
+VOID HistogramRecord(volatile LONG64* buckets, ULONG bucketCount, ULONG64 value)
+{
+    InterlockedIncrementNoFence64(&buckets[HistogramBucket(value, bucketCount)]);
+}
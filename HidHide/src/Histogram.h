@@ -0,0 +1,17 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// Histogram.h
+#pragma once
+#include "Portable.h"
+
+// Log-scaled histogram; recording may run concurrently without taking a lock
+
+EXTERN_C_START
+
+// Get the log-scaled bucket for a value; bucket 0 holds zero, bucket n (n > 0) the values from 2^(n-1) up to 2^n, and the last bucket all larger values
+ULONG HistogramBucket(_In_ ULONG64 value, _In_ ULONG bucketCount);
+
+// Count a value in its bucket
+VOID HistogramRecord(_Inout_updates_(bucketCount) volatile LONG64* buckets, _In_ ULONG bucketCount, _In_ ULONG64 value);
+
+EXTERN_C_END
@@ -11,57 +11,173 @@
 // Unique memory pool tag for buffers
 #define LOGIC_TAG 'oLHH'
 
+// Unique memory pool tag for the configuration snapshots
+#define CONFIGURATION_TAG 'sCHH'
+
+// Unique memory pool tags for the session blacklist owners and records
+#define SESSION_BLACKLIST_TAG        'lBSH'
+#define SESSION_BLACKLIST_RECORD_TAG 'rBSH'
+
+// Unique memory pool tag for the session jail entries
+#define SESSION_JAIL_TAG 'jSHH'
+
 // The control device is created first and should be deleted last after having release the driver resources
 // Releasing the control device is required else the driver will never unload
 WDFDEVICE s_wdfControlDevice = NULL;
 
 // The device is multi-threading hence we need a lock for the critical sections
 // As a rule of thumb, don't use the control device context directly but instead use the methods below
-WDFWAITLOCK s_criticalSectionLock = NULL;
+// Reader/writer lock on the control device context
+// The access decisions only read hence acquire it shared, while configuration changes acquire it exclusive
+// The process administration has locks of its own so that process churn doesn't contend with the access decisions
+ERESOURCE s_criticalSectionLock;
+BOOLEAN   s_criticalSectionLockInitialized = FALSE;
+
+// Whether the create process notifications are subscribed to, as both the system shutdown and the driver unload remove the subscription
+// Exchanged atomically so that the subscription is removed only once, whichever comes first
+volatile LONG s_processNotifyRoutineRegistered = FALSE;
+
+// The blacklist generation is bumped, while holding the lock exclusive, on every change of the persistent or session blacklist
+// Verdicts cached in a device context stamped with an older generation are considered stale
+volatile LONG s_BlacklistGeneration = 0;
+
+// The configuration generation is bumped for every configuration snapshot published, and tells apart the verdicts made against each of them
+volatile LONG s_ConfigurationGeneration = 0;
+
+// The performance counter frequency, taken once, for converting the time spent on open requests into microseconds
+LARGE_INTEGER s_PerformanceFrequency;
+
+// A cached verdict is stored as the generation (30 bits) shifted left by 34 bits, combined with the session jail bound state (bit 33), the blacklisted state (bit 32), and the jail session id
+#define BLACKLIST_VERDICT_GENERATION_MASK      0x3FFFFFFFUL
+#define BLACKLIST_VERDICT_STAMP(generation, blacklisted, jailSessionId, jailBound) ((LONG64)(((ULONG64)((ULONG)(generation) & BLACKLIST_VERDICT_GENERATION_MASK) << 34) | ((ULONG64)((jailBound) ? 1 : 0) << 33) | ((ULONG64)((blacklisted) ? 1 : 0) << 32) | (ULONG64)(ULONG)(jailSessionId)))
+#define BLACKLIST_VERDICT_GENERATION(stamp)    ((ULONG)(((ULONG64)(stamp)) >> 34))
+#define BLACKLIST_VERDICT_JAIL_BOUND(stamp)    (0 != (((ULONG64)(stamp)) & (1ULL << 33)))
+#define BLACKLIST_VERDICT_BLACKLISTED(stamp)   (0 != (((ULONG64)(stamp)) & (1ULL << 32)))
+#define BLACKLIST_VERDICT_JAIL_SESSION(stamp)  ((ULONG)(((ULONG64)(stamp)) & 0xFFFFFFFFULL))
+
+// The number of microseconds elapsed since the performance counter value provided
+#define ELAPSED_MICROSECONDS(start) ((ULONG64)(((KeQueryPerformanceCounter(NULL).QuadPart - (start)) * 1000000LL) / s_PerformanceFrequency.QuadPart))
+
+// The size of a device statistics record holding a device instance path of a given length, padded to a multiple of eight bytes
+#define DEVICE_STATISTICS_RECORD_SIZE(deviceInstancePathLengthInBytes) ((sizeof(HIDHIDE_DEVICE_STATISTICS) + (size_t)(deviceInstancePathLengthInBytes) + 7) & ~((size_t)7))
+
+// Remove the create process notification subscription when still in place
+// Upon return, no notification callback is running or will run hence the process administration can be released
+static VOID UnregisterProcessNotifyRoutine()
+{
+    if (InterlockedExchange(&s_processNotifyRoutineRegistered, FALSE))
+    {
+        PsSetCreateProcessNotifyRoutineEx(OnSystemProcessChange, TRUE);
+    }
+}
+
+// Undo the driver creation steps taken so far, as the driver unload isn't called when the driver creation fails
+static VOID UndoDriverCreate()
+{
+    TRACE_ALWAYS(L"");
+
+    // The control device context cleanup still needs the process administration and the lock hence delete the control device first
+    if (NULL != s_wdfControlDevice)
+    {
+        WdfObjectDelete(s_wdfControlDevice);
+        s_wdfControlDevice = NULL;
+    }
+
+    // The lock isn't parented to the control device hence release it explicitly
+    if (s_criticalSectionLockInitialized)
+    {
+        ExDeleteResourceLite(&s_criticalSectionLock);
+        s_criticalSectionLockInitialized = FALSE;
+    }
+
+    // Release the process administration
+    HidHideProcessIdsTerminate();
+}
 
 _Use_decl_annotations_
 NTSTATUS OnDriverCreate(WDFDRIVER wdfDriver)
 {
     TRACE_ALWAYS(L"");
 
-    WDF_OBJECT_ATTRIBUTES wdfObjectAttributes;
-    NTSTATUS              ntstatus;
+    ULONG    shardCount;
+    NTSTATUS ntstatus;
+
+    // Partition the process id administration in a shard per processor unless configured otherwise
+    DECLARE_CONST_UNICODE_STRING(processIdShards, DRIVER_PROPERTY_PROCESS_ID_SHARDS);
+    ntstatus = HidHideDriverGetULongProperty(&processIdShards, &shardCount);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+    if (0 == shardCount) shardCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    // The performance counter frequency is fixed at system boot
+    KeQueryPerformanceCounter(&s_PerformanceFrequency);
+
+    // Prepare the process id administration as the integrity check depends on it
+    ntstatus = HidHideProcessIdsInitialize(shardCount);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
     // Do an integrity check on the btree algorithm
     ntstatus = HidHideVerifyInternalConsistency();
-    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+    if (!NT_SUCCESS(ntstatus))
+    {
+        UndoDriverCreate();
+        return (ntstatus);
+    }
 
     // Create the control device so that we have a shared context that is device independent
     ntstatus = HidHideControlDeviceCreate(wdfDriver, &s_wdfControlDevice);
-    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+    if (!NT_SUCCESS(ntstatus))
+    {
+        UndoDriverCreate();
+        return (ntstatus);
+    }
 
     // Part of the code is multi-threaded so we need a lock for managing the critical section on the control device context
-    WDF_OBJECT_ATTRIBUTES_INIT(&wdfObjectAttributes);
-    wdfObjectAttributes.ParentObject = s_wdfControlDevice;
-    ntstatus = WdfWaitLockCreate(&wdfObjectAttributes, &s_criticalSectionLock);
-    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"WdfWaitLockCreate", ntstatus);
+    ntstatus = ExInitializeResourceLite(&s_criticalSectionLock);
+    if (!NT_SUCCESS(ntstatus))
+    {
+        UndoDriverCreate();
+        LOG_AND_RETURN_NTSTATUS(L"ExInitializeResourceLite", ntstatus);
+    }
+    s_criticalSectionLockInitialized = TRUE;
 
-    // Subscribe to the create process and load image notifications
-    ntstatus = PsSetCreateProcessNotifyRoutine(OnSystemProcessChange, FALSE);
-    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"PsSetCreateProcessNotifyRoutine", ntstatus);
-    ntstatus = PsSetLoadImageNotifyRoutine(OnSystemLoadImage);
-    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"PsSetLoadImageNotifyRoutine", ntstatus);
+    // Subscribe to the create process notifications (requires the image to be linked with /INTEGRITYCHECK)
+    ntstatus = PsSetCreateProcessNotifyRoutineEx(OnSystemProcessChange, FALSE);
+    if (!NT_SUCCESS(ntstatus))
+    {
+        UndoDriverCreate();
+        LOG_AND_RETURN_NTSTATUS(L"PsSetCreateProcessNotifyRoutineEx", ntstatus);
+    }
+    InterlockedExchange(&s_processNotifyRoutineRegistered, TRUE);
 
     return (STATUS_SUCCESS);
 }
 
+_Use_decl_annotations_
+VOID OnDriverUnload(WDFDRIVER wdfDriver)
+{
+    TRACE_ALWAYS(L"");
+    UNREFERENCED_PARAMETER(wdfDriver);
+
+    // Stop monitoring of create process notifications, unless already done on shutdown, before releasing the process administration they update
+    UnregisterProcessNotifyRoutine();
+    HidHideProcessIdsTerminate();
+
+    // Release the lock as the control device is gone
+    if (s_criticalSectionLockInitialized)
+    {
+        ExDeleteResourceLite(&s_criticalSectionLock);
+        s_criticalSectionLockInitialized = FALSE;
+    }
+}
+
 _Use_decl_annotations_
 VOID OnSystemShutdown(WDFDEVICE wdfControlDevice)
 {
     TRACE_ALWAYS(L"");
     UNREFERENCED_PARAMETER(wdfControlDevice);
 
-    // Stop monitoring of load image notifications
-    PsRemoveLoadImageNotifyRoutine(OnSystemLoadImage);
-    PsSetCreateProcessNotifyRoutine(OnSystemProcessChange, TRUE);
-
-    // Release the evaluation cache resources
-    HidHideProcessIdsFlushWhitelistEvaluationCache(s_criticalSectionLock);
+    // Stop monitoring of create process notifications
+    UnregisterProcessNotifyRoutine();
 
     // Enter shutdown state
     UpdateDataForControlDeviceDeletionAndDeleteControlDeviceWhenNeeded(0);
@@ -74,50 +190,84 @@ VOID OnControlDeviceContextCleanup(WDFOBJECT wdfControlDeviceObject)
 
     PCONTROL_DEVICE_CONTEXT pControlDeviceContext = ControlDeviceGetContext(wdfControlDeviceObject);
 
+    // Nothing got added to the session blacklist when the control device creation failed early on
+    if (!pControlDeviceContext->sessionBlacklistLookasideListInitialized) return;
+
     // Drain any remaining session blacklist entries left over at driver unload.
-    // s_criticalSectionLock is a child of the control device and is still live during its cleanup
-    // callback, but guard against the case where WdfWaitLockCreate failed and left it NULL.
-    if (NULL != s_criticalSectionLock) WdfWaitLockAcquire(s_criticalSectionLock, NULL);
-    PLIST_ENTRY entry = pControlDeviceContext->sessionBlacklistHead.Flink;
-    while (entry != &pControlDeviceContext->sessionBlacklistHead)
+    // s_criticalSectionLock is released on driver unload hence still live during the control device cleanup
+    // callback, but guard against the case where ExInitializeResourceLite failed and left it uninitialized.
+    if (s_criticalSectionLockInitialized) ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+    for (ULONG bucket = 0; (bucket < SESSION_BLACKLIST_OWNER_BUCKETS); bucket++)
     {
-        PSESSION_BLACKLIST_ENTRY sbe = CONTAINING_RECORD(entry, SESSION_BLACKLIST_ENTRY, listEntry);
-        PLIST_ENTRY next = entry->Flink;
-        RemoveEntryList(entry);
-        WdfObjectDelete(sbe->deviceInstancePath);
-        ExFreePoolWithTag(sbe, 'lBSH');
-        entry = next;
+        while (!IsListEmpty(&pControlDeviceContext->sessionBlacklistOwnerBuckets[bucket]))
+        {
+            SessionBlacklistDisown(pControlDeviceContext, CONTAINING_RECORD(RemoveHeadList(&pControlDeviceContext->sessionBlacklistOwnerBuckets[bucket]), SESSION_BLACKLIST_ENTRY, listEntry));
+        }
+        pControlDeviceContext->sessionBlacklistOwnerCounts[bucket] = 0;
     }
-    if (NULL != s_criticalSectionLock) WdfWaitLockRelease(s_criticalSectionLock);
+
+    // Drain the session jail bindings left over as well
+    for (ULONG bucket = 0; (bucket < SESSION_JAIL_BUCKETS); bucket++)
+    {
+        PSESSION_JAIL_BINDING binding;
+        while (NULL != (binding = pControlDeviceContext->sessionJailDeviceBuckets[bucket]))
+        {
+            SessionJailRemove(&pControlDeviceContext->sessionJailIndex, binding);
+            ExFreePoolWithTag(CONTAINING_RECORD(binding, SESSION_JAIL_ENTRY, binding), SESSION_JAIL_TAG);
+        }
+    }
+    if (s_criticalSectionLockInitialized) ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+
+    // The session blacklist owners are all returned hence the lookaside list can go
+    ExDeleteLookasideListEx(&pControlDeviceContext->sessionBlacklistLookasideList);
+    pControlDeviceContext->sessionBlacklistLookasideListInitialized = FALSE;
+
+    // Release the configuration snapshot published, and with it the compiled whitelist and blacklist
+    if (NULL != pControlDeviceContext->configuration.current) SnapshotRelease(pControlDeviceContext->configuration.current);
+    pControlDeviceContext->configuration.current = NULL;
 }
 
 _Use_decl_annotations_
-VOID OnSystemProcessChange(HANDLE parentId, HANDLE processId, BOOLEAN create)
+VOID OnSystemProcessChange(PEPROCESS process, HANDLE processId, PPS_CREATE_NOTIFY_INFO createInfo)
 {
     TRACE_PERFORMANCE(L"");
-    UNREFERENCED_PARAMETER(parentId);
 
     // When a process is stopped we need to properly unregister it as we no longer need its information
     // Notice that we aren't receiving notifications for any process with enhanced security
-    if (FALSE == create)
+    if (NULL == createInfo)
     {
-        HidHideProcessIdUnregister(s_criticalSectionLock, processId);
+        HidHideProcessIdUnregister(processId);
         SessionBlacklistCleanupForPid(processId);
+        return;
     }
+
+    // Register the full image name once, at process creation, rather than on every image loaded into the process
+    RegisterProcess(process, processId);
 }
 
 _Use_decl_annotations_
-VOID OnSystemLoadImage(PUNICODE_STRING fullImageName, HANDLE processId, PIMAGE_INFO imageInfo)
+NTSTATUS RegisterProcess(PEPROCESS process, HANDLE processId)
 {
     TRACE_PERFORMANCE(L"");
-    UNREFERENCED_PARAMETER(imageInfo);
 
-    // Ignore load attempts by device drivers (process id zero) or when the image name isn't provided
-    if ((NULL != fullImageName) && (NULL != processId))
+    PUNICODE_STRING fullImageName;
+    UNICODE_STRING  unknownImageName;
+    NTSTATUS        ntstatus;
+
+    // The image file name in the create notification holds the name used for opening the file (e.g. \??\C:\...)
+    // so ask for the image name in its device form (e.g. \Device\HarddiskVolume3\...) as that is what the whitelist holds
+    ntstatus = SeLocateProcessImageName(process, &fullImageName);
+    if (!NT_SUCCESS(ntstatus))
     {
-        // Only process the first load attempt as this is the executable; subsequent calls are for its load modules
-        HidHideProcessIdRegister(s_criticalSectionLock, processId, fullImageName);
+        // Register the process without an image name, matching no whitelist entry, rather than leaving it unknown and trying again on its every access
+        LogEvent(ETW(Exception), L"%s reports NT status 0x%08X", L"SeLocateProcessImageName", ntstatus);
+        RtlInitUnicodeString(&unknownImageName, L"");
+        return (HidHideProcessIdRegister(processId, &unknownImageName));
     }
+    ntstatus = HidHideProcessIdRegister(processId, fullImageName);
+    ExFreePool(fullImageName);
+
+    return (ntstatus);
 }
 
 _Use_decl_annotations_
@@ -125,14 +275,47 @@ NTSTATUS OnDeviceCreate(WDFDEVICE wdfDevice)
 {
     TRACE_ALWAYS(L"");
 
-    PDEVICE_CONTEXT pDeviceContext;
-    NTSTATUS        ntstatus;
+    PDEVICE_CONTEXT         pDeviceContext;
+    PCONFIGURATION_SNAPSHOT configuration;
+    UNICODE_STRING          deviceInstancePath;
+    GUID                    containerId;
+    NTSTATUS                ntstatus;
+
+    // Account for the device before anything can fail, as the context cleanup always takes it off again
+    UpdateDataForControlDeviceDeletionAndDeleteControlDeviceWhenNeeded(1);
 
     // Get the device instance path of this device and cache it for future use
     pDeviceContext = DeviceGetContext(wdfDevice);
     ntstatus = HidHideDeviceInstancePath(wdfDevice, &pDeviceContext->deviceInstancePath); // PASSIVE_LEVEL
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
-    UpdateDataForControlDeviceDeletionAndDeleteControlDeviceWhenNeeded(1);
+
+    // Fold the case of the device instance path once so that it can be matched against the compiled blacklist as-is
+    WdfStringGetUnicodeString(pDeviceContext->deviceInstancePath, &deviceInstancePath);
+    ntstatus = RtlUpcaseUnicodeString(&pDeviceContext->upcaseDeviceInstancePath, &deviceInstancePath, TRUE);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"RtlUpcaseUnicodeString", ntstatus);
+    pDeviceContext->deviceInstancePathHash = BlacklistHash(pDeviceContext->upcaseDeviceInstancePath.Buffer, (pDeviceContext->upcaseDeviceInstancePath.Length / sizeof(WCHAR)));
+
+    // Likewise take the container id once, in the form the blacklist holds it; a device without one is only matched on its device instance path
+    pDeviceContext->upcaseContainerId.Buffer = &pDeviceContext->upcaseContainerIdBuffer[0];
+    pDeviceContext->upcaseContainerId.MaximumLength = sizeof(pDeviceContext->upcaseContainerIdBuffer);
+    pDeviceContext->upcaseContainerId.Length = 0;
+    if (NT_SUCCESS(HidHideDeviceContainerId(wdfDevice, &containerId))) // PASSIVE_LEVEL
+    {
+        BlacklistFormatContainerId(&containerId, &pDeviceContext->upcaseContainerIdBuffer[0]);
+        pDeviceContext->upcaseContainerId.Length = sizeof(pDeviceContext->upcaseContainerIdBuffer);
+        pDeviceContext->containerIdHash = BlacklistHash(&pDeviceContext->upcaseContainerIdBuffer[0], BLACKLIST_CONTAINER_ID_LENGTH);
+    }
+
+    // The device instance path never changes hence determine the blacklist verdict once, up front
+    configuration = ConfigurationAcquire();
+    DeviceRefreshBlacklistVerdict(pDeviceContext, configuration);
+    ConfigurationRelease(configuration);
+    VerdictCacheInitialize(&pDeviceContext->verdictCache);
+
+    // Track the device so that its statistics can be reported
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+    InsertTailList(&ControlDeviceGetContext(s_wdfControlDevice)->deviceHead, &pDeviceContext->deviceListEntry);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
 
     return (STATUS_SUCCESS);
 }
@@ -144,10 +327,23 @@ VOID OnDeviceContextCleanup(WDFOBJECT wdfDeviceObject)
     UNREFERENCED_PARAMETER(wdfDeviceObject);
 
     PDEVICE_CONTEXT pDeviceContext;
+    WCHAR           message[LOGGING_MESSAGE_MAXIMUM_SIZE];
 
-    // Release context resources
+    // Report how well the verdict cache performed over the lifetime of the device, in support of tuning its size
     pDeviceContext = DeviceGetContext(wdfDeviceObject);
-    WdfObjectDelete(pDeviceContext->deviceInstancePath);
+    if (NT_SUCCESS(RtlStringCchPrintfW(&message[0], _countof(message), L"Verdict cache hits %I64d, misses %I64d", pDeviceContext->verdictCache.hits, pDeviceContext->verdictCache.misses))) TRACE_ALWAYS(message);
+
+    // Stop tracking the device, when it got that far, before its context goes
+    if (NULL != pDeviceContext->deviceListEntry.Flink)
+    {
+        ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+        RemoveEntryList(&pDeviceContext->deviceListEntry);
+        ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+    }
+
+    // Release context resources
+    if (NULL != pDeviceContext->deviceInstancePath) WdfObjectDelete(pDeviceContext->deviceInstancePath);
+    RtlFreeUnicodeString(&pDeviceContext->upcaseDeviceInstancePath);
     UpdateDataForControlDeviceDeletionAndDeleteControlDeviceWhenNeeded(-1);
 }
 
@@ -157,20 +353,25 @@ VOID OnDeviceFileCreate(WDFDEVICE wdfDevice, WDFREQUEST wdfRequest, WDFFILEOBJEC
     TRACE_PERFORMANCE(L"");
     UNREFERENCED_PARAMETER(wdfFileObject);
 
-    WDF_REQUEST_SEND_OPTIONS wdfRequestSendOptions;
     PDEVICE_CONTEXT          pDeviceContext;
+    PCONFIGURATION_SNAPSHOT  configuration;
+    VERDICT_CACHE_KEY        verdictCacheKey;
+    LONGLONG                 decisionTime;
     UNICODE_STRING           deviceInstancePath;
     PEPROCESS                process;
     HANDLE                   processId;
     ULONG                    sessionId;
     BOOLEAN                  accessDenied;
     BOOLEAN                  cacheHit;
+    BOOLEAN                  processKnown;
     WDFMEMORY                wdfMemory;
     LPWSTR                   buffer;
     NTSTATUS                 ntstatus;
 
     // Get the device instance path
+    decisionTime = KeQueryPerformanceCounter(NULL).QuadPart;
     pDeviceContext = DeviceGetContext(wdfDevice);
+    InterlockedIncrementNoFence64(&pDeviceContext->statistics.opens);
     WdfStringGetUnicodeString(pDeviceContext->deviceInstancePath, &deviceInstancePath);
 
     // Should access be granted to a particular client that attempts to access the device?
@@ -191,58 +392,83 @@ VOID OnDeviceFileCreate(WDFDEVICE wdfDevice, WDFREQUEST wdfRequest, WDFFILEOBJEC
         sessionId = 0;
     }
 
+    // Evaluate a single configuration snapshot throughout, taken without taking the lock, so that a concurrent configuration change is either seen in full or not at all
+    // The active state, the persistent blacklist, the whitelist and the inverse state all come from this snapshot
+    // Locks still taken on this path, all of them shared;
+    // - the critical section lock, when the blacklist verdict of the device is refreshed for the session blacklist and the session jail (after a blacklist change only)
+    // - the critical section lock, when the device is bound in the session jail and the caller isn't in its jail session
+    // - the lock of the process id shard, when the process id is present and the verdict cache misses
+    // An unknown process is registered on its first access, which takes the shard lock exclusive (see Whitelisted)
     accessDenied = FALSE;
-    if ((SYSTEM_PID != PROCESS_HANDLE_TO_PROCESS_ID(processId)) && (GetActive()) && (Blacklisted(&deviceInstancePath, sessionId)))
+    configuration = ConfigurationAcquire();
+    if ((SYSTEM_PID != PROCESS_HANDLE_TO_PROCESS_ID(processId)) && (configuration->active))
     {
-        // When the service is active, and the process is not a system-process, and the device being accessed is on the black-list, then the final verdict comes from the white-list
-        if (Whitelisted(processId, &cacheHit))
+        // Repeated opens by the same process are answered from the verdict cache of the device, as long as the configuration didn't change meanwhile
+        // Take the blacklist generation before evaluating the blacklist so that a verdict is never remembered for a newer generation than it was made against
+        verdictCacheKey.processId               = PROCESS_HANDLE_TO_PROCESS_ID(processId);
+        verdictCacheKey.processCreateTime       = ((NULL != process) ? PsGetProcessCreateTimeQuadPart(process) : 0);
+        verdictCacheKey.configurationGeneration = configuration->generation;
+        verdictCacheKey.blacklistGeneration     = ReadAcquire(&s_BlacklistGeneration);
+        if (!VerdictCacheLookup(&pDeviceContext->verdictCache, &verdictCacheKey, &accessDenied))
         {
-            // Log the first-time that a white-listed application is granted access to a black-listed device
-            if (!cacheHit) LogEvent(ETW(Whitelisted), L"%ld (Session ID: %ld)", PROCESS_HANDLE_TO_PROCESS_ID(processId), sessionId);
-        }
-        else
-        {
-            // Trace the first-time that an application is denied access to a black-listed device
-            if (!cacheHit) TRACE_ALWAYS(L"Device is black-listed hence deny access");
-            accessDenied = TRUE;
-        }
-        // Trace the first-time the device instance path is challenged, in support of the message above
-        if (!cacheHit)
-        {
-            ntstatus = WdfMemoryCreate(WDF_NO_OBJECT_ATTRIBUTES, NonPagedPoolNx, LOGIC_TAG, sizeof(WCHAR) * ((size_t)deviceInstancePath.Length + 1), &wdfMemory, &buffer);
-            if (NT_SUCCESS(ntstatus)) ntstatus = RtlStringCchCopyUnicodeStringEx(buffer, ((size_t)deviceInstancePath.Length + 1), &deviceInstancePath, NULL, NULL, STRSAFE_NO_TRUNCATION);
-            if (NT_SUCCESS(ntstatus)) TRACE_ALWAYS(buffer);
-            WdfObjectDelete(wdfMemory);
+            processKnown = TRUE;
+            if (DeviceBlacklisted(pDeviceContext, configuration, sessionId))
+            {
+                // When the service is active, and the process is not a system-process, and the device being accessed is on the black-list, then the final verdict comes from the white-list
+                if (Whitelisted(configuration, processId, &cacheHit, &processKnown))
+                {
+                    // Log the first-time that a white-listed application is granted access to a black-listed device
+                    if (!cacheHit) LogEvent(ETW(Whitelisted), L"%ld (Session ID: %ld)", PROCESS_HANDLE_TO_PROCESS_ID(processId), sessionId);
+                }
+                else
+                {
+                    // Trace the first-time that an application is denied access to a black-listed device
+                    if (!cacheHit) TRACE_ALWAYS(L"Device is black-listed hence deny access");
+                    accessDenied = TRUE;
+                }
+                // Trace the first-time the device instance path is challenged, in support of the message above
+                if (!cacheHit)
+                {
+                    ntstatus = WdfMemoryCreate(WDF_NO_OBJECT_ATTRIBUTES, NonPagedPoolNx, LOGIC_TAG, sizeof(WCHAR) * ((size_t)deviceInstancePath.Length + 1), &wdfMemory, &buffer);
+                    if (NT_SUCCESS(ntstatus)) ntstatus = RtlStringCchCopyUnicodeStringEx(buffer, ((size_t)deviceInstancePath.Length + 1), &deviceInstancePath, NULL, NULL, STRSAFE_NO_TRUNCATION);
+                    if (NT_SUCCESS(ntstatus)) TRACE_ALWAYS(buffer);
+                    WdfObjectDelete(wdfMemory);
+                }
+            }
+
+            // Only remember the verdict when it holds till the configuration changes, hence not for a process that isn't registered (yet)
+            if ((processKnown) && (NULL != process)) VerdictCacheStore(&pDeviceContext->verdictCache, &verdictCacheKey, accessDenied);
         }
     }
+    else if (SYSTEM_PID == PROCESS_HANDLE_TO_PROCESS_ID(processId))
+    {
+        InterlockedIncrementNoFence64(&pDeviceContext->statistics.systemBypasses);
+    }
+    ConfigurationRelease(configuration);
+    HistogramRecord(&pDeviceContext->statistics.decisionLatency[0], HIDHIDE_LATENCY_BUCKETS, ELAPSED_MICROSECONDS(decisionTime));
 
     // Handle the request accordingly
-    // Note that a file create has to be handled synchrounously
     if (accessDenied)
     {
+        InterlockedIncrementNoFence64(&pDeviceContext->statistics.denies);
         WdfRequestComplete(wdfRequest, STATUS_ACCESS_DENIED);
     }
     else
     {
         // Attach a completion routine and forward the original request to the driver lower in the driver stack
         // Note that WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET can't be used here as a bug check triggers when running driver verifier 
+        // The request is forwarded asynchronously, without a timeout, so that a slow lower stack doesn't hold up the calling thread in this filter
+        // The completion routine completes the request with the status of the lower stack, as the requestor would have seen it without this filter
+        // The completion routine gets the device context for accounting the time spent by the lower stack
+        InterlockedIncrementNoFence64(&pDeviceContext->statistics.allows);
         WdfRequestFormatRequestUsingCurrentType(wdfRequest);
-        WdfRequestSetCompletionRoutine(wdfRequest, OnDeviceFileCreateRequestCompletion, WDF_NO_CONTEXT);
-        WDF_REQUEST_SEND_OPTIONS_INIT(&wdfRequestSendOptions, WDF_REQUEST_SEND_OPTION_SYNCHRONOUS);
-        WDF_REQUEST_SEND_OPTIONS_SET_TIMEOUT(&wdfRequestSendOptions, WDF_REL_TIMEOUT_IN_SEC(60));
-        ntstatus = WdfRequestAllocateTimer(wdfRequest);
-        if (!NT_SUCCESS(ntstatus))
-        {
-            // Bail out when we don't have the resources to forward the request
-            WdfRequestComplete(wdfRequest, ntstatus);
-        }
-        else
+        WdfRequestSetCompletionRoutine(wdfRequest, OnDeviceFileCreateRequestCompletion, pDeviceContext);
+        RequestGetContext(wdfRequest)->forwardTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
+        // Bail out when we failed forwarding the request
+        if (FALSE == WdfRequestSend(wdfRequest, WdfDeviceGetIoTarget(wdfDevice), WDF_NO_SEND_OPTIONS))
         {
-            // Bail out when we failed forwarding the request
-            if (FALSE == WdfRequestSend(wdfRequest, WdfDeviceGetIoTarget(wdfDevice), &wdfRequestSendOptions))
-            {
-                WdfRequestComplete(wdfRequest, WdfRequestGetStatus(wdfRequest));
-            }
+            WdfRequestComplete(wdfRequest, WdfRequestGetStatus(wdfRequest));
         }
     }
 }
@@ -252,8 +478,9 @@ VOID OnDeviceFileCreateRequestCompletion(WDFREQUEST wdfRequest, WDFIOTARGET wdfI
 {
     TRACE_PERFORMANCE(L"");
     UNREFERENCED_PARAMETER(wdfIoTarget);
-    UNREFERENCED_PARAMETER(wdfContext);
 
+    // The completion context is the device context of the device forwarding the request
+    HistogramRecord(&((PDEVICE_CONTEXT)wdfContext)->statistics.forwardLatency[0], HIDHIDE_LATENCY_BUCKETS, ELAPSED_MICROSECONDS(RequestGetContext(wdfRequest)->forwardTime));
     WdfRequestComplete(wdfRequest, wdfRequestCompletionParams->IoStatus.Status);
 }
 
@@ -272,35 +499,60 @@ NTSTATUS OnControlDeviceCreate(WDFDEVICE wdfControlDevice)
     TRACE_ALWAYS(L"");
 
     PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
+    PCONFIGURATION_SNAPSHOT configuration;
     NTSTATUS                ntstatus;
 
     pControlDeviceContext = ControlDeviceGetContext(wdfControlDevice);
     pControlDeviceContext->numberOfDevicesCreated = 0;
     pControlDeviceContext->shutdownPending = FALSE;
-    InitializeListHead(&pControlDeviceContext->sessionBlacklistHead);
 
-    // Query the multi-string property containing the white-listed full image names
+    // Use the system default depth as the system tunes it to the actual allocation rate
+    ntstatus = ExInitializeLookasideListEx(&pControlDeviceContext->sessionBlacklistLookasideList, NULL, NULL, NonPagedPoolNx, 0, sizeof(SESSION_BLACKLIST_ENTRY), SESSION_BLACKLIST_TAG, 0);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"ExInitializeLookasideListEx", ntstatus);
+    pControlDeviceContext->sessionBlacklistLookasideListInitialized = TRUE;
+
+    for (ULONG bucket = 0; (bucket < SESSION_BLACKLIST_OWNER_BUCKETS); bucket++)
+    {
+        InitializeListHead(&pControlDeviceContext->sessionBlacklistOwnerBuckets[bucket]);
+        pControlDeviceContext->sessionBlacklistOwnerCounts[bucket] = 0;
+    }
+    BlacklistIndexInitialize(&pControlDeviceContext->sessionBlacklistIndex, &pControlDeviceContext->sessionBlacklistBuckets[0], SESSION_BLACKLIST_BUCKETS);
+    SessionJailInitialize(&pControlDeviceContext->sessionJailIndex, &pControlDeviceContext->sessionJailDeviceBuckets[0], &pControlDeviceContext->sessionJailSessionBuckets[0], SESSION_JAIL_BUCKETS);
+    InitializeListHead(&pControlDeviceContext->deviceHead);
+
+    // Publish the initial configuration snapshot right away, so that the control device cleanup releases whatever got loaded
+    // No access decision reads it before the control device is created hence it may be filled in after publishing it
+#pragma warning(disable: 4996)
+    configuration = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(CONFIGURATION_SNAPSHOT), CONFIGURATION_TAG);
+#pragma warning(default: 4996)
+    if (NULL == configuration) LOG_AND_RETURN_NTSTATUS(L"ExAllocatePoolWithTag", STATUS_NO_MEMORY);
+    RtlZeroMemory(configuration, sizeof(CONFIGURATION_SNAPSHOT));
+    SnapshotInitialize(&configuration->header, OnConfigurationCleanup);
+    configuration->generation = InterlockedIncrement(&s_ConfigurationGeneration);
+    SnapshotSlotInitialize(&pControlDeviceContext->configuration, &configuration->header);
+
+    // Query the multi-string property containing the white-listed full image names and compile it for matching
     DECLARE_CONST_UNICODE_STRING(whitelistedFullImageNames, DRIVER_PROPERTY_WHITELISTED_FULL_IMAGE_NAMES);
-    ntstatus = HidHideDriverCreateCollectionForMultiStringProperty(&whitelistedFullImageNames, &pControlDeviceContext->whitelistedFullImageNames);
+    ntstatus = CreateWhitelist(&whitelistedFullImageNames, &configuration->whitelist);
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
-    // Query the multi-string property containing the black-listed device instance paths
+    // Query the multi-string property containing the black-listed device instance paths and compile it for matching
     DECLARE_CONST_UNICODE_STRING(blacklistedDeviceInstancePaths, DRIVER_PROPERTY_BLACKLISTED_DEVICE_INSTANCE_PATHS);
-    ntstatus = HidHideDriverCreateCollectionForMultiStringProperty(&blacklistedDeviceInstancePaths, &pControlDeviceContext->blacklistedDeviceInstancePaths);
+    ntstatus = CreateBlacklist(&blacklistedDeviceInstancePaths, &configuration->blacklist);
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
     // Query the boolean property indicating the activity state
     DECLARE_CONST_UNICODE_STRING(active, DRIVER_PROPERTY_ACTIVE);
-    ntstatus = HidHideDriverGetBooleanProperty(&active, &pControlDeviceContext->active);
+    ntstatus = HidHideDriverGetBooleanProperty(&active, &configuration->active);
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
     // Log the activity state
-    if (pControlDeviceContext->active)  LogEvent(ETW(Enabled), L"");
-    if (!pControlDeviceContext->active) LogEvent(ETW(Disabled), L"");
+    if (configuration->active)  LogEvent(ETW(Enabled), L"");
+    if (!configuration->active) LogEvent(ETW(Disabled), L"");
 
     // Query the boolean property indicating the inverse state
     DECLARE_CONST_UNICODE_STRING(whitelistedInverse, DRIVER_PROPERTY_WHITELISTED_INVERSE);
-    ntstatus = HidHideDriverGetBooleanProperty(&whitelistedInverse, &pControlDeviceContext->whitelistedInverse);
+    ntstatus = HidHideDriverGetBooleanProperty(&whitelistedInverse, &configuration->whitelistedInverse);
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
     return (STATUS_SUCCESS);
@@ -364,6 +616,21 @@ NTSTATUS OnControlDeviceIoDeviceControl(WDFDEVICE wdfControlDevice, WDFQUEUE wdf
     case IOCTL_CLR_SESSION_BLACKLIST:
         return (OnControlDeviceIoClearSessionBlacklist(wdfControlDevice, wdfQueue, wdfRequest, outputBufferLength, inputBufferLength, ioControlCode));
         break;
+    case IOCTL_DEL_SESSION_BLACKLIST:
+        return (OnControlDeviceIoDelSessionBlacklist(wdfControlDevice, wdfQueue, wdfRequest, outputBufferLength, inputBufferLength, ioControlCode));
+        break;
+    case IOCTL_ADD_SESSION_JAIL:
+        return (OnControlDeviceIoAddSessionJail(wdfControlDevice, wdfQueue, wdfRequest, outputBufferLength, inputBufferLength, ioControlCode));
+        break;
+    case IOCTL_DEL_SESSION_JAIL:
+        return (OnControlDeviceIoDelSessionJail(wdfControlDevice, wdfQueue, wdfRequest, outputBufferLength, inputBufferLength, ioControlCode));
+        break;
+    case IOCTL_CLR_SESSION_JAIL:
+        return (OnControlDeviceIoClearSessionJail(wdfControlDevice, wdfQueue, wdfRequest, outputBufferLength, inputBufferLength, ioControlCode));
+        break;
+    case IOCTL_GET_DEVICE_STATISTICS:
+        return (OnControlDeviceIoGetDeviceStatistics(wdfControlDevice, wdfQueue, wdfRequest, outputBufferLength, inputBufferLength, ioControlCode));
+        break;
     default:
         LOG_AND_RETURN_NTSTATUS(L"OnControlDeviceIoDeviceControl", STATUS_INVALID_PARAMETER);
     }
@@ -600,6 +867,10 @@ NTSTATUS OnControlDeviceIoAddSessionBlacklist(WDFDEVICE wdfControlDevice, WDFQUE
     HANDLE                  callerPid;
     size_t                  totalChars;
     LIST_ENTRY              localHead;
+    PLIST_ENTRY             ownerHead;
+    PLIST_ENTRY             owner;
+    PBLACKLIST_RECORD       record;
+    BOOLEAN                 added;
     LPWSTR                  current;
     PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
 
@@ -629,9 +900,9 @@ NTSTATUS OnControlDeviceIoAddSessionBlacklist(WDFDEVICE wdfControlDevice, WDFQUE
     {
         size_t remaining = totalChars - (size_t)(current - buffer);
         size_t len = wcsnlen(current, remaining);
-        if (len >= remaining)
+        if ((len >= remaining) || (len > (UNICODE_STRING_MAX_CHARS - 1)))
         {
-            // Malformed multi-string: no null terminator within buffer bounds
+            // Malformed multi-string: no null terminator within buffer bounds, or a path too long for a UNICODE_STRING
             ntstatus = STATUS_INVALID_PARAMETER;
             break;
         }
@@ -641,20 +912,43 @@ NTSTATUS OnControlDeviceIoAddSessionBlacklist(WDFDEVICE wdfControlDevice, WDFQUE
         path.Length = (USHORT)(len * sizeof(WCHAR));
         path.MaximumLength = path.Length + sizeof(WCHAR);
 
-        PSESSION_BLACKLIST_ENTRY entry = (PSESSION_BLACKLIST_ENTRY)ExAllocatePoolWithTag(NonPagedPool, sizeof(SESSION_BLACKLIST_ENTRY), 'lBSH');
+        // Prepare a record for the device instance path as well, as the caller may be the first to add it
+        // The owners have a fixed size hence come from the lookaside list, while a record is a single allocation with the path inline
+        PSESSION_BLACKLIST_ENTRY entry = (PSESSION_BLACKLIST_ENTRY)ExAllocateFromLookasideListEx(&pControlDeviceContext->sessionBlacklistLookasideList);
         if (NULL == entry)
         {
             ntstatus = STATUS_INSUFFICIENT_RESOURCES;
             break;
         }
+#pragma warning(disable: 4996)
+        entry->sessionRecord = (PSESSION_BLACKLIST_RECORD)ExAllocatePoolWithTag(NonPagedPoolNx, SESSION_BLACKLIST_RECORD_SIZE(path.Length), SESSION_BLACKLIST_RECORD_TAG);
+#pragma warning(default: 4996)
+        if (NULL == entry->sessionRecord)
+        {
+            ExFreeToLookasideListEx(&pControlDeviceContext->sessionBlacklistLookasideList, entry);
+            ntstatus = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
 
-        ntstatus = WdfStringCreate(&path, WDF_NO_OBJECT_ATTRIBUTES, &entry->deviceInstancePath);
+        // Fold the case and hash the device instance path before taking the lock, so that indexing it is all that remains
+        UNICODE_STRING upcasePath;
+        upcasePath.Buffer = &entry->sessionRecord->upcaseDeviceInstancePath[0];
+        upcasePath.Length = 0;
+        upcasePath.MaximumLength = path.Length;
+        ntstatus = RtlUpcaseUnicodeString(&upcasePath, &path, FALSE);
         if (!NT_SUCCESS(ntstatus))
         {
-            ExFreePoolWithTag(entry, 'lBSH');
+            ExFreePoolWithTag(entry->sessionRecord, SESSION_BLACKLIST_RECORD_TAG);
+            ExFreeToLookasideListEx(&pControlDeviceContext->sessionBlacklistLookasideList, entry);
             break;
         }
 
+        entry->sessionRecord->record.next = NULL;
+        entry->sessionRecord->record.upcaseDeviceInstancePath = &entry->sessionRecord->upcaseDeviceInstancePath[0];
+        entry->sessionRecord->record.length = (ULONG)(path.Length / sizeof(WCHAR));
+        entry->sessionRecord->record.hash = BlacklistHash(&entry->sessionRecord->upcaseDeviceInstancePath[0], entry->sessionRecord->record.length);
+        entry->sessionRecord->record.jailSessionId = 0;
+        entry->sessionRecord->referenceCount = 1;
         entry->ownerPid = callerPid;
         InsertTailList(&localHead, &entry->listEntry);
 
@@ -670,20 +964,49 @@ NTSTATUS OnControlDeviceIoAddSessionBlacklist(WDFDEVICE wdfControlDevice, WDFQUE
             PSESSION_BLACKLIST_ENTRY sbe = CONTAINING_RECORD(le, SESSION_BLACKLIST_ENTRY, listEntry);
             le = le->Flink;
             RemoveEntryList(&sbe->listEntry);
-            WdfObjectDelete(sbe->deviceInstancePath);
-            ExFreePoolWithTag(sbe, 'lBSH');
+            ExFreePoolWithTag(sbe->sessionRecord, SESSION_BLACKLIST_RECORD_TAG);
+            ExFreeToLookasideListEx(&pControlDeviceContext->sessionBlacklistLookasideList, sbe);
         }
         LOG_AND_RETURN_NTSTATUS(L"OnControlDeviceIoAddSessionBlacklist", ntstatus);
     }
 
-    // Splice local list into global list under lock — O(1), no allocations inside critical section
-    if (!IsListEmpty(&localHead))
+    // Index the new records and move the owners into the bucket of the caller under lock — no allocations inside critical section
+    // A device instance path already on the session blacklist is shared rather than indexed again, and owned by the caller at most once
+    added = FALSE;
+    ownerHead = &pControlDeviceContext->sessionBlacklistOwnerBuckets[SESSION_BLACKLIST_OWNER_BUCKET(callerPid)];
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+    while (!IsListEmpty(&localHead))
     {
-        WdfWaitLockAcquire(s_criticalSectionLock, NULL);
-        AppendTailList(&pControlDeviceContext->sessionBlacklistHead, &localHead);
-        WdfWaitLockRelease(s_criticalSectionLock);
+        PSESSION_BLACKLIST_ENTRY sbe = CONTAINING_RECORD(RemoveHeadList(&localHead), SESSION_BLACKLIST_ENTRY, listEntry);
+        record = BlacklistIndexFind(&pControlDeviceContext->sessionBlacklistIndex, sbe->sessionRecord->record.hash, sbe->sessionRecord->upcaseDeviceInstancePath, sbe->sessionRecord->record.length);
+        if (NULL == record)
+        {
+            BlacklistIndexInsert(&pControlDeviceContext->sessionBlacklistIndex, &sbe->sessionRecord->record);
+            added = TRUE;
+        }
+        else
+        {
+            ExFreePoolWithTag(sbe->sessionRecord, SESSION_BLACKLIST_RECORD_TAG);
+            sbe->sessionRecord = CONTAINING_RECORD(record, SESSION_BLACKLIST_RECORD, record);
+            for (owner = ownerHead->Flink; (owner != ownerHead); owner = owner->Flink)
+            {
+                if ((callerPid == CONTAINING_RECORD(owner, SESSION_BLACKLIST_ENTRY, listEntry)->ownerPid) && (sbe->sessionRecord == CONTAINING_RECORD(owner, SESSION_BLACKLIST_ENTRY, listEntry)->sessionRecord)) break;
+            }
+            if (owner != ownerHead)
+            {
+                ExFreeToLookasideListEx(&pControlDeviceContext->sessionBlacklistLookasideList, sbe);
+                continue;
+            }
+            sbe->sessionRecord->referenceCount++;
+        }
+        InsertTailList(ownerHead, &sbe->listEntry);
+        InterlockedIncrement(&pControlDeviceContext->sessionBlacklistOwnerCounts[SESSION_BLACKLIST_OWNER_BUCKET(callerPid)]);
     }
 
+    // Only a device instance path new to the session blacklist renders the verdicts cached stale
+    if (added) InterlockedIncrement(&s_BlacklistGeneration);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+
     WdfRequestCompleteWithInformation(wdfRequest, STATUS_SUCCESS, inputBufferLength);
     return (STATUS_SUCCESS);
 }
@@ -706,137 +1029,577 @@ NTSTATUS OnControlDeviceIoClearSessionBlacklist(WDFDEVICE wdfControlDevice, WDFQ
 }
 
 _Use_decl_annotations_
-VOID SessionBlacklistCleanupForPid(HANDLE processId)
+NTSTATUS OnControlDeviceIoDelSessionBlacklist(WDFDEVICE wdfControlDevice, WDFQUEUE wdfQueue, WDFREQUEST wdfRequest, size_t outputBufferLength, size_t inputBufferLength, ULONG ioControlCode)
 {
-    TRACE_PERFORMANCE(L"");
+    TRACE_ALWAYS(L"");
+    UNREFERENCED_PARAMETER(wdfControlDevice);
+    UNREFERENCED_PARAMETER(wdfQueue);
+    UNREFERENCED_PARAMETER(ioControlCode);
 
-    PCONTROL_DEVICE_CONTEXT  pControlDeviceContext;
-    PLIST_ENTRY              entry;
+    LPWSTR                   buffer;
+    NTSTATUS                 ntstatus;
+    HANDLE                   callerPid;
+    size_t                   totalChars;
+    size_t                   len;
+    LPWSTR                   current;
+    PLIST_ENTRY              ownerHead;
+    PLIST_ENTRY              owner;
     PSESSION_BLACKLIST_ENTRY sbe;
-    PLIST_ENTRY              next;
+    PBLACKLIST_RECORD        record;
+    ULONG                    bucket;
+    LONG                     removed;
+    BOOLEAN                  changed;
+    PCONTROL_DEVICE_CONTEXT  pControlDeviceContext;
 
-    if (NULL == s_wdfControlDevice) return;
+    // Same MULTI_SZ validation as for adding entries
+    if (0 != outputBufferLength) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    if (inputBufferLength < (2 * sizeof(WCHAR)))  LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    if (0 != (inputBufferLength % sizeof(WCHAR))) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
 
-    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
+    ntstatus = WdfRequestRetrieveInputBuffer(wdfRequest, inputBufferLength, &buffer, NULL);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"WdfRequestRetrieveInputBuffer", ntstatus);
 
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
+    totalChars = inputBufferLength / sizeof(WCHAR);
+    if ((buffer[totalChars - 1] != L'\0') || (buffer[totalChars - 2] != L'\0'))
+        LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
 
-    entry = pControlDeviceContext->sessionBlacklistHead.Flink;
-    while (entry != &pControlDeviceContext->sessionBlacklistHead)
+    // Nothing to remove when the caller doesn't own any entries, hence spare the lock
+    callerPid             = PsGetCurrentProcessId();
+    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
+    bucket                = SESSION_BLACKLIST_OWNER_BUCKET(callerPid);
+    if (0 == ReadAcquire(&pControlDeviceContext->sessionBlacklistOwnerCounts[bucket]))
     {
-        sbe  = CONTAINING_RECORD(entry, SESSION_BLACKLIST_ENTRY, listEntry);
-        next = entry->Flink;
+        WdfRequestCompleteWithInformation(wdfRequest, STATUS_SUCCESS, inputBufferLength);
+        return (STATUS_SUCCESS);
+    }
+
+    // The buffered input isn't copied back to the caller hence fold the case of the paths in place, before taking the lock
+    for (size_t index = 0; (index < totalChars); index++) buffer[index] = RtlUpcaseUnicodeChar(buffer[index]);
 
-        if (sbe->ownerPid == processId)
+    // Remove the owners of the caller in a single pass while holding the lock, so that the remaining entries stay in effect throughout
+    removed   = 0;
+    changed   = FALSE;
+    ownerHead = &pControlDeviceContext->sessionBlacklistOwnerBuckets[bucket];
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+    for (current = buffer; (L'\0' != *current); current += len + 1)
+    {
+        len = wcsnlen(current, totalChars - (size_t)(current - buffer));
+        record = BlacklistIndexFind(&pControlDeviceContext->sessionBlacklistIndex, BlacklistHash(current, (ULONG)len), current, (ULONG)len);
+        if (NULL == record) continue;
+        for (owner = ownerHead->Flink; (owner != ownerHead); owner = owner->Flink)
         {
-            RemoveEntryList(entry);
-            WdfObjectDelete(sbe->deviceInstancePath);
-            ExFreePoolWithTag(sbe, 'lBSH');
+            sbe = CONTAINING_RECORD(owner, SESSION_BLACKLIST_ENTRY, listEntry);
+            if ((callerPid != sbe->ownerPid) || (&sbe->sessionRecord->record != record)) continue;
+            RemoveEntryList(owner);
+            if (SessionBlacklistDisown(pControlDeviceContext, sbe)) changed = TRUE;
+            removed++;
+            break;
         }
+    }
+    if (0 != removed) InterlockedExchangeAdd(&pControlDeviceContext->sessionBlacklistOwnerCounts[bucket], -removed);
+
+    // Only a device instance path leaving the session blacklist renders the verdicts cached stale
+    if (changed) InterlockedIncrement(&s_BlacklistGeneration);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+
+    WdfRequestCompleteWithInformation(wdfRequest, STATUS_SUCCESS, inputBufferLength);
+    return (STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+NTSTATUS OnControlDeviceIoAddSessionJail(WDFDEVICE wdfControlDevice, WDFQUEUE wdfQueue, WDFREQUEST wdfRequest, size_t outputBufferLength, size_t inputBufferLength, ULONG ioControlCode)
+{
+    TRACE_ALWAYS(L"");
+    UNREFERENCED_PARAMETER(wdfControlDevice);
+    UNREFERENCED_PARAMETER(wdfQueue);
+    UNREFERENCED_PARAMETER(ioControlCode);
+
+    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
+    PSESSION_JAIL_ENTRY     sje;
+    PLIST_ENTRY             le;
+    LIST_ENTRY              localHead;
+    LPWSTR                  buffer;
+    BOOLEAN                 added;
+    NTSTATUS                ntstatus;
 
-        entry = next;
+    // MULTI_SZ must be at least two null WCHAR terminators (4 bytes) and a whole number of WCHARs
+    if (0 != outputBufferLength) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    if (inputBufferLength < (2 * sizeof(WCHAR)))  LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    if (0 != (inputBufferLength % sizeof(WCHAR))) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    ntstatus = WdfRequestRetrieveInputBuffer(wdfRequest, inputBufferLength, &buffer, NULL);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"WdfRequestRetrieveInputBuffer", ntstatus);
+
+    // Prepare all bindings before taking the lock so that either all are bound or none are
+    InitializeListHead(&localHead);
+    ntstatus = CreateSessionJailEntries(buffer, (inputBufferLength / sizeof(WCHAR)), &localHead);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"CreateSessionJailEntries", ntstatus);
+
+    // Index the bindings not bound already; those left on the local list are released afterwards
+    added = FALSE;
+    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+    for (le = localHead.Flink; (le != &localHead);)
+    {
+        sje = CONTAINING_RECORD(le, SESSION_JAIL_ENTRY, listEntry);
+        le = le->Flink;
+        if (NULL != SessionJailFind(&pControlDeviceContext->sessionJailIndex, sje->binding.hash, sje->binding.upcaseDeviceInstancePath, sje->binding.length, sje->binding.sessionId)) continue;
+        RemoveEntryList(&sje->listEntry);
+        SessionJailInsert(&pControlDeviceContext->sessionJailIndex, &sje->binding);
+        added = TRUE;
     }
 
-    WdfWaitLockRelease(s_criticalSectionLock);
+    // Only a change of the session jail renders the verdicts cached stale
+    if (added) InterlockedIncrement(&s_BlacklistGeneration);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+    DeleteSessionJailEntries(&localHead);
+
+    WdfRequestCompleteWithInformation(wdfRequest, STATUS_SUCCESS, inputBufferLength);
+    return (STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
-BOOLEAN Whitelisted(HANDLE processId, BOOLEAN* cacheHit)
+NTSTATUS OnControlDeviceIoDelSessionJail(WDFDEVICE wdfControlDevice, WDFQUEUE wdfQueue, WDFREQUEST wdfRequest, size_t outputBufferLength, size_t inputBufferLength, ULONG ioControlCode)
 {
-    TRACE_PERFORMANCE(L"");
+    TRACE_ALWAYS(L"");
+    UNREFERENCED_PARAMETER(wdfControlDevice);
+    UNREFERENCED_PARAMETER(wdfQueue);
+    UNREFERENCED_PARAMETER(ioControlCode);
+
+    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
+    PSESSION_JAIL_BINDING   binding;
+    PSESSION_JAIL_ENTRY     sje;
+    PLIST_ENTRY             le;
+    LIST_ENTRY              localHead;
+    LIST_ENTRY              removedHead;
+    LPWSTR                  buffer;
+    NTSTATUS                ntstatus;
+
+    // MULTI_SZ must be at least two null WCHAR terminators (4 bytes) and a whole number of WCHARs
+    if (0 != outputBufferLength) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    if (inputBufferLength < (2 * sizeof(WCHAR)))  LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    if (0 != (inputBufferLength % sizeof(WCHAR))) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    ntstatus = WdfRequestRetrieveInputBuffer(wdfRequest, inputBufferLength, &buffer, NULL);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"WdfRequestRetrieveInputBuffer", ntstatus);
+
+    // Parse the bindings requested the same way as when binding, so that they match regardless of their case
+    InitializeListHead(&localHead);
+    ntstatus = CreateSessionJailEntries(buffer, (inputBufferLength / sizeof(WCHAR)), &localHead);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"CreateSessionJailEntries", ntstatus);
+
+    // Unbind in a single pass while holding the lock; bindings that aren't present are ignored
+    InitializeListHead(&removedHead);
+    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+    for (le = localHead.Flink; (le != &localHead); le = le->Flink)
+    {
+        sje = CONTAINING_RECORD(le, SESSION_JAIL_ENTRY, listEntry);
+        binding = SessionJailFind(&pControlDeviceContext->sessionJailIndex, sje->binding.hash, sje->binding.upcaseDeviceInstancePath, sje->binding.length, sje->binding.sessionId);
+        if (NULL == binding) continue;
+        SessionJailRemove(&pControlDeviceContext->sessionJailIndex, binding);
+        InsertTailList(&removedHead, &CONTAINING_RECORD(binding, SESSION_JAIL_ENTRY, binding)->listEntry);
+    }
+
+    // Only a change of the session jail renders the verdicts cached stale
+    if (!IsListEmpty(&removedHead)) InterlockedIncrement(&s_BlacklistGeneration);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+    DeleteSessionJailEntries(&removedHead);
+    DeleteSessionJailEntries(&localHead);
+
+    WdfRequestCompleteWithInformation(wdfRequest, STATUS_SUCCESS, inputBufferLength);
+    return (STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+NTSTATUS OnControlDeviceIoClearSessionJail(WDFDEVICE wdfControlDevice, WDFQUEUE wdfQueue, WDFREQUEST wdfRequest, size_t outputBufferLength, size_t inputBufferLength, ULONG ioControlCode)
+{
+    TRACE_ALWAYS(L"");
+    UNREFERENCED_PARAMETER(wdfControlDevice);
+    UNREFERENCED_PARAMETER(wdfQueue);
+    UNREFERENCED_PARAMETER(ioControlCode);
 
     PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
+    PSESSION_JAIL_BINDING   binding;
+    LIST_ENTRY              removedHead;
+    PULONG                  buffer;
+    NTSTATUS                ntstatus;
+
+    // Validate buffer and retrieve the session id
+    if ((sizeof(ULONG) != inputBufferLength) || (0 != outputBufferLength)) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    ntstatus = WdfRequestRetrieveInputBuffer(wdfRequest, inputBufferLength, &buffer, NULL);
+    if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"WdfRequestRetrieveInputBuffer", ntstatus);
+
+    // The session index yields the bindings of the session without visiting those of other sessions
+    InitializeListHead(&removedHead);
+    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+    while (NULL != (binding = SessionJailFirstOfSession(&pControlDeviceContext->sessionJailIndex, *buffer)))
+    {
+        SessionJailRemove(&pControlDeviceContext->sessionJailIndex, binding);
+        InsertTailList(&removedHead, &CONTAINING_RECORD(binding, SESSION_JAIL_ENTRY, binding)->listEntry);
+    }
+
+    // Only a change of the session jail renders the verdicts cached stale
+    if (!IsListEmpty(&removedHead)) InterlockedIncrement(&s_BlacklistGeneration);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+    DeleteSessionJailEntries(&removedHead);
+
+    WdfRequestCompleteWithInformation(wdfRequest, STATUS_SUCCESS, inputBufferLength);
+    return (STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+NTSTATUS OnControlDeviceIoGetDeviceStatistics(WDFDEVICE wdfControlDevice, WDFQUEUE wdfQueue, WDFREQUEST wdfRequest, size_t outputBufferLength, size_t inputBufferLength, ULONG ioControlCode)
+{
+    TRACE_ALWAYS(L"");
+    UNREFERENCED_PARAMETER(wdfControlDevice);
+    UNREFERENCED_PARAMETER(wdfQueue);
+    UNREFERENCED_PARAMETER(ioControlCode);
 
+    PCONTROL_DEVICE_CONTEXT    pControlDeviceContext;
+    PDEVICE_CONTEXT            pDeviceContext;
+    PHIDHIDE_DEVICE_STATISTICS record;
+    UNICODE_STRING             deviceInstancePath;
+    PUCHAR                     buffer;
+    size_t                     neededSize;
+    NTSTATUS                   ntstatus;
+
+    // Validate buffer and retrieve the output buffer, when provided
+    if (0 != inputBufferLength) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_INVALID_PARAMETER);
+    buffer = NULL;
+    if (0 != outputBufferLength)
+    {
+        ntstatus = WdfRequestRetrieveOutputBuffer(wdfRequest, outputBufferLength, &buffer, NULL);
+        if (!NT_SUCCESS(ntstatus)) LOG_AND_RETURN_NTSTATUS(L"WdfRequestRetrieveOutputBuffer", ntstatus);
+    }
+
+    // Determine the size needed, and with an output buffer provided that is large enough, fill it in the same pass
+    // The counters are read while the devices update them, hence the figures of a record are consistent only as far as each counter goes
+    neededSize = 0;
     pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
-    BOOLEAN result = (STATUS_PROCESS_IN_JOB == HidHideProcessIdCheckFullImageNameAgainstWhitelist(s_criticalSectionLock, processId, pControlDeviceContext->whitelistedFullImageNames, cacheHit));
-    return GetInverse() ? !result : result;
+    ExEnterCriticalRegionAndAcquireResourceShared(&s_criticalSectionLock);
+    for (PLIST_ENTRY le = pControlDeviceContext->deviceHead.Flink; (le != &pControlDeviceContext->deviceHead); le = le->Flink)
+    {
+        pDeviceContext = CONTAINING_RECORD(le, DEVICE_CONTEXT, deviceListEntry);
+        WdfStringGetUnicodeString(pDeviceContext->deviceInstancePath, &deviceInstancePath);
+        if ((NULL != buffer) && ((neededSize + DEVICE_STATISTICS_RECORD_SIZE(deviceInstancePath.Length)) <= outputBufferLength))
+        {
+            record = (PHIDHIDE_DEVICE_STATISTICS)(buffer + neededSize);
+            RtlZeroMemory(record, DEVICE_STATISTICS_RECORD_SIZE(deviceInstancePath.Length));
+            record->recordSize               = (ULONG)DEVICE_STATISTICS_RECORD_SIZE(deviceInstancePath.Length);
+            record->deviceInstancePathLength = (deviceInstancePath.Length / sizeof(WCHAR));
+            record->opens                    = ReadNoFence64(&pDeviceContext->statistics.opens);
+            record->allows                   = ReadNoFence64(&pDeviceContext->statistics.allows);
+            record->denies                   = ReadNoFence64(&pDeviceContext->statistics.denies);
+            record->systemBypasses           = ReadNoFence64(&pDeviceContext->statistics.systemBypasses);
+            record->verdictCacheHits         = ReadNoFence64(&pDeviceContext->verdictCache.hits);
+            record->verdictCacheMisses       = ReadNoFence64(&pDeviceContext->verdictCache.misses);
+            for (ULONG bucket = 0; (bucket < HIDHIDE_LATENCY_BUCKETS); bucket++)
+            {
+                record->decisionLatency[bucket] = ReadNoFence64(&pDeviceContext->statistics.decisionLatency[bucket]);
+                record->forwardLatency[bucket]  = ReadNoFence64(&pDeviceContext->statistics.forwardLatency[bucket]);
+            }
+            RtlCopyMemory((record + 1), deviceInstancePath.Buffer, deviceInstancePath.Length);
+        }
+        neededSize += DEVICE_STATISTICS_RECORD_SIZE(deviceInstancePath.Length);
+    }
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+
+    // Fail when the output buffer proves too small, hence when it didn't get all records
+    if ((NULL != buffer) && (neededSize > outputBufferLength)) LOG_AND_RETURN_NTSTATUS(L"Validation", STATUS_BUFFER_TOO_SMALL);
+
+    WdfRequestCompleteWithInformation(wdfRequest, STATUS_SUCCESS, neededSize);
+    return (STATUS_SUCCESS);
 }
 
-void SplitDeviceData(PUNICODE_STRING input, PUNICODE_STRING deviceInstancePath, ULONG* sessionId)
+_Use_decl_annotations_
+NTSTATUS CreateSessionJailEntries(LPWSTR buffer, size_t bufferSizeInCharacters, PLIST_ENTRY head)
 {
-    // Initialize delimiter as '!'
-    WCHAR delimiter = L'!';
-    USHORT delimiterPosition = 0;
+    TRACE_ALWAYS(L"");
+
+    PSESSION_JAIL_ENTRY sje;
+    LIST_ENTRY          localHead;
+    UNICODE_STRING      path;
+    UNICODE_STRING      upcasePath;
+    LPWSTR              current;
+    size_t              remaining;
+    size_t              len;
+    ULONG               pathLength;
+    ULONG               sessionId;
+    NTSTATUS            ntstatus;
+
+    // Verify the buffer ends with a double-NUL as required by MULTI_SZ format
+    if ((bufferSizeInCharacters < 2) || (L'\0' != buffer[bufferSizeInCharacters - 1]) || (L'\0' != buffer[bufferSizeInCharacters - 2])) return (STATUS_INVALID_PARAMETER);
 
-    // Search for the delimiter in the input string
-    for (USHORT i = 0; i < input->Length / sizeof(WCHAR); i++)
+    InitializeListHead(&localHead);
+    ntstatus = STATUS_SUCCESS;
+    for (current = buffer; (((size_t)(current - buffer) < bufferSizeInCharacters) && (L'\0' != *current)); current += (len + 1))
     {
-        if (input->Buffer[i] == delimiter)
+        remaining = (bufferSizeInCharacters - (size_t)(current - buffer));
+        len = wcsnlen(current, remaining);
+        if ((len >= remaining) || (len > (UNICODE_STRING_MAX_CHARS - 1)))
         {
-            delimiterPosition = i;
+            ntstatus = STATUS_INVALID_PARAMETER;
             break;
         }
+
+        // Each entry should name a session, as there is no point in binding a device to no session at all
+        BlacklistSplit(current, (ULONG)len, &pathLength, &sessionId);
+        if ((pathLength == len) || (0 == sessionId))
+        {
+            ntstatus = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+#pragma warning(disable: 4996)
+        sje = (PSESSION_JAIL_ENTRY)ExAllocatePoolWithTag(NonPagedPoolNx, SESSION_JAIL_ENTRY_SIZE(pathLength * sizeof(WCHAR)), SESSION_JAIL_TAG);
+#pragma warning(default: 4996)
+        if (NULL == sje)
+        {
+            ntstatus = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        // Fold the case and hash the device instance path up front, so that binding it is all that remains
+        path.Buffer = current;
+        path.Length = (USHORT)(pathLength * sizeof(WCHAR));
+        path.MaximumLength = path.Length;
+        upcasePath.Buffer = &sje->upcaseDeviceInstancePath[0];
+        upcasePath.Length = 0;
+        upcasePath.MaximumLength = path.Length;
+        ntstatus = RtlUpcaseUnicodeString(&upcasePath, &path, FALSE);
+        if (!NT_SUCCESS(ntstatus))
+        {
+            ExFreePoolWithTag(sje, SESSION_JAIL_TAG);
+            break;
+        }
+        sje->binding.nextOfDevice = NULL;
+        sje->binding.nextOfSession = NULL;
+        sje->binding.upcaseDeviceInstancePath = &sje->upcaseDeviceInstancePath[0];
+        sje->binding.length = pathLength;
+        sje->binding.hash = BlacklistHash(&sje->upcaseDeviceInstancePath[0], pathLength);
+        sje->binding.sessionId = sessionId;
+        InsertTailList(&localHead, &sje->listEntry);
     }
 
-    // Set deviceInstancePath to the portion of the input before the delimiter
-    deviceInstancePath->Buffer = input->Buffer;
-    deviceInstancePath->Length = (delimiterPosition > 0) ? (delimiterPosition * sizeof(WCHAR)) : (input->Length);
-    deviceInstancePath->MaximumLength = deviceInstancePath->Length;
+    // Either hand over all entries or none at all
+    if (!NT_SUCCESS(ntstatus))
+    {
+        DeleteSessionJailEntries(&localHead);
+        return (ntstatus);
+    }
+    if (!IsListEmpty(&localHead)) AppendTailList(head, &localHead);
 
-    // Set a default session ID
-    *sessionId = 0;
+    return (STATUS_SUCCESS);
+}
 
-    // We have a jail session filter to work with
-    if (delimiterPosition > 0)
+_Use_decl_annotations_
+VOID DeleteSessionJailEntries(PLIST_ENTRY head)
+{
+    TRACE_ALWAYS(L"");
+
+    PSESSION_JAIL_ENTRY sje;
+
+    while (!IsListEmpty(head))
     {
-        // Set sessionIdString to the portion of the input after the delimiter
-        UNICODE_STRING sessionIdString;
-        sessionIdString.Buffer = &input->Buffer[delimiterPosition + 1]; // +1 to skip the delimiter
-        sessionIdString.Length = input->Length - ((delimiterPosition + 1) * sizeof(WCHAR));
-        sessionIdString.MaximumLength = sessionIdString.Length;
-
-        // Convert the sessionIdString to a ULONG
-        RtlUnicodeStringToInteger(&sessionIdString, 10, sessionId);
+        sje = CONTAINING_RECORD(RemoveHeadList(head), SESSION_JAIL_ENTRY, listEntry);
+        ExFreePoolWithTag(sje, SESSION_JAIL_TAG);
     }
 }
 
 _Use_decl_annotations_
-BOOLEAN Blacklisted(PUNICODE_STRING deviceInstancePath, ULONG sessionId)
+VOID SessionBlacklistCleanupForPid(HANDLE processId)
 {
     TRACE_PERFORMANCE(L"");
 
     PCONTROL_DEVICE_CONTEXT  pControlDeviceContext;
-    UNICODE_STRING           inputFilter;
-    UNICODE_STRING           blacklistedDeviceInstancePath;
-    ULONG                    jailSessionId;
+    PLIST_ENTRY              head;
     PLIST_ENTRY              entry;
     PSESSION_BLACKLIST_ENTRY sbe;
+    PLIST_ENTRY              next;
+    ULONG                    bucket;
+    LONG                     removed;
+    BOOLEAN                  changed;
+
+    if (NULL == s_wdfControlDevice) return;
+    removed = 0;
+    changed = FALSE;
 
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
+    // Called on every process exit in the system, hence bail out without taking the lock when the process can't own any entries
+    // Entries of a process are only added by the process itself, hence none get added to its bucket while it exits
     pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
+    bucket = SESSION_BLACKLIST_OWNER_BUCKET(processId);
+    if (0 == ReadAcquire(&pControlDeviceContext->sessionBlacklistOwnerCounts[bucket])) return;
 
-    // Check persistent blacklist
-    for (ULONG index1 = 0, size1 = WdfCollectionGetCount(pControlDeviceContext->blacklistedDeviceInstancePaths); (index1 < size1); index1++)
-    {
-        WdfStringGetUnicodeString(WdfCollectionGetItem(pControlDeviceContext->blacklistedDeviceInstancePaths, index1), &inputFilter); // PASSIVE_LEVEL
-        SplitDeviceData(&inputFilter, &blacklistedDeviceInstancePath, &jailSessionId);
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
 
-        if (0 == RtlCompareUnicodeString(&blacklistedDeviceInstancePath, deviceInstancePath, TRUE))
-        {
-            WdfWaitLockRelease(s_criticalSectionLock);
-            return (sessionId != 0 && jailSessionId != 0 && sessionId == jailSessionId ? FALSE : TRUE);
-        }
+    // Only visit the entries of the owners sharing the bucket of the process
+    head = &pControlDeviceContext->sessionBlacklistOwnerBuckets[bucket];
+    for (entry = head->Flink; (entry != head); entry = next)
+    {
+        sbe  = CONTAINING_RECORD(entry, SESSION_BLACKLIST_ENTRY, listEntry);
+        next = entry->Flink;
+        if (sbe->ownerPid != processId) continue;
+        RemoveEntryList(entry);
+        if (SessionBlacklistDisown(pControlDeviceContext, sbe)) changed = TRUE;
+        removed++;
     }
+    if (0 != removed) InterlockedExchangeAdd(&pControlDeviceContext->sessionBlacklistOwnerCounts[bucket], -removed);
 
-    // Check session (process-lifetime) blacklist
-    entry = pControlDeviceContext->sessionBlacklistHead.Flink;
-    while (entry != &pControlDeviceContext->sessionBlacklistHead)
-    {
-        sbe = CONTAINING_RECORD(entry, SESSION_BLACKLIST_ENTRY, listEntry);
-        WdfStringGetUnicodeString(sbe->deviceInstancePath, &inputFilter);
+    // Only a device instance path leaving the session blacklist renders the verdicts cached stale
+    if (changed) InterlockedIncrement(&s_BlacklistGeneration);
 
-        if (0 == RtlCompareUnicodeString(&inputFilter, deviceInstancePath, TRUE))
-        {
-            WdfWaitLockRelease(s_criticalSectionLock);
-            return (TRUE);
-        }
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+}
+
+_Use_decl_annotations_
+BOOLEAN SessionBlacklistDisown(PCONTROL_DEVICE_CONTEXT pControlDeviceContext, PSESSION_BLACKLIST_ENTRY entry)
+{
+    TRACE_PERFORMANCE(L"");
 
-        entry = entry->Flink;
+    PSESSION_BLACKLIST_RECORD sessionRecord;
+
+    // The record stays indexed for as long as any of the other owners remains
+    sessionRecord = entry->sessionRecord;
+    ExFreeToLookasideListEx(&pControlDeviceContext->sessionBlacklistLookasideList, entry);
+    if (0 != --sessionRecord->referenceCount) return (FALSE);
+    BlacklistIndexRemove(&pControlDeviceContext->sessionBlacklistIndex, &sessionRecord->record);
+    ExFreePoolWithTag(sessionRecord, SESSION_BLACKLIST_RECORD_TAG);
+    return (TRUE);
+}
+
+_Use_decl_annotations_
+BOOLEAN Whitelisted(PCONFIGURATION_SNAPSHOT configuration, HANDLE processId, BOOLEAN* cacheHit, BOOLEAN* processKnown)
+{
+    TRACE_PERFORMANCE(L"");
+
+    NTSTATUS ntstatus;
+
+    // The snapshot referenced keeps the whitelist alive while it is being evaluated hence there is no need for the lock
+    ntstatus = HidHideProcessIdCheckFullImageNameAgainstWhitelist(processId, configuration->whitelist, cacheHit);
+
+    // Processes started before the driver was loaded are unknown so register the caller (the open request runs in its context) on its first access
+    // Once registered, with or without an image name, the process is known hence this is attempted once per process; only a registration failing
+    // for lack of memory leaves the process unknown, and tried again on its next access
+    if ((STATUS_SUCCESS == ntstatus) && (NT_SUCCESS(RegisterProcess(PsGetCurrentProcess(), processId))))
+    {
+        ntstatus = HidHideProcessIdCheckFullImageNameAgainstWhitelist(processId, configuration->whitelist, cacheHit);
     }
 
-    WdfWaitLockRelease(s_criticalSectionLock);
+    // An unknown process may be registered later on, hence only the verdict for a known process is final
+    (*processKnown) = ((STATUS_PROCESS_IN_JOB == ntstatus) || (STATUS_PROCESS_NOT_IN_JOB == ntstatus));
 
-    return (FALSE);
+    BOOLEAN result = (STATUS_PROCESS_IN_JOB == ntstatus);
+    return configuration->whitelistedInverse ? !result : result;
+}
+
+_Use_decl_annotations_
+BOOLEAN DeviceBlacklisted(PDEVICE_CONTEXT pDeviceContext, PCONFIGURATION_SNAPSHOT configuration, ULONG sessionId)
+{
+    TRACE_PERFORMANCE(L"");
+
+    LONG    generation;
+    LONG64  stamp;
+    BOOLEAN bound;
+
+    // Recompute the verdict when the blacklist changed since it was cached, or when the snapshot evaluated got replaced meanwhile
+    // Take the generation before checking the snapshot as a configuration change publishes its snapshot before advancing the generation
+    generation = ReadAcquire(&s_BlacklistGeneration);
+    stamp = ReadAcquire64(&pDeviceContext->blacklistVerdict);
+    if ((BLACKLIST_VERDICT_GENERATION(stamp) != ((ULONG)generation & BLACKLIST_VERDICT_GENERATION_MASK)) || (!SnapshotIsCurrent(&ControlDeviceGetContext(s_wdfControlDevice)->configuration, &configuration->header))) stamp = DeviceRefreshBlacklistVerdict(pDeviceContext, configuration);
+
+    // A device jailed to a session remains accessible from that session
+    if (!BLACKLIST_VERDICT_BLACKLISTED(stamp)) return (FALSE);
+    if (0 == sessionId) return (TRUE);
+    if ((0 != BLACKLIST_VERDICT_JAIL_SESSION(stamp)) && (sessionId == BLACKLIST_VERDICT_JAIL_SESSION(stamp))) return (FALSE);
+
+    // Only a device bound to sessions in the session jail needs a probe for the session of the caller
+    if (!BLACKLIST_VERDICT_JAIL_BOUND(stamp)) return (TRUE);
+    ExEnterCriticalRegionAndAcquireResourceShared(&s_criticalSectionLock);
+    bound = (NULL != SessionJailFind(&ControlDeviceGetContext(s_wdfControlDevice)->sessionJailIndex, pDeviceContext->deviceInstancePathHash, pDeviceContext->upcaseDeviceInstancePath.Buffer, (pDeviceContext->upcaseDeviceInstancePath.Length / sizeof(WCHAR)), sessionId));
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+    return (bound ? FALSE : TRUE);
+}
+
+_Use_decl_annotations_
+LONG64 DeviceRefreshBlacklistVerdict(PDEVICE_CONTEXT pDeviceContext, PCONFIGURATION_SNAPSHOT configuration)
+{
+    TRACE_PERFORMANCE(L"");
+
+    ULONG   jailSessionId;
+    BOOLEAN blacklisted;
+    BOOLEAN jailBound;
+    BOOLEAN current;
+    LONG    generation;
+    LONG64  stamp;
+
+    // Take the generation while holding the lock as the blacklists and their generation only change while holding it exclusive
+    // The session blacklist and the session jail are mutable hence are only consulted under the lock; the persistent blacklist comes from the snapshot
+    ExEnterCriticalRegionAndAcquireResourceShared(&s_criticalSectionLock);
+    generation = ReadAcquire(&s_BlacklistGeneration);
+    current = SnapshotIsCurrent(&ControlDeviceGetContext(s_wdfControlDevice)->configuration, &configuration->header);
+    blacklisted = Blacklisted(configuration, &pDeviceContext->upcaseDeviceInstancePath, pDeviceContext->deviceInstancePathHash, &jailSessionId);
+    if ((!blacklisted) && (0 != pDeviceContext->upcaseContainerId.Length)) blacklisted = Blacklisted(configuration, &pDeviceContext->upcaseContainerId, pDeviceContext->containerIdHash, &jailSessionId);
+    jailBound = SessionJailBound(&ControlDeviceGetContext(s_wdfControlDevice)->sessionJailIndex, pDeviceContext->deviceInstancePathHash, pDeviceContext->upcaseDeviceInstancePath.Buffer, (pDeviceContext->upcaseDeviceInstancePath.Length / sizeof(WCHAR)));
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+
+    // Concurrent refreshes may race but a verdict stamped with an older generation is simply recomputed on the next access
+    // A verdict made against a snapshot that got replaced holds for the caller only, hence isn't cached under the generation of its successor
+    stamp = BLACKLIST_VERDICT_STAMP(generation, blacklisted, jailSessionId, jailBound);
+    if (current) InterlockedExchange64(&pDeviceContext->blacklistVerdict, stamp);
+    return (stamp);
+}
+
+_Use_decl_annotations_
+BOOLEAN Blacklisted(PCONFIGURATION_SNAPSHOT configuration, PCUNICODE_STRING upcaseDeviceInstancePath, ULONG hash, ULONG* jailSessionId)
+{
+    TRACE_PERFORMANCE(L"");
+
+    PCONTROL_DEVICE_CONTEXT  pControlDeviceContext;
+
+    // The caller holds the lock (at least shared) for the session blacklist
+    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
+
+    // Check persistent blacklist of the snapshot provided, compiled up front hence without parsing its entries
+    if (HidHideBlacklistContains(configuration->blacklist, hash, upcaseDeviceInstancePath, jailSessionId)) return (TRUE);
+
+    // Check session (process-lifetime) blacklist, through its index rather than walking the list
+    return ((NULL != BlacklistIndexFind(&pControlDeviceContext->sessionBlacklistIndex, hash, upcaseDeviceInstancePath->Buffer, (upcaseDeviceInstancePath->Length / sizeof(WCHAR)))) ? TRUE : FALSE);
+}
+
+_Use_decl_annotations_
+NTSTATUS CreateWhitelist(PCUNICODE_STRING valueName, PHIDHIDE_WHITELIST* whitelist)
+{
+    TRACE_ALWAYS(L"");
+
+    WDFCOLLECTION wdfCollection;
+    NTSTATUS      ntstatus;
+
+    // The string collection is only needed for compiling the whitelist
+    ntstatus = HidHideDriverCreateCollectionForMultiStringProperty(valueName, &wdfCollection);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+    ntstatus = HidHideWhitelistCreate(wdfCollection, whitelist);
+    WdfObjectDelete(wdfCollection);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+
+    return (STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+NTSTATUS CreateBlacklist(PCUNICODE_STRING valueName, PHIDHIDE_BLACKLIST* blacklist)
+{
+    TRACE_ALWAYS(L"");
+
+    WDFCOLLECTION wdfCollection;
+    NTSTATUS      ntstatus;
+
+    // The string collection is only needed for compiling the blacklist
+    ntstatus = HidHideDriverCreateCollectionForMultiStringProperty(valueName, &wdfCollection);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+    ntstatus = HidHideBlacklistCreate(wdfCollection, blacklist);
+    WdfObjectDelete(wdfCollection);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+
+    return (STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
@@ -864,24 +1627,27 @@ NTSTATUS SetWhitelist(LPWSTR buffer, size_t bufferSizeInCharacters)
 {
     TRACE_ALWAYS(L"");
 
-    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
-    NTSTATUS                ntstatus;
+    CONFIGURATION_SNAPSHOT changes;
+    NTSTATUS               ntstatus;
 
     // Persist the new setting in the registry
     DECLARE_CONST_UNICODE_STRING(parameterName, DRIVER_PROPERTY_WHITELISTED_FULL_IMAGE_NAMES);
     ntstatus = HidHideDriverSetMultiStringProperty(&parameterName, buffer, bufferSizeInCharacters);
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
-    // Dispose the old setting and apply the new setting
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
-    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
-    WdfObjectDelete(pControlDeviceContext->whitelistedFullImageNames);
-    ntstatus = HidHideDriverCreateCollectionForMultiStringProperty(&parameterName, &pControlDeviceContext->whitelistedFullImageNames);
-    WdfWaitLockRelease(s_criticalSectionLock);
+    // Compile the new setting before publishing it so that the access decisions aren't held up meanwhile
+    RtlZeroMemory(&changes, sizeof(changes));
+    ntstatus = CreateWhitelist(&parameterName, &changes.whitelist);
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
-    // Flush the evaluation cache as it is no longer accurate
-    HidHideProcessIdsFlushWhitelistEvaluationCache(s_criticalSectionLock);
+    // Apply the new setting; the old setting is disposed once the last access decision using it is done
+    // The evaluation cache needs no flush as the new whitelist comes with a generation of its own
+    ntstatus = ConfigurationReplace(CONFIGURATION_WHITELIST, &changes);
+    if (!NT_SUCCESS(ntstatus))
+    {
+        HidHideWhitelistDelete(changes.whitelist);
+        return (ntstatus);
+    }
 
     return (STATUS_SUCCESS);
 }
@@ -911,22 +1677,27 @@ NTSTATUS SetBlacklist(LPWSTR buffer, size_t bufferSizeInCharacters)
 {
     TRACE_ALWAYS(L"");
 
-    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
-    NTSTATUS                ntstatus;
+    CONFIGURATION_SNAPSHOT changes;
+    NTSTATUS               ntstatus;
 
     // Persist the new setting in the registry
     DECLARE_CONST_UNICODE_STRING(parameterName, DRIVER_PROPERTY_BLACKLISTED_DEVICE_INSTANCE_PATHS);
     ntstatus = HidHideDriverSetMultiStringProperty(&parameterName, buffer, bufferSizeInCharacters);
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
-    // Dispose the old setting and apply the new setting
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
-    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
-    WdfObjectDelete(pControlDeviceContext->blacklistedDeviceInstancePaths);
-    ntstatus = HidHideDriverCreateCollectionForMultiStringProperty(&parameterName, &pControlDeviceContext->blacklistedDeviceInstancePaths);
-    WdfWaitLockRelease(s_criticalSectionLock);
+    // Compile the new setting before publishing it so that the access decisions aren't held up meanwhile
+    RtlZeroMemory(&changes, sizeof(changes));
+    ntstatus = CreateBlacklist(&parameterName, &changes.blacklist);
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
+    // Apply the new setting; the old setting is disposed once the last access decision using it is done
+    ntstatus = ConfigurationReplace(CONFIGURATION_BLACKLIST, &changes);
+    if (!NT_SUCCESS(ntstatus))
+    {
+        HidHideBlacklistDelete(changes.blacklist);
+        return (ntstatus);
+    }
+
     return (STATUS_SUCCESS);
 }
 
@@ -935,13 +1706,12 @@ BOOLEAN GetActive()
 {
     TRACE_PERFORMANCE(L"");
 
-    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
+    PCONFIGURATION_SNAPSHOT configuration;
     BOOLEAN                 active;
 
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
-    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
-    active = pControlDeviceContext->active;
-    WdfWaitLockRelease(s_criticalSectionLock);
+    configuration = ConfigurationAcquire();
+    active = configuration->active;
+    ConfigurationRelease(configuration);
 
     return (active);
 }
@@ -951,9 +1721,9 @@ NTSTATUS SetActive(BOOLEAN active)
 {
     TRACE_PERFORMANCE(L"");
 
-    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
-    BOOLEAN                 changed;
-    NTSTATUS                ntstatus;
+    CONFIGURATION_SNAPSHOT changes;
+    BOOLEAN                changed;
+    NTSTATUS               ntstatus;
 
     // Persist the new setting in the registry
     DECLARE_CONST_UNICODE_STRING(parameterName, DRIVER_PROPERTY_ACTIVE);
@@ -961,11 +1731,11 @@ NTSTATUS SetActive(BOOLEAN active)
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
     // Apply the new setting
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
-    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
-    changed = (pControlDeviceContext->active != active);
-    pControlDeviceContext->active = active;
-    WdfWaitLockRelease(s_criticalSectionLock);
+    RtlZeroMemory(&changes, sizeof(changes));
+    changes.active = active;
+    ntstatus = ConfigurationReplace(CONFIGURATION_ACTIVE, &changes);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+    changed = (changes.active != active);
 
     // Log service active changes
     if ((changed) && (active))  LogEvent(ETW(Enabled),  L"");
@@ -979,13 +1749,12 @@ BOOLEAN GetInverse()
 {
     TRACE_PERFORMANCE(L"");
 
-    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
+    PCONFIGURATION_SNAPSHOT configuration;
     BOOLEAN                 inverse;
 
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
-    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
-    inverse = pControlDeviceContext->whitelistedInverse;
-    WdfWaitLockRelease(s_criticalSectionLock);
+    configuration = ConfigurationAcquire();
+    inverse = configuration->whitelistedInverse;
+    ConfigurationRelease(configuration);
 
     return (inverse);
 }
@@ -995,9 +1764,9 @@ NTSTATUS SetInverse(BOOLEAN inverse)
 {
     TRACE_PERFORMANCE(L"");
 
-    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
-    BOOLEAN                 changed;
-    NTSTATUS                ntstatus;
+    CONFIGURATION_SNAPSHOT changes;
+    BOOLEAN                changed;
+    NTSTATUS               ntstatus;
 
     // Persist the new setting in the registry
     DECLARE_CONST_UNICODE_STRING(parameterName, DRIVER_PROPERTY_WHITELISTED_INVERSE);
@@ -1005,11 +1774,11 @@ NTSTATUS SetInverse(BOOLEAN inverse)
     if (!NT_SUCCESS(ntstatus)) return (ntstatus);
 
     // Apply the new setting
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
-    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
-    changed = (pControlDeviceContext->whitelistedInverse != inverse);
-    pControlDeviceContext->whitelistedInverse = inverse;
-    WdfWaitLockRelease(s_criticalSectionLock);
+    RtlZeroMemory(&changes, sizeof(changes));
+    changes.whitelistedInverse = inverse;
+    ntstatus = ConfigurationReplace(CONFIGURATION_INVERSE, &changes);
+    if (!NT_SUCCESS(ntstatus)) return (ntstatus);
+    changed = (changes.whitelistedInverse != inverse);
 
     // Log service inverse changes
     if ((changed) && (inverse))  LogEvent(ETW(Enabled), L"");
@@ -1018,6 +1787,80 @@ NTSTATUS SetInverse(BOOLEAN inverse)
     return (STATUS_SUCCESS);
 }
 
+_Use_decl_annotations_
+PCONFIGURATION_SNAPSHOT ConfigurationAcquire()
+{
+    TRACE_PERFORMANCE(L"");
+
+    return (CONTAINING_RECORD(SnapshotAcquire(&ControlDeviceGetContext(s_wdfControlDevice)->configuration), CONFIGURATION_SNAPSHOT, header));
+}
+
+_Use_decl_annotations_
+VOID ConfigurationRelease(PCONFIGURATION_SNAPSHOT configuration)
+{
+    TRACE_PERFORMANCE(L"");
+
+    SnapshotRelease(&configuration->header);
+}
+
+_Use_decl_annotations_
+NTSTATUS ConfigurationReplace(ULONG settings, PCONFIGURATION_SNAPSHOT changes)
+{
+    TRACE_ALWAYS(L"");
+
+    PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
+    PCONFIGURATION_SNAPSHOT current;
+    PCONFIGURATION_SNAPSHOT configuration;
+    PSNAPSHOT_HEADER        previous;
+    BOOLEAN                 active;
+    BOOLEAN                 whitelistedInverse;
+
+    // Allocate the new snapshot before taking the lock
+#pragma warning(disable: 4996)
+    configuration = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(CONFIGURATION_SNAPSHOT), CONFIGURATION_TAG);
+#pragma warning(default: 4996)
+    if (NULL == configuration) LOG_AND_RETURN_NTSTATUS(L"ExAllocatePoolWithTag", STATUS_NO_MEMORY);
+    SnapshotInitialize(&configuration->header, OnConfigurationCleanup);
+
+    // Hold the lock exclusive so that the publishers are serialized, and so that the verdict refreshes see the blacklist and its generation change together
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
+    pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
+    current = CONTAINING_RECORD(pControlDeviceContext->configuration.current, CONFIGURATION_SNAPSHOT, header);
+    active             = current->active;
+    whitelistedInverse = current->whitelistedInverse;
+
+    // Take the settings selected from the changes, and share the lists not selected with the current snapshot
+    configuration->active             = ((CONFIGURATION_ACTIVE    & settings) ? changes->active             : current->active);
+    configuration->whitelistedInverse = ((CONFIGURATION_INVERSE   & settings) ? changes->whitelistedInverse : current->whitelistedInverse);
+    configuration->whitelist          = ((CONFIGURATION_WHITELIST & settings) ? changes->whitelist          : ((NULL == current->whitelist) ? NULL : HidHideWhitelistReference(current->whitelist)));
+    configuration->blacklist          = ((CONFIGURATION_BLACKLIST & settings) ? changes->blacklist          : ((NULL == current->blacklist) ? NULL : HidHideBlacklistReference(current->blacklist)));
+    configuration->generation = InterlockedIncrement(&s_ConfigurationGeneration);
+    previous = SnapshotPublish(&pControlDeviceContext->configuration, &configuration->header);
+
+    // Advance the blacklist generation only after publishing, so that an access decision seeing the new generation also sees the new snapshot published
+    if (CONFIGURATION_BLACKLIST & settings) InterlockedIncrement(&s_BlacklistGeneration);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
+
+    // Report the states replaced, and dispose the previous snapshot once the last access decision using it is done
+    changes->active             = active;
+    changes->whitelistedInverse = whitelistedInverse;
+    SnapshotRelease(previous);
+
+    return (STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+VOID OnConfigurationCleanup(PSNAPSHOT_HEADER header)
+{
+    TRACE_ALWAYS(L"");
+
+    PCONFIGURATION_SNAPSHOT configuration = CONTAINING_RECORD(header, CONFIGURATION_SNAPSHOT, header);
+
+    HidHideWhitelistDelete(configuration->whitelist);
+    HidHideBlacklistDelete(configuration->blacklist);
+    ExFreePoolWithTag(configuration, CONFIGURATION_TAG);
+}
+
 _Use_decl_annotations_
 VOID UpdateDataForControlDeviceDeletionAndDeleteControlDeviceWhenNeeded(INT32 increment)
 {
@@ -1026,7 +1869,7 @@ VOID UpdateDataForControlDeviceDeletionAndDeleteControlDeviceWhenNeeded(INT32 in
     PCONTROL_DEVICE_CONTEXT pControlDeviceContext;
     BOOLEAN                 deleteControlDevice;
 
-    WdfWaitLockAcquire(s_criticalSectionLock, NULL);
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&s_criticalSectionLock);
     pControlDeviceContext = ControlDeviceGetContext(s_wdfControlDevice);
 
     // Memorize the fact that we are in a shutdown state
@@ -1035,7 +1878,7 @@ VOID UpdateDataForControlDeviceDeletionAndDeleteControlDeviceWhenNeeded(INT32 in
     // When we are in a shutdown state and this is the last device then we should delete the control device
     pControlDeviceContext->numberOfDevicesCreated += increment;
     deleteControlDevice = (((0 == pControlDeviceContext->numberOfDevicesCreated) && (pControlDeviceContext->shutdownPending)) ? TRUE : FALSE);
-    WdfWaitLockRelease(s_criticalSectionLock);
+    ExReleaseResourceAndLeaveCriticalRegion(&s_criticalSectionLock);
 
     // Delete the control device either when
     // - we just entered the shutdown state and have no devices pending or
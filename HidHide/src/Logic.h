@@ -6,6 +6,10 @@
 // Undocumented ntddk function that allows easy access to the session ID field in the opaque EPROCESS structure
 ULONG PsGetProcessSessionId(PEPROCESS process);
 
+// Documented in ntifs.h, which can't be combined with ntddk.h, hence declare it here
+// On success the caller becomes responsible for releasing the image name returned with ExFreePool
+NTSTATUS SeLocateProcessImageName(PEPROCESS process, PUNICODE_STRING* imageFileName);
+
 #define DEVICE_HARDWARE_ID                                L"root\\HidHide"
 #define CONTROL_DEVICE_NT_DEVICE_NAME                     L"\\Device\\HidHide"
 #define CONTROL_DEVICE_DOS_DEVICE_NAME                    L"\\DosDevices\\HidHide"
@@ -13,30 +17,93 @@ ULONG PsGetProcessSessionId(PEPROCESS process);
 #define DRIVER_PROPERTY_BLACKLISTED_DEVICE_INSTANCE_PATHS L"BlacklistedDeviceInstancePaths" // HKLM\SYSTEM\CurrentControlSet\Services\HidHide\Parameters\BlacklistedDeviceInstancePaths (REG_MULTI_Z)
 #define DRIVER_PROPERTY_ACTIVE                            L"Active"                         // HKLM\SYSTEM\CurrentControlSet\Services\HidHide\Parameters\Active (DWORD)
 #define DRIVER_PROPERTY_WHITELISTED_INVERSE               L"WhitelistedInverse"             // HKLM\SYSTEM\CurrentControlSet\Services\HidHide\Parameters\WhitelistedInverse (DWORD)
+#define DRIVER_PROPERTY_PROCESS_ID_SHARDS                 L"ProcessIdShards"                // HKLM\SYSTEM\CurrentControlSet\Services\HidHide\Parameters\ProcessIdShards (DWORD)
 
 #include "HidHideIoctlContract.h"
+#include "Config.h"
+#include "Histogram.h"
+#include "Blacklist.h"
+#include "SessionJail.h"
+#include "Snapshot.h"
+#include "VerdictCache.h"
+
+// The number of hash buckets of the session blacklist index (a power of two)
+#define SESSION_BLACKLIST_BUCKETS 256
+
+// The number of owner buckets of the session blacklist (a power of two)
+#define SESSION_BLACKLIST_OWNER_BUCKETS 64
+
+// Select the owner bucket for a process id; process ids are a multiple of four hence the two lowest bits are dropped
+#define SESSION_BLACKLIST_OWNER_BUCKET(processId) (((((ULONG)(ULONG_PTR)(processId)) >> 2) * 2654435761UL >> 16) & (SESSION_BLACKLIST_OWNER_BUCKETS - 1))
+
+// The number of hash buckets of the session jail index (a power of two)
+#define SESSION_JAIL_BUCKETS 256
 
 // {0C320FF7-BD9B-42B6-BDAF-49FEB9C91649}
 DEFINE_GUID(HidHideInterfaceGuid, 0xc320ff7, 0xbd9b, 0x42b6, 0xbd, 0xaf, 0x49, 0xfe, 0xb9, 0xc9, 0x16, 0x49);
 
+// The open request counters and latency histograms of a device (see IOCTL_GET_DEVICE_STATISTICS)
+// Updated with interlocked operations only, hence a snapshot taken may be off by the opens in flight
+typedef struct _DEVICE_STATISTICS
+{
+    volatile LONG64 opens;
+    volatile LONG64 allows;
+    volatile LONG64 denies;
+    volatile LONG64 systemBypasses;
+    volatile LONG64 decisionLatency[HIDHIDE_LATENCY_BUCKETS];
+    volatile LONG64 forwardLatency[HIDHIDE_LATENCY_BUCKETS];
+} DEVICE_STATISTICS, *PDEVICE_STATISTICS;
+
 // The administration maintained per device (0 .. *)
 typedef struct _DEVICE_CONTEXT
 {
+    // Entry on the list of devices of the control device, so that the statistics of all devices can be reported
+    LIST_ENTRY deviceListEntry;
+
     // The unique device instance path of this device, suitable as input for CreateFile
     WDFSTRING deviceInstancePath;
 
+    // The device instance path in its upper-case form and its hash (see BlacklistHash), as matched against the compiled blacklist
+    UNICODE_STRING upcaseDeviceInstancePath;
+    ULONG deviceInstancePathHash;
+
+    // The container id of the physical device this device belongs to, in its upper-case textual form, and its hash (see BlacklistHash)
+    // Matched against the blacklist as the device instance path is, so that a single entry covers all devices of the container; empty when there is none
+    UNICODE_STRING upcaseContainerId;
+    ULONG containerIdHash;
+    WCHAR upcaseContainerIdBuffer[BLACKLIST_CONTAINER_ID_LENGTH];
+
+    // The blacklist verdict for this device, stamped with the blacklist generation it was computed for (see BLACKLIST_VERDICT_STAMP)
+    // As the device instance path never changes, the verdict only needs recomputing after a blacklist change
+    volatile LONG64 blacklistVerdict;
+
+    // The access decisions made for the processes opening this device, so that repeated opens by the same process only take a single probe
+    VERDICT_CACHE verdictCache;
+
+    // The open requests seen by this device and the time spent on them
+    DEVICE_STATISTICS statistics;
+
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
 
-// The administration shared by all devices (0 .. 1)
-typedef struct _CONTROL_DEVICE_CONTEXT
+// The administration maintained per request passed down the stack of a device
+typedef struct _REQUEST_CONTEXT
 {
-    // Collection of string objects containing the full image names of applications that will be granted access to blacklisted human interface devices
-    WDFCOLLECTION whitelistedFullImageNames;
+    // The performance counter value at the time the request was sent to the lower stack
+    LONGLONG forwardTime;
+} REQUEST_CONTEXT, *PREQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, RequestGetContext)
 
-    // Collection of string objects containing the device instance paths of the human interface devices (HID) that are subject to access control
-    WDFCOLLECTION blacklistedDeviceInstancePaths;
+// Read-only snapshot of the configuration evaluated by the access decisions
+// A snapshot never changes once published; a configuration change publishes a new snapshot in its place
+typedef struct _CONFIGURATION_SNAPSHOT
+{
+    SNAPSHOT_HEADER header;
+
+    // Unique for each snapshot published, so that verdicts cached against a previous snapshot are recognized as stale
+    LONG generation;
 
     // The device active (enabled) state
     BOOLEAN active;
@@ -44,23 +111,89 @@ typedef struct _CONTROL_DEVICE_CONTEXT
     // The whitelisted inverse (enabled) state
     BOOLEAN whitelistedInverse;
 
-    // Collection of SESSION_BLACKLIST_ENTRY structures for process-lifetime blacklist entries
+    // The full image names of applications that will be granted access to blacklisted human interface devices, compiled for matching
+    PHIDHIDE_WHITELIST whitelist;
+
+    // The device instance paths of the human interface devices (HID) that are subject to access control, compiled for matching
+    PHIDHIDE_BLACKLIST blacklist;
+} CONFIGURATION_SNAPSHOT, *PCONFIGURATION_SNAPSHOT;
+
+// Flags selecting the settings replaced by ConfigurationReplace
+#define CONFIGURATION_ACTIVE    0x00000001
+#define CONFIGURATION_INVERSE   0x00000002
+#define CONFIGURATION_WHITELIST 0x00000004
+#define CONFIGURATION_BLACKLIST 0x00000008
+
+// The administration shared by all devices (0 .. 1)
+typedef struct _CONTROL_DEVICE_CONTEXT
+{
+    // The configuration snapshot currently published, read by the access decisions without taking the lock
+    SNAPSHOT_SLOT configuration;
+
+    // Collections of SESSION_BLACKLIST_ENTRY structures for process-lifetime blacklist entries, bucketed on the process id of their owner
     // Entries are automatically removed when the registering process exits
-    LIST_ENTRY sessionBlacklistHead;
+    LIST_ENTRY sessionBlacklistOwnerBuckets[SESSION_BLACKLIST_OWNER_BUCKETS];
+
+    // The number of entries in each owner bucket, changed while holding the lock exclusive but read without it
+    // A process exiting without entries in its bucket, hence any process when the session blacklist is empty, doesn't take the lock
+    volatile LONG sessionBlacklistOwnerCounts[SESSION_BLACKLIST_OWNER_BUCKETS];
+
+    // The owners of the session blacklist records come from a lookaside list, as processes add and clear them all the time
+    LOOKASIDE_LIST_EX sessionBlacklistLookasideList;
+    BOOLEAN sessionBlacklistLookasideListInitialized;
+
+    // Hash index over the records of the session blacklist entries, so that a lookup doesn't have to walk the list
+    BLACKLIST_INDEX sessionBlacklistIndex;
+    PBLACKLIST_RECORD sessionBlacklistBuckets[SESSION_BLACKLIST_BUCKETS];
+
+    // Bindings of blacklisted devices to the sessions still granted access to them (see IOCTL_ADD_SESSION_JAIL)
+    // Bindings remain till unbound, regardless of the process that bound them, and are indexed on both the device and the session
+    SESSION_JAIL_INDEX sessionJailIndex;
+    PSESSION_JAIL_BINDING sessionJailDeviceBuckets[SESSION_JAIL_BUCKETS];
+    PSESSION_JAIL_BINDING sessionJailSessionBuckets[SESSION_JAIL_BUCKETS];
+
+    // Collection of the DEVICE_CONTEXT structures of the filter devices present
+    LIST_ENTRY deviceHead;
 
     // During a shutdown we may only delete the control device object after the last device is removed so keep track of the number of devices and shutdown state
     BOOLEAN shutdownPending;
     INT32 numberOfDevicesCreated;
 } CONTROL_DEVICE_CONTEXT, *PCONTROL_DEVICE_CONTEXT;
 
-// An entry in the process-lifetime (session) blacklist
+// A device instance path on the process-lifetime (session) blacklist, shared by all processes that added it
+// Only one record is indexed per device instance path hence the lookup cost depends on the devices rather than on the registrations
+// The device instance path is stored inline, in its upper-case form, at its actual length
+typedef struct _SESSION_BLACKLIST_RECORD
+{
+    BLACKLIST_RECORD record;
+    LONG             referenceCount; // The number of owners, changed while holding the lock exclusive
+    WCHAR            upcaseDeviceInstancePath[ANYSIZE_ARRAY];
+} SESSION_BLACKLIST_RECORD, *PSESSION_BLACKLIST_RECORD;
+
+// The size needed for a session blacklist record holding a device instance path of a given length
+#define SESSION_BLACKLIST_RECORD_SIZE(deviceInstancePathLengthInBytes) (FIELD_OFFSET(SESSION_BLACKLIST_RECORD, upcaseDeviceInstancePath) + (size_t)(deviceInstancePathLengthInBytes))
+
+// An owner of a session blacklist record, listed in the owner bucket of its owner process
+// A process owns a record at most once, regardless of the number of times it added the device instance path
 typedef struct _SESSION_BLACKLIST_ENTRY
 {
-    LIST_ENTRY  listEntry;
-    HANDLE      ownerPid;
-    WDFSTRING   deviceInstancePath;
+    LIST_ENTRY                listEntry;
+    HANDLE                    ownerPid;
+    PSESSION_BLACKLIST_RECORD sessionRecord;
 } SESSION_BLACKLIST_ENTRY, *PSESSION_BLACKLIST_ENTRY;
 
+// A binding of a device to a session in the session jail
+// The list entry is only used while the bindings requested are prepared; the device instance path is stored inline, in its upper-case form
+typedef struct _SESSION_JAIL_ENTRY
+{
+    LIST_ENTRY           listEntry;
+    SESSION_JAIL_BINDING binding;
+    WCHAR                upcaseDeviceInstancePath[ANYSIZE_ARRAY];
+} SESSION_JAIL_ENTRY, *PSESSION_JAIL_ENTRY;
+
+// The size needed for a session jail entry holding a device instance path of a given length
+#define SESSION_JAIL_ENTRY_SIZE(deviceInstancePathLengthInBytes) (FIELD_OFFSET(SESSION_JAIL_ENTRY, upcaseDeviceInstancePath) + (size_t)(deviceInstancePathLengthInBytes))
+
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_DEVICE_CONTEXT, ControlDeviceGetContext)
 
 EXTERN_C_START
@@ -69,10 +202,7 @@ EXTERN_C_START
 EVT_WDF_DEVICE_SHUTDOWN_NOTIFICATION OnSystemShutdown;
 
 // Notification handler called on the system-wide creation and deletion of (any) processes
-CREATE_PROCESS_NOTIFY_ROUTINE OnSystemProcessChange;
-
-// Notification handler called whenever (any) image is loaded (or mapped into memory)
-LOAD_IMAGE_NOTIFY_ROUTINE OnSystemLoadImage;
+CREATE_PROCESS_NOTIFY_ROUTINE_EX OnSystemProcessChange;
 
 // Notification handler called when either the framework or a driver attempts to delete the device object
 EVT_WDF_DEVICE_CONTEXT_CLEANUP OnDeviceContextCleanup;
@@ -100,6 +230,11 @@ _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NTSTATUS OnDriverCreate(_In_ WDFDRIVER wdfDriver);
 
+// Hook called before having the driver unloaded
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID OnDriverUnload(_In_ WDFDRIVER wdfDriver);
+
 // Hook called after having a device created
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -166,21 +301,103 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS OnControlDeviceIoClearSessionBlacklist(_In_ WDFDEVICE wdfDevice, _In_ WDFQUEUE wdfQueue, _In_ WDFREQUEST wdfRequest, _In_ size_t outputBufferLength, _In_ size_t inputBufferLength, _In_ ULONG ioControlCode);
 
+// Handle DelSessionBlacklist I/O request — removes the device instance paths provided from the session blacklist entries of the calling process
+// Paths the calling process doesn't hold on its session blacklist are ignored
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS OnControlDeviceIoDelSessionBlacklist(_In_ WDFDEVICE wdfDevice, _In_ WDFQUEUE wdfQueue, _In_ WDFREQUEST wdfRequest, _In_ size_t outputBufferLength, _In_ size_t inputBufferLength, _In_ ULONG ioControlCode);
+
+// Handle AddSessionJail I/O request — binds blacklisted devices to sessions that remain granted access to them
+// Each entry holds a device instance path and a session id, delimited as in the blacklist (e.g. HID\VID_054C&PID_09CC\7&1C2F3B9A&0&0000!2)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS OnControlDeviceIoAddSessionJail(_In_ WDFDEVICE wdfDevice, _In_ WDFQUEUE wdfQueue, _In_ WDFREQUEST wdfRequest, _In_ size_t outputBufferLength, _In_ size_t inputBufferLength, _In_ ULONG ioControlCode);
+
+// Handle DelSessionJail I/O request — unbinds devices from sessions, using the same entry format as AddSessionJail
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS OnControlDeviceIoDelSessionJail(_In_ WDFDEVICE wdfDevice, _In_ WDFQUEUE wdfQueue, _In_ WDFREQUEST wdfRequest, _In_ size_t outputBufferLength, _In_ size_t inputBufferLength, _In_ ULONG ioControlCode);
+
+// Handle ClearSessionJail I/O request — unbinds all devices from the session id provided
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS OnControlDeviceIoClearSessionJail(_In_ WDFDEVICE wdfDevice, _In_ WDFQUEUE wdfQueue, _In_ WDFREQUEST wdfRequest, _In_ size_t outputBufferLength, _In_ size_t inputBufferLength, _In_ ULONG ioControlCode);
+
+// Handle GetDeviceStatistics I/O request — reports the counters and latency histograms of all filter devices
+// An empty output buffer reports the size needed; as devices may arrive meanwhile, the caller should retry when the buffer proves too small
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS OnControlDeviceIoGetDeviceStatistics(_In_ WDFDEVICE wdfDevice, _In_ WDFQUEUE wdfQueue, _In_ WDFREQUEST wdfRequest, _In_ size_t outputBufferLength, _In_ size_t inputBufferLength, _In_ ULONG ioControlCode);
+
+// Prepare the session jail entries for a multi-string of device instance paths with a session id each
+// On success the entries are appended to the list provided and the caller becomes responsible for them, else nothing is appended
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS CreateSessionJailEntries(_In_reads_(bufferSizeInCharacters) LPWSTR buffer, _In_ size_t bufferSizeInCharacters, _Inout_ PLIST_ENTRY head);
+
+// Release the session jail entries on the list provided that aren't indexed
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID DeleteSessionJailEntries(_Inout_ PLIST_ENTRY head);
+
+// Release an owner of a session blacklist record, along with the record when it was its last owner
+// The caller holds the lock exclusive and has unlinked the owner already
+// Returns TRUE when the device instance path is no longer on the session blacklist
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+BOOLEAN SessionBlacklistDisown(_Inout_ PCONTROL_DEVICE_CONTEXT pControlDeviceContext, _In_ PSESSION_BLACKLIST_ENTRY entry);
+
 // Remove all session blacklist entries owned by the given process ID
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 VOID SessionBlacklistCleanupForPid(_In_ HANDLE processId);
 
-// Is the process id on the whitelist?
+// Register a process and its full image name, or without an image name when it can't be located
+// Returns STATUS_PROCESS_IN_JOB (success) when the process id is already registered
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS RegisterProcess(_In_ PEPROCESS process, _In_ HANDLE processId);
+
+// Is the process id on the whitelist of the configuration snapshot provided?
 // On a match, the cache-hit indicates if its the first time or not
+// The process-known indicates if the process is registered, hence if the verdict holds for as long as the configuration doesn't change
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
-BOOLEAN Whitelisted(_In_ HANDLE processId, _Out_ BOOLEAN* cacheHit);
+BOOLEAN Whitelisted(_In_ PCONFIGURATION_SNAPSHOT configuration, _In_ HANDLE processId, _Out_ BOOLEAN* cacheHit, _Out_ BOOLEAN* processKnown);
 
-// Is this device instance on the blacklist?
+// Is this device instance on the persistent blacklist of the configuration snapshot provided, or on the session blacklist?
+// The jail session id returned is the session that is still granted access, or zero when there is none
+// The caller holds the lock (at least shared) for the session blacklist
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
-BOOLEAN Blacklisted(_In_ PUNICODE_STRING deviceInstancePath, ULONG sessionId);
+BOOLEAN Blacklisted(_In_ PCONFIGURATION_SNAPSHOT configuration, _In_ PCUNICODE_STRING upcaseDeviceInstancePath, _In_ ULONG hash, _Out_ ULONG* jailSessionId);
+
+// Is this device blacklisted for a caller in the session provided, given the configuration snapshot provided?
+// The verdict cached in the device context is used unless the blacklist changed since it was computed, or the snapshot is no longer the one published
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN DeviceBlacklisted(_In_ PDEVICE_CONTEXT pDeviceContext, _In_ PCONFIGURATION_SNAPSHOT configuration, _In_ ULONG sessionId);
+
+// Compute the blacklist verdict of a device against the configuration snapshot provided
+// The verdict is cached in its device context only when the snapshot is the one published
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+LONG64 DeviceRefreshBlacklistVerdict(_Inout_ PDEVICE_CONTEXT pDeviceContext, _In_ PCONFIGURATION_SNAPSHOT configuration);
+
+// Read the multi-string property with the whitelist and compile it for matching
+// On success the caller becomes responsible for calling HidHideWhitelistDelete on the whitelist when it is no longer needed
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS CreateWhitelist(_In_ PCUNICODE_STRING valueName, _Out_ PHIDHIDE_WHITELIST* whitelist);
+
+// Read the multi-string property with the blacklist and compile it for matching
+// On success the caller becomes responsible for calling HidHideBlacklistDelete on the blacklist when it is no longer needed
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS CreateBlacklist(_In_ PCUNICODE_STRING valueName, _Out_ PHIDHIDE_BLACKLIST* blacklist);
 
 // Get the whitelist in a multi-string format
 // When the supplied buffer is NULL, the method returns STATUS_SUCCESS and indicates the buffer size needed for the multi-string (incl. terminator)
@@ -206,6 +423,29 @@ _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NTSTATUS SetBlacklist(_In_reads_(bufferSizeInCharacters) LPWSTR buffer, _In_ size_t bufferSizeInCharacters);
 
+// Take a reference on the configuration snapshot currently published, without taking the lock
+// The caller becomes responsible for calling ConfigurationRelease on the snapshot returned
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PCONFIGURATION_SNAPSHOT ConfigurationAcquire();
+
+// Release a reference on a configuration snapshot taken earlier
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID ConfigurationRelease(_In_ PCONFIGURATION_SNAPSHOT configuration);
+
+// Publish a configuration snapshot with the settings selected taken from the changes provided and the others from the current snapshot
+// On success the snapshot takes over the whitelist and blacklist selected, else the caller remains responsible for them
+// The active and inverse states replaced are returned in the changes provided
+_Must_inspect_result_
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS ConfigurationReplace(_In_ ULONG settings, _Inout_ PCONFIGURATION_SNAPSHOT changes);
+
+// Release the resources of a configuration snapshot once its last reference is gone
+SNAPSHOT_CLEANUP OnConfigurationCleanup;
+
 // Get the active state (enable/disable service)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -0,0 +1,121 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// PathTrie.c
+#include "PathTrie.h"
+
+// FNV-1a parameters; the hash of a component continues from the hash of the components preceding it
+#define PATH_TRIE_HASH_BASIS 2166136261UL
+#define PATH_TRIE_HASH_PRIME 16777619UL
+
+// Continue the hash over the characters of a component and the separator terminating it
+static ULONG PathTrieHash(_In_ ULONG hash, _In_reads_(length) const WCHAR* component, _In_ ULONG length)
+{
+    for (ULONG index = 0; (index < length); index++) hash = ((hash ^ (ULONG)component[index]) * PATH_TRIE_HASH_PRIME);
+    return ((hash ^ (ULONG)PATH_TRIE_SEPARATOR) * PATH_TRIE_HASH_PRIME);
+}
+
+// Look for the node of a component below the parent provided (NULL for the first component)
+static PPATH_TRIE_NODE PathTrieLookup(_In_ PPATH_TRIE trie, _In_opt_ PPATH_TRIE_NODE parent, _In_ ULONG hash, _In_reads_(length) const WCHAR* component, _In_ ULONG length)
+{
+    PPATH_TRIE_NODE node;
+    ULONG           index;
+
+    for (node = trie->buckets[hash & trie->bucketMask]; (NULL != node); node = node->next)
+    {
+        if ((hash != node->hash) || (parent != node->parent) || (length != node->length)) continue;
+        for (index = 0; ((index < length) && (component[index] == node->component[index])); index++);
+        if (index == length) return (node);
+    }
+
+    return (NULL);
+}
+
+_Use_decl_annotations_
+ULONG PathTrieNodesNeeded(const WCHAR* path, ULONG length)
+{
+    ULONG count = 0;
+
+    for (ULONG index = 0; (index < length); index++) if (PATH_TRIE_SEPARATOR == path[index]) count++;
+    return (count);
+}
+
+_Use_decl_annotations_
+VOID PathTrieInitialize(PPATH_TRIE trie, PPATH_TRIE_NODE* buckets, ULONG bucketCount, PPATH_TRIE_NODE nodes, ULONG nodeCount)
+{
+    for (ULONG index = 0; (index < bucketCount); index++) buckets[index] = NULL;
+    trie->buckets    = buckets;
+    trie->bucketMask = (bucketCount - 1);
+    trie->nodes      = nodes;
+    trie->nodeCount  = nodeCount;
+    trie->nodesUsed  = 0;
+    trie->folders    = 0;
+}
+
+_Use_decl_annotations_
+BOOLEAN PathTrieInsertFolder(PPATH_TRIE trie, const WCHAR* path, ULONG length)
+{
+    PPATH_TRIE_NODE parent;
+    PPATH_TRIE_NODE node;
+    ULONG           hash;
+    ULONG           start;
+
+    // Bail out when the path isn't a folder or when the nodes that may be needed aren't available
+    if (!PATH_TRIE_IS_FOLDER(path, length)) return (FALSE);
+    if ((trie->nodeCount - trie->nodesUsed) < PathTrieNodesNeeded(path, length)) return (FALSE);
+
+    // Descend the components, adding the ones not yet present
+    parent = NULL;
+    hash   = PATH_TRIE_HASH_BASIS;
+    start  = 0;
+    for (ULONG index = 0; (index < length); index++)
+    {
+        if (PATH_TRIE_SEPARATOR != path[index]) continue;
+        hash = PathTrieHash(hash, &path[start], (index - start));
+        node = PathTrieLookup(trie, parent, hash, &path[start], (index - start));
+        if (NULL == node)
+        {
+            node = &trie->nodes[trie->nodesUsed++];
+            node->parent    = parent;
+            node->component = &path[start];
+            node->length    = (index - start);
+            node->hash      = hash;
+            node->folder    = FALSE;
+            node->next      = trie->buckets[hash & trie->bucketMask];
+            trie->buckets[hash & trie->bucketMask] = node;
+        }
+        parent = node;
+        start  = (index + 1);
+    }
+
+    // Count each folder once even when inserted more than once
+    if (!parent->folder) trie->folders++;
+    parent->folder = TRUE;
+    return (TRUE);
+}
+
+_Use_decl_annotations_
+BOOLEAN PathTrieMatch(PPATH_TRIE trie, const WCHAR* path, ULONG length)
+{
+    PPATH_TRIE_NODE parent;
+    ULONG           hash;
+    ULONG           start;
+
+    // Nothing can match an empty trie
+    if (0 == trie->folders) return (FALSE);
+
+    // Descend the folder components of the path (the last component is a file name unless followed by a separator) till we hit a folder inserted
+    parent = NULL;
+    hash   = PATH_TRIE_HASH_BASIS;
+    start  = 0;
+    for (ULONG index = 0; (index < length); index++)
+    {
+        if (PATH_TRIE_SEPARATOR != path[index]) continue;
+        hash = PathTrieHash(hash, &path[start], (index - start));
+        parent = PathTrieLookup(trie, parent, hash, &path[start], (index - start));
+        if (NULL == parent) return (FALSE);
+        if (parent->folder) return (TRUE);
+        start = (index + 1);
+    }
+
+    return (FALSE);
+}
@@ -0,0 +1,57 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// PathTrie.h
+#pragma once
+#include "Portable.h"
+
+// Trie over the folder entries of the whitelist, built from buckets and nodes owned by the caller
+
+// Separator between the components of a path
+#define PATH_TRIE_SEPARATOR L'\\'
+
+// Does the path denote a folder (a path ending with a separator) ?
+#define PATH_TRIE_IS_FOLDER(path, length) ((0 != (length)) && (PATH_TRIE_SEPARATOR == (path)[(length) - 1]))
+
+// Node of the trie representing a path component, with all components up to the root leading to it
+typedef struct _PATH_TRIE_NODE
+{
+    struct _PATH_TRIE_NODE* next;      // Next node in the same hash bucket
+    struct _PATH_TRIE_NODE* parent;    // Node of the preceding component, or NULL for the first component
+    const WCHAR*            component; // Characters of the component (not terminated)
+    ULONG                   length;    // Number of characters of the component
+    ULONG                   hash;      // Hash over all components leading to and including this component
+    BOOLEAN                 folder;    // A folder inserted ends at this component
+} PATH_TRIE_NODE, *PPATH_TRIE_NODE;
+
+// Trie on the components of folder paths, answering whether a path lies within any of the folders inserted
+// The edges are kept in a single hash table keyed on the path prefix hence matching costs O(path length) regardless of the number of folders
+// Components are compared as-is hence the caller should fold the case of the paths inserted and matched alike
+typedef struct _PATH_TRIE
+{
+    PPATH_TRIE_NODE*        buckets;
+    ULONG                   bucketMask;
+    PPATH_TRIE_NODE         nodes;
+    ULONG                   nodeCount;
+    ULONG                   nodesUsed;
+    ULONG                   folders;
+} PATH_TRIE, *PPATH_TRIE;
+
+EXTERN_C_START
+
+// Get the number of nodes needed for inserting a path (one per component terminated by a separator)
+ULONG PathTrieNodesNeeded(_In_reads_(length) const WCHAR* path, _In_ ULONG length);
+
+// Initialize an empty trie using the buckets (a power of two) and nodes provided
+VOID PathTrieInitialize(_Out_ PPATH_TRIE trie, _Out_writes_(bucketCount) PPATH_TRIE_NODE* buckets, _In_ ULONG bucketCount, _Out_writes_(nodeCount) PPATH_TRIE_NODE nodes, _In_ ULONG nodeCount);
+
+// Insert a folder path (ending with a separator)
+// Returns FALSE when the path isn't a folder or when there are insufficient nodes left (the trie remains usable)
+_Must_inspect_result_
+BOOLEAN PathTrieInsertFolder(_Inout_ PPATH_TRIE trie, _In_reads_(length) const WCHAR* path, _In_ ULONG length);
+
+// Check whether a path lies within one of the folders inserted (at any depth)
+// Returns TRUE when the path lies within a folder inserted
+_Must_inspect_result_
+BOOLEAN PathTrieMatch(_In_ PPATH_TRIE trie, _In_reads_(length) const WCHAR* path, _In_ ULONG length);
+
+EXTERN_C_END
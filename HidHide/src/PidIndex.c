@@ -0,0 +1,262 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// PidIndex.c
+#include "PidIndex.h"
+
+// Height of a (possibly empty) sub-tree
+#define PID_INDEX_NODE_HEIGHT(node) ((NULL == (node)) ? 0 : (node)->height)
+
+// Recalculate the height of a node from the heights of its children
+static VOID PidIndexUpdateHeight(_Inout_ PPID_INDEX_NODE node)
+{
+    LONG left  = PID_INDEX_NODE_HEIGHT(node->left);
+    LONG right = PID_INDEX_NODE_HEIGHT(node->right);
+
+    node->height = (((left > right) ? left : right) + 1);
+}
+
+// Rotate the sub-tree to the right and return its new root
+static PPID_INDEX_NODE PidIndexRotateRight(_Inout_ PPID_INDEX_NODE node)
+{
+    PPID_INDEX_NODE pivot = node->left;
+
+    node->left   = pivot->right;
+    pivot->right = node;
+    PidIndexUpdateHeight(node);
+    PidIndexUpdateHeight(pivot);
+    return (pivot);
+}
+
+// Rotate the sub-tree to the left and return its new root
+static PPID_INDEX_NODE PidIndexRotateLeft(_Inout_ PPID_INDEX_NODE node)
+{
+    PPID_INDEX_NODE pivot = node->right;
+
+    node->right = pivot->left;
+    pivot->left = node;
+    PidIndexUpdateHeight(node);
+    PidIndexUpdateHeight(pivot);
+    return (pivot);
+}
+
+// Restore the balance of a sub-tree whose children differ at most two levels in height and return its new root
+static PPID_INDEX_NODE PidIndexRebalance(_Inout_ PPID_INDEX_NODE node)
+{
+    LONG balance;
+
+    PidIndexUpdateHeight(node);
+    balance = (PID_INDEX_NODE_HEIGHT(node->left) - PID_INDEX_NODE_HEIGHT(node->right));
+
+    // Left heavy; when the left child leans to the right a double rotation is needed
+    if (balance > 1)
+    {
+        if (PID_INDEX_NODE_HEIGHT(node->left->left) < PID_INDEX_NODE_HEIGHT(node->left->right)) node->left = PidIndexRotateLeft(node->left);
+        return (PidIndexRotateRight(node));
+    }
+
+    // Right heavy; when the right child leans to the left a double rotation is needed
+    if (balance < -1)
+    {
+        if (PID_INDEX_NODE_HEIGHT(node->right->right) < PID_INDEX_NODE_HEIGHT(node->right->left)) node->right = PidIndexRotateRight(node->right);
+        return (PidIndexRotateLeft(node));
+    }
+
+    return (node);
+}
+
+// Walk the recorded path back up to the root and rebalance every node on it
+// The path holds the addresses of the links (the root or a child pointer of the parent) that lead to the nodes visited
+static VOID PidIndexRebalancePath(_Inout_updates_(depth) PPID_INDEX_NODE** path, _In_ ULONG depth)
+{
+    while (depth > 0)
+    {
+        depth--;
+        *path[depth] = PidIndexRebalance(*path[depth]);
+    }
+}
+
+_Use_decl_annotations_
+VOID PidIndexInitialize(PPID_INDEX index)
+{
+    index->root  = NULL;
+    index->count = 0;
+}
+
+_Use_decl_annotations_
+BOOLEAN PidIndexInsert(PPID_INDEX index, PPID_INDEX_NODE node)
+{
+    PPID_INDEX_NODE* path[PID_INDEX_MAX_HEIGHT];
+    PPID_INDEX_NODE* link;
+    ULONG            depth;
+
+    // Descend to the empty link where the node belongs while recording the path taken
+    depth = 0;
+    link  = &index->root;
+    while (NULL != *link)
+    {
+        if ((node->key == (*link)->key) || (depth >= PID_INDEX_MAX_HEIGHT)) return (FALSE);
+        path[depth++] = link;
+        link = ((node->key < (*link)->key) ? &(*link)->left : &(*link)->right);
+    }
+
+    // Attach the node as a leaf and restore the balance on the way up
+    node->left   = NULL;
+    node->right  = NULL;
+    node->height = 1;
+    *link = node;
+    index->count++;
+    PidIndexRebalancePath(path, depth);
+    return (TRUE);
+}
+
+_Use_decl_annotations_
+PPID_INDEX_NODE PidIndexDelete(PPID_INDEX index, ULONG key)
+{
+    PPID_INDEX_NODE* path[PID_INDEX_MAX_HEIGHT];
+    PPID_INDEX_NODE* link;
+    PPID_INDEX_NODE* successorLink;
+    PPID_INDEX_NODE  successor;
+    PPID_INDEX_NODE  node;
+    ULONG            depth;
+    ULONG            nodeDepth;
+
+    // Descend to the node while recording the path taken
+    depth = 0;
+    link  = &index->root;
+    while ((NULL != *link) && (key != (*link)->key))
+    {
+        if (depth >= PID_INDEX_MAX_HEIGHT) return (NULL);
+        path[depth++] = link;
+        link = ((key < (*link)->key) ? &(*link)->left : &(*link)->right);
+    }
+    node = *link;
+    if (NULL == node) return (NULL);
+
+    if ((NULL == node->left) || (NULL == node->right))
+    {
+        // With at most one child, the child takes the place of the node
+        *link = ((NULL != node->left) ? node->left : node->right);
+    }
+    else
+    {
+        // With two children, the lowest node of the right sub-tree takes the place of the node
+        nodeDepth = depth;
+        path[depth++] = link;
+        successorLink = &node->right;
+        while (NULL != (*successorLink)->left)
+        {
+            if (depth >= PID_INDEX_MAX_HEIGHT) return (NULL);
+            path[depth++] = successorLink;
+            successorLink = &(*successorLink)->left;
+        }
+        successor = *successorLink;
+        *successorLink = successor->right;
+
+        successor->left   = node->left;
+        successor->right  = node->right;
+        successor->height = node->height;
+        *link = successor;
+
+        // The link recorded just below the node belonged to the node and now belongs to its successor
+        if (depth > (nodeDepth + 1)) path[nodeDepth + 1] = &successor->right;
+    }
+
+    node->left  = NULL;
+    node->right = NULL;
+    index->count--;
+    PidIndexRebalancePath(path, depth);
+    return (node);
+}
+
+_Use_decl_annotations_
+PPID_INDEX_NODE PidIndexLookup(PPID_INDEX index, ULONG key)
+{
+    PPID_INDEX_NODE node;
+
+    for (node = index->root; ((NULL != node) && (key != node->key)); node = ((key < node->key) ? node->left : node->right));
+    return (node);
+}
+
+_Use_decl_annotations_
+PPID_INDEX_NODE PidIndexFirst(PPID_INDEX index)
+{
+    PPID_INDEX_NODE node;
+
+    node = index->root;
+    if (NULL != node) for (; (NULL != node->left); node = node->left);
+    return (node);
+}
+
+_Use_decl_annotations_
+PPID_INDEX_NODE PidIndexNext(PPID_INDEX index, ULONG key)
+{
+    PPID_INDEX_NODE candidate;
+    PPID_INDEX_NODE node;
+
+    // Remember the last node where we turned left as that is the lowest key above the one provided seen so far
+    candidate = NULL;
+    for (node = index->root; (NULL != node);)
+    {
+        if (node->key > key)
+        {
+            candidate = node;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    return (candidate);
+}
+
+_Use_decl_annotations_
+ULONG PidIndexHeight(PPID_INDEX index)
+{
+    return ((ULONG)PID_INDEX_NODE_HEIGHT(index->root));
+}
+
+_Use_decl_annotations_
+BOOLEAN PidIndexVerify(PPID_INDEX index)
+{
+    PPID_INDEX_NODE stack[PID_INDEX_MAX_HEIGHT];
+    PPID_INDEX_NODE node;
+    PPID_INDEX_NODE previous;
+    ULONG           depth;
+    ULONG           count;
+    LONG            left;
+    LONG            right;
+
+    // Do an in-order walk using an explicit stack, checking each node on the way
+    depth    = 0;
+    count    = 0;
+    previous = NULL;
+    node     = index->root;
+    while ((NULL != node) || (depth > 0))
+    {
+        if (NULL != node)
+        {
+            if (depth >= PID_INDEX_MAX_HEIGHT) return (FALSE);
+            stack[depth++] = node;
+            node = node->left;
+            continue;
+        }
+
+        node = stack[--depth];
+
+        // Keys should be unique and ascending
+        if ((NULL != previous) && (previous->key >= node->key)) return (FALSE);
+
+        // Heights should be accurate and the children should differ at most one level in height
+        left  = PID_INDEX_NODE_HEIGHT(node->left);
+        right = PID_INDEX_NODE_HEIGHT(node->right);
+        if (node->height != (((left > right) ? left : right) + 1)) return (FALSE);
+        if (((left - right) > 1) || ((right - left) > 1)) return (FALSE);
+
+        count++;
+        previous = node;
+        node = node->right;
+    }
+
+    return (count == index->count);
+}
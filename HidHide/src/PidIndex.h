@@ -0,0 +1,67 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// PidIndex.h
+#pragma once
+#include "Portable.h"
+
+// Process id index kept as an iterative AVL tree over nodes owned by the caller
+
+// The maximum height of an AVL tree holding up to 2^32 nodes is below 1.45 * 32, so 48 levels are more than enough
+#define PID_INDEX_MAX_HEIGHT 48
+
+// Select one of a power of two number of indexes for a key (the mask being the number of indexes minus one)
+// Process ids are a multiple of four hence the two lowest bits are dropped so that consecutive process ids land in different indexes
+#define PID_INDEX_SHARD(key, mask) ((((ULONG)(key)) >> 2) & (ULONG)(mask))
+
+// Node of the index, to be embedded in the structure holding the payload
+typedef struct _PID_INDEX_NODE
+{
+    struct _PID_INDEX_NODE* left;
+    struct _PID_INDEX_NODE* right;
+    ULONG                   key;
+    LONG                    height;
+} PID_INDEX_NODE, *PPID_INDEX_NODE;
+
+// Self-balancing (AVL) binary search tree keyed on a process id
+// All operations are iterative and guaranteed O(log n) regardless of the order in which process ids are registered
+typedef struct _PID_INDEX
+{
+    PPID_INDEX_NODE root;
+    ULONG           count;
+} PID_INDEX, *PPID_INDEX;
+
+EXTERN_C_START
+
+// Initialize an empty index
+VOID PidIndexInitialize(_Out_ PPID_INDEX index);
+
+// Insert a node with its key set
+// Returns FALSE when the key isn't unique (the index is left unchanged)
+_Must_inspect_result_
+BOOLEAN PidIndexInsert(_Inout_ PPID_INDEX index, _Inout_ PPID_INDEX_NODE node);
+
+// Detach the node with the given key from the index
+// Returns the node detached or NULL when the key isn't found
+PPID_INDEX_NODE PidIndexDelete(_Inout_ PPID_INDEX index, _In_ ULONG key);
+
+// Look for the node with the given key
+// Returns the node when found or NULL when not found
+_Must_inspect_result_
+PPID_INDEX_NODE PidIndexLookup(_In_ PPID_INDEX index, _In_ ULONG key);
+
+// Get the node with the lowest key, or NULL when the index is empty
+_Must_inspect_result_
+PPID_INDEX_NODE PidIndexFirst(_In_ PPID_INDEX index);
+
+// Get the node with the lowest key above the key provided, or NULL when there is none
+_Must_inspect_result_
+PPID_INDEX_NODE PidIndexNext(_In_ PPID_INDEX index, _In_ ULONG key);
+
+// Get the height of the index (zero when empty)
+ULONG PidIndexHeight(_In_ PPID_INDEX index);
+
+// Check the ordering, the balance, and the administration of the index
+// Returns TRUE when the index is consistent
+BOOLEAN PidIndexVerify(_In_ PPID_INDEX index);
+
+EXTERN_C_END
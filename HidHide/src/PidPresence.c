@@ -0,0 +1,27 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// PidPresence.c
+#include "PidPresence.h"
+
+// Select the word and the bit of a process id; process ids are a multiple of four hence the two lowest bits are dropped
+#define PID_PRESENCE_WORD(pid) (((pid) >> 2) / 32)
+#define PID_PRESENCE_BIT(pid)  ((LONG)(1UL << (((pid) >> 2) % 32)))
+
+_Use_decl_annotations_
+VOID PidPresenceInitialize(PPID_PRESENCE presence)
+{
+    RtlZeroMemory((PVOID)presence, sizeof(PID_PRESENCE));
+}
+
+_Use_decl_annotations_
+BOOLEAN PidPresenceTest(PPID_PRESENCE presence, ULONG pid)
+{
+    return ((0 != (ReadNoFence(&presence->words[PID_PRESENCE_WORD(pid)]) & PID_PRESENCE_BIT(pid))) ? TRUE : FALSE);
+}
+
+_Use_decl_annotations_
+VOID PidPresenceUpdate(PPID_PRESENCE presence, ULONG pid, BOOLEAN present)
+{
+    if (present) InterlockedOr(&presence->words[PID_PRESENCE_WORD(pid)], PID_PRESENCE_BIT(pid));
+    else InterlockedAnd(&presence->words[PID_PRESENCE_WORD(pid)], ~PID_PRESENCE_BIT(pid));
+}
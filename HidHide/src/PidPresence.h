@@ -0,0 +1,34 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// PidPresence.h
+#pragma once
+#include "Portable.h"
+
+// Process id presence bitmap; tests may run concurrently with the updates the caller serializes per process id
+
+// Process ids below this limit that are a multiple of four (as the system hands them out) are tracked in the presence bitmap
+#define PID_PRESENCE_LIMIT (1UL << 20)
+
+// Is the process id covered by the presence bitmap ?
+#define PID_PRESENCE_TRACKED(pid) (((pid) < PID_PRESENCE_LIMIT) && (0 == ((pid) & 3UL)))
+
+// Presence bitmap with a bit per tracked process id (32 KiB)
+typedef struct _PID_PRESENCE
+{
+    volatile LONG           words[PID_PRESENCE_LIMIT / 4 / 32];
+} PID_PRESENCE, *PPID_PRESENCE;
+
+EXTERN_C_START
+
+// Initialize a bitmap with all process ids absent
+VOID PidPresenceInitialize(_Out_ PPID_PRESENCE presence);
+
+// Test for the presence of a tracked process id
+_Must_inspect_result_
+BOOLEAN PidPresenceTest(_In_ PPID_PRESENCE presence, _In_ ULONG pid);
+
+// Mark a tracked process id as present or absent
+// Process ids share the words of the bitmap hence the bits are altered with interlocked operations
+VOID PidPresenceUpdate(_Inout_ PPID_PRESENCE presence, _In_ ULONG pid, _In_ BOOLEAN present);
+
+EXTERN_C_END
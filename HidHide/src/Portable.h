@@ -0,0 +1,12 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// Portable.h
+#pragma once
+
+// The modules including this header are free of kernel and framework dependencies so that they can be exercised outside of the driver as well
+// Their callers own the memory handed to them and take care of the synchronization, unless stated otherwise
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#else
+#include <windows.h>
+#endif
@@ -0,0 +1,96 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// SessionJail.c
+#include "SessionJail.h"
+#include "Blacklist.h"
+
+// Session ids are small and consecutive hence spread them over the buckets with a multiplicative hash
+#define SESSION_JAIL_SESSION_BUCKET(index, sessionId) (((((ULONG)(sessionId)) * 2654435761UL) >> 16) & (index)->bucketMask)
+#define SESSION_JAIL_DEVICE_BUCKET(index, hash)       ((hash) & (index)->bucketMask)
+
+_Use_decl_annotations_
+VOID SessionJailInitialize(PSESSION_JAIL_INDEX index, PSESSION_JAIL_BINDING* deviceBuckets, PSESSION_JAIL_BINDING* sessionBuckets, ULONG bucketCount)
+{
+    for (ULONG bucket = 0; (bucket < bucketCount); bucket++)
+    {
+        deviceBuckets[bucket]  = NULL;
+        sessionBuckets[bucket] = NULL;
+    }
+    index->deviceBuckets  = deviceBuckets;
+    index->sessionBuckets = sessionBuckets;
+    index->bucketMask     = (bucketCount - 1);
+    index->count          = 0;
+}
+
+_Use_decl_annotations_
+VOID SessionJailInsert(PSESSION_JAIL_INDEX index, PSESSION_JAIL_BINDING binding)
+{
+    binding->nextOfDevice = index->deviceBuckets[SESSION_JAIL_DEVICE_BUCKET(index, binding->hash)];
+    index->deviceBuckets[SESSION_JAIL_DEVICE_BUCKET(index, binding->hash)] = binding;
+    binding->nextOfSession = index->sessionBuckets[SESSION_JAIL_SESSION_BUCKET(index, binding->sessionId)];
+    index->sessionBuckets[SESSION_JAIL_SESSION_BUCKET(index, binding->sessionId)] = binding;
+    index->count++;
+}
+
+_Use_decl_annotations_
+VOID SessionJailRemove(PSESSION_JAIL_INDEX index, PSESSION_JAIL_BINDING binding)
+{
+    PSESSION_JAIL_BINDING* link;
+    BOOLEAN                found;
+
+    // Unlink the binding from both buckets, and only account for it when it was indexed
+    found = FALSE;
+    for (link = &index->deviceBuckets[SESSION_JAIL_DEVICE_BUCKET(index, binding->hash)]; (NULL != *link); link = &(*link)->nextOfDevice)
+    {
+        if (binding != *link) continue;
+        *link = binding->nextOfDevice;
+        found = TRUE;
+        break;
+    }
+    for (link = &index->sessionBuckets[SESSION_JAIL_SESSION_BUCKET(index, binding->sessionId)]; (NULL != *link); link = &(*link)->nextOfSession)
+    {
+        if (binding != *link) continue;
+        *link = binding->nextOfSession;
+        break;
+    }
+    if (!found) return;
+    binding->nextOfDevice  = NULL;
+    binding->nextOfSession = NULL;
+    index->count--;
+}
+
+_Use_decl_annotations_
+PSESSION_JAIL_BINDING SessionJailFind(PSESSION_JAIL_INDEX index, ULONG hash, const WCHAR* upcaseDeviceInstancePath, ULONG length, ULONG sessionId)
+{
+    PSESSION_JAIL_BINDING binding;
+
+    for (binding = index->deviceBuckets[SESSION_JAIL_DEVICE_BUCKET(index, hash)]; (NULL != binding); binding = binding->nextOfDevice)
+    {
+        if ((sessionId == binding->sessionId) && (BlacklistPathMatch(binding->hash, binding->upcaseDeviceInstancePath, binding->length, hash, upcaseDeviceInstancePath, length))) return (binding);
+    }
+    return (NULL);
+}
+
+_Use_decl_annotations_
+BOOLEAN SessionJailBound(PSESSION_JAIL_INDEX index, ULONG hash, const WCHAR* upcaseDeviceInstancePath, ULONG length)
+{
+    PSESSION_JAIL_BINDING binding;
+
+    for (binding = index->deviceBuckets[SESSION_JAIL_DEVICE_BUCKET(index, hash)]; (NULL != binding); binding = binding->nextOfDevice)
+    {
+        if (BlacklistPathMatch(binding->hash, binding->upcaseDeviceInstancePath, binding->length, hash, upcaseDeviceInstancePath, length)) return (TRUE);
+    }
+    return (FALSE);
+}
+
+_Use_decl_annotations_
+PSESSION_JAIL_BINDING SessionJailFirstOfSession(PSESSION_JAIL_INDEX index, ULONG sessionId)
+{
+    PSESSION_JAIL_BINDING binding;
+
+    for (binding = index->sessionBuckets[SESSION_JAIL_SESSION_BUCKET(index, sessionId)]; (NULL != binding); binding = binding->nextOfSession)
+    {
+        if (sessionId == binding->sessionId) return (binding);
+    }
+    return (NULL);
+}
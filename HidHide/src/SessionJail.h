@@ -0,0 +1,55 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// SessionJail.h
+#pragma once
+#include "Portable.h"
+
+// Index binding blacklisted devices to the sessions still granted access to them
+
+// Binding of a blacklisted device to a session that is still granted access to it
+typedef struct _SESSION_JAIL_BINDING
+{
+    struct _SESSION_JAIL_BINDING* nextOfDevice;         // Next binding in the same device bucket
+    struct _SESSION_JAIL_BINDING* nextOfSession;        // Next binding in the same session bucket
+    const WCHAR*            upcaseDeviceInstancePath;   // Device instance path in its upper-case form (not terminated)
+    ULONG                   length;                     // Number of characters of the device instance path
+    ULONG                   hash;                       // Hash over the upper-case device instance path (see BlacklistHash)
+    ULONG                   sessionId;                  // The session granted access
+} SESSION_JAIL_BINDING, *PSESSION_JAIL_BINDING;
+
+// Index over the bindings, keyed on the device for the access decisions, and on the session for rebinding a session as a whole
+// A device is looked up in its own bucket only, while rebinding a session walks the bindings of that session only
+typedef struct _SESSION_JAIL_INDEX
+{
+    PSESSION_JAIL_BINDING*  deviceBuckets;
+    PSESSION_JAIL_BINDING*  sessionBuckets;
+    ULONG                   bucketMask;
+    ULONG                   count;
+} SESSION_JAIL_INDEX, *PSESSION_JAIL_INDEX;
+
+EXTERN_C_START
+
+// Initialize an empty index using the buckets (both a power of two, of the same size) provided
+VOID SessionJailInitialize(_Out_ PSESSION_JAIL_INDEX index, _Out_writes_(bucketCount) PSESSION_JAIL_BINDING* deviceBuckets, _Out_writes_(bucketCount) PSESSION_JAIL_BINDING* sessionBuckets, _In_ ULONG bucketCount);
+
+// Add a binding to the index; the caller should check first that the device isn't bound to the session already
+VOID SessionJailInsert(_Inout_ PSESSION_JAIL_INDEX index, _Inout_ PSESSION_JAIL_BINDING binding);
+
+// Remove a binding added earlier from the index
+VOID SessionJailRemove(_Inout_ PSESSION_JAIL_INDEX index, _In_ PSESSION_JAIL_BINDING binding);
+
+// Look for the binding of an upper-case device instance path, given its hash, to a session
+// Returns the binding, or NULL when the device isn't bound to the session
+_Must_inspect_result_
+PSESSION_JAIL_BINDING SessionJailFind(_In_ PSESSION_JAIL_INDEX index, _In_ ULONG hash, _In_reads_(length) const WCHAR* upcaseDeviceInstancePath, _In_ ULONG length, _In_ ULONG sessionId);
+
+// Is an upper-case device instance path, given its hash, bound to any session ?
+_Must_inspect_result_
+BOOLEAN SessionJailBound(_In_ PSESSION_JAIL_INDEX index, _In_ ULONG hash, _In_reads_(length) const WCHAR* upcaseDeviceInstancePath, _In_ ULONG length);
+
+// Get any of the bindings of a session, or NULL when there are none
+// Remove the binding returned before calling it again so as to visit all bindings of the session
+_Must_inspect_result_
+PSESSION_JAIL_BINDING SessionJailFirstOfSession(_In_ PSESSION_JAIL_INDEX index, _In_ ULONG sessionId);
+
+EXTERN_C_END
@@ -0,0 +1,67 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// Snapshot.c
+#include "Snapshot.h"
+
+_Use_decl_annotations_
+VOID SnapshotInitialize(PSNAPSHOT_HEADER header, PSNAPSHOT_CLEANUP cleanup)
+{
+    header->referenceCount = 1;
+    header->cleanup        = cleanup;
+}
+
+_Use_decl_annotations_
+VOID SnapshotSlotInitialize(PSNAPSHOT_SLOT slot, PSNAPSHOT_HEADER header)
+{
+    slot->phase        = 0;
+    slot->acquiring[0] = 0;
+    slot->acquiring[1] = 0;
+    InterlockedExchangePointer((PVOID volatile*)&slot->current, header);
+}
+
+_Use_decl_annotations_
+PSNAPSHOT_HEADER SnapshotAcquire(PSNAPSHOT_SLOT slot)
+{
+    PSNAPSHOT_HEADER header;
+    LONG             phase;
+
+    // Announce the acquisition before reading the pointer so that a publisher replacing it waits till the reference is taken
+    // Announce again when the phase moved on meanwhile, as the publisher that moved it may no longer be waiting for the count announced on
+    for (;;)
+    {
+        phase = ReadAcquire(&slot->phase);
+        InterlockedIncrement(&slot->acquiring[phase & 1]);
+        if (phase == ReadAcquire(&slot->phase)) break;
+        InterlockedDecrement(&slot->acquiring[phase & 1]);
+    }
+    header = (PSNAPSHOT_HEADER)ReadPointerAcquire((PVOID const volatile*)&slot->current);
+    InterlockedIncrement(&header->referenceCount);
+    InterlockedDecrement(&slot->acquiring[phase & 1]);
+    return (header);
+}
+
+_Use_decl_annotations_
+VOID SnapshotRelease(PSNAPSHOT_HEADER header)
+{
+    if (0 == InterlockedDecrement(&header->referenceCount)) header->cleanup(header);
+}
+
+_Use_decl_annotations_
+PSNAPSHOT_HEADER SnapshotPublish(PSNAPSHOT_SLOT slot, PSNAPSHOT_HEADER header)
+{
+    PSNAPSHOT_HEADER previous;
+    LONG             phase;
+
+    // Readers that read the previous pointer announced themselves on the previous phase before doing so hence, once none is acquiring on
+    // that phase, all of them hold a reference; readers announcing themselves on the next phase read the new pointer
+    previous = (PSNAPSHOT_HEADER)InterlockedExchangePointer((PVOID volatile*)&slot->current, header);
+    phase = (InterlockedIncrement(&slot->phase) - 1);
+    while (0 != ReadAcquire(&slot->acquiring[phase & 1])) YieldProcessor();
+    return (previous);
+}
+
+_Use_decl_annotations_
+BOOLEAN SnapshotIsCurrent(PSNAPSHOT_SLOT slot, PSNAPSHOT_HEADER header)
+{
+    return ((header == (PSNAPSHOT_HEADER)ReadPointerAcquire((PVOID const volatile*)&slot->current)) ? TRUE : FALSE);
+}
@@ -0,0 +1,61 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// Snapshot.h
+#pragma once
+#include "Portable.h"
+
+// Slot publishing reference counted snapshots; the caller serializes the publishers
+
+struct _SNAPSHOT_HEADER;
+
+// Release the resources of a snapshot once its last reference is gone
+typedef VOID SNAPSHOT_CLEANUP(_In_ struct _SNAPSHOT_HEADER* header);
+typedef SNAPSHOT_CLEANUP* PSNAPSHOT_CLEANUP;
+
+// Header in front of a read-only, reference counted snapshot
+typedef struct _SNAPSHOT_HEADER
+{
+    volatile LONG           referenceCount;
+    PSNAPSHOT_CLEANUP       cleanup;
+} SNAPSHOT_HEADER, *PSNAPSHOT_HEADER;
+
+// Slot holding the snapshot currently published
+// Readers take a reference on the current snapshot without taking a lock; the acquiring counts cover the short window between
+// reading the pointer and taking the reference, which is all a publisher has to wait for before dropping the reference of the slot
+// Readers announce themselves on the count of the current phase; a publisher flips the phase and waits for the count of the
+// previous phase to drain, hence a steady stream of readers can't hold up a publisher indefinitely
+typedef struct _SNAPSHOT_SLOT
+{
+    PSNAPSHOT_HEADER volatile current;
+    volatile LONG           phase;
+    volatile LONG           acquiring[2];
+} SNAPSHOT_SLOT, *PSNAPSHOT_SLOT;
+
+EXTERN_C_START
+
+// Initialize a snapshot header with a single reference, being the reference the creator holds
+VOID SnapshotInitialize(_Out_ PSNAPSHOT_HEADER header, _In_ PSNAPSHOT_CLEANUP cleanup);
+
+// Initialize a slot with its first snapshot; the slot takes over the reference of the creator
+VOID SnapshotSlotInitialize(_Out_ PSNAPSHOT_SLOT slot, _In_ PSNAPSHOT_HEADER header);
+
+// Take a reference on the snapshot currently published
+// The caller becomes responsible for calling SnapshotRelease on the snapshot returned
+_Must_inspect_result_
+PSNAPSHOT_HEADER SnapshotAcquire(_Inout_ PSNAPSHOT_SLOT slot);
+
+// Release a reference taken earlier, and clean up the snapshot when it was the last reference
+VOID SnapshotRelease(_In_ PSNAPSHOT_HEADER header);
+
+// Publish a new snapshot in place of the current one; the slot takes over the reference of the creator
+// Publishers should be serialized by the caller
+// Returns the previous snapshot, whose reference held by the slot is handed over to the caller
+// Readers still using the previous snapshot keep it alive till they release it
+_Must_inspect_result_
+PSNAPSHOT_HEADER SnapshotPublish(_Inout_ PSNAPSHOT_SLOT slot, _In_ PSNAPSHOT_HEADER header);
+
+// Is the snapshot provided the one currently published?
+// The answer only holds for as long as the caller keeps the publishers out; otherwise it may be outdated by the time it is returned
+BOOLEAN SnapshotIsCurrent(_In_ PSNAPSHOT_SLOT slot, _In_ PSNAPSHOT_HEADER header);
+
+EXTERN_C_END
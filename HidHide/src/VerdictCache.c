@@ -0,0 +1,61 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// VerdictCache.c
+#include "VerdictCache.h"
+
+// Select the entry for a process; process ids are a multiple of four hence the two lowest bits are dropped
+#define VERDICT_CACHE_ENTRY_INDEX(key) ((((((key)->processId >> 2) ^ (ULONG)((key)->processCreateTime >> 4)) * 2654435761UL) >> 16) & (VERDICT_CACHE_ENTRIES - 1))
+
+// Do both keys match ?
+static BOOLEAN VerdictCacheKeyMatch(_In_ PVERDICT_CACHE_KEY left, _In_ PVERDICT_CACHE_KEY right)
+{
+    return (((left->processId == right->processId) && (left->processCreateTime == right->processCreateTime) && (left->configurationGeneration == right->configurationGeneration) && (left->blacklistGeneration == right->blacklistGeneration)) ? TRUE : FALSE);
+}
+
+_Use_decl_annotations_
+VOID VerdictCacheInitialize(PVERDICT_CACHE cache)
+{
+    // A process id of zero belongs to the idle process, which never opens a device, hence a zeroed entry never matches
+    RtlZeroMemory(cache, sizeof(VERDICT_CACHE));
+}
+
+_Use_decl_annotations_
+BOOLEAN VerdictCacheLookup(PVERDICT_CACHE cache, PVERDICT_CACHE_KEY key, BOOLEAN* accessDenied)
+{
+    PVERDICT_CACHE_ENTRY entry;
+    VERDICT_CACHE_KEY    entryKey;
+    BOOLEAN              entryAccessDenied;
+    LONG                 sequence;
+
+    // Copy the entry and only use the copy when no store ran meanwhile
+    entry = &cache->entries[VERDICT_CACHE_ENTRY_INDEX(key)];
+    sequence = ReadAcquire(&entry->sequence);
+    entryKey = entry->key;
+    entryAccessDenied = entry->accessDenied;
+    MemoryBarrier();
+    if ((0 == (sequence & 1)) && (sequence == ReadAcquire(&entry->sequence)) && (VerdictCacheKeyMatch(&entryKey, key)))
+    {
+        InterlockedIncrementNoFence64(&cache->hits);
+        (*accessDenied) = entryAccessDenied;
+        return (TRUE);
+    }
+
+    InterlockedIncrementNoFence64(&cache->misses);
+    (*accessDenied) = FALSE;
+    return (FALSE);
+}
+
+_Use_decl_annotations_
+VOID VerdictCacheStore(PVERDICT_CACHE cache, PVERDICT_CACHE_KEY key, BOOLEAN accessDenied)
+{
+    PVERDICT_CACHE_ENTRY entry;
+    LONG                 sequence;
+
+    // Claim the entry by making its sequence odd; rather than waiting for another store in progress, skip remembering this verdict
+    entry = &cache->entries[VERDICT_CACHE_ENTRY_INDEX(key)];
+    sequence = ReadAcquire(&entry->sequence);
+    if ((0 != (sequence & 1)) || (sequence != InterlockedCompareExchange(&entry->sequence, (sequence + 1), sequence))) return;
+    entry->key = (*key);
+    entry->accessDenied = accessDenied;
+    InterlockedIncrement(&entry->sequence);
+}
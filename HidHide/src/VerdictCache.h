@@ -0,0 +1,53 @@
+// (c) Eric Korff de Gidts
+// SPDX-License-Identifier: MIT
+// VerdictCache.h
+#pragma once
+#include "Portable.h"
+
+// Cache of access verdicts; lookups and stores may run concurrently without taking a lock
+
+// The number of verdicts remembered per cache (a power of two)
+#define VERDICT_CACHE_ENTRIES 16
+
+// Identifies the process an access decision was made for, and the configuration it was made against
+// The process create time tells apart processes reusing the process id of a process that exited
+typedef struct _VERDICT_CACHE_KEY
+{
+    ULONG                   processId;
+    LONGLONG                processCreateTime;
+    LONG                    configurationGeneration;
+    LONG                    blacklistGeneration;
+} VERDICT_CACHE_KEY, *PVERDICT_CACHE_KEY;
+
+// A verdict remembered; the sequence is odd while the entry is being written
+typedef struct _VERDICT_CACHE_ENTRY
+{
+    volatile LONG           sequence;
+    BOOLEAN                 accessDenied;
+    VERDICT_CACHE_KEY       key;
+} VERDICT_CACHE_ENTRY, *PVERDICT_CACHE_ENTRY;
+
+// Direct-mapped cache of access decisions for a single device, keyed on the process
+// A verdict made against an older configuration or blacklist generation never matches hence there is no need to flush the cache
+typedef struct _VERDICT_CACHE
+{
+    VERDICT_CACHE_ENTRY     entries[VERDICT_CACHE_ENTRIES];
+    volatile LONG64         hits;
+    volatile LONG64         misses;
+} VERDICT_CACHE, *PVERDICT_CACHE;
+
+EXTERN_C_START
+
+// Initialize an empty cache
+VOID VerdictCacheInitialize(_Out_ PVERDICT_CACHE cache);
+
+// Look for the verdict remembered for the key provided, and count the outcome as a hit or a miss
+// Returns TRUE when found, with the verdict returned in accessDenied
+_Must_inspect_result_
+BOOLEAN VerdictCacheLookup(_Inout_ PVERDICT_CACHE cache, _In_ PVERDICT_CACHE_KEY key, _Out_ BOOLEAN* accessDenied);
+
+// Remember the verdict for the key provided, in place of whatever the entry it maps to held before
+// The verdict isn't remembered when another store on the same entry is in progress
+VOID VerdictCacheStore(_Inout_ PVERDICT_CACHE cache, _In_ PVERDICT_CACHE_KEY key, _In_ BOOLEAN accessDenied);
+
+EXTERN_C_END
@@ -22,26 +22,14 @@
 
 // API call-back prototype missing so define it here
 typedef
-_Function_class_(CREATE_PROCESS_NOTIFY_ROUTINE)
+_Function_class_(CREATE_PROCESS_NOTIFY_ROUTINE_EX)
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
 VOID
-CREATE_PROCESS_NOTIFY_ROUTINE(
-    _In_ HANDLE ParentId,
+CREATE_PROCESS_NOTIFY_ROUTINE_EX(
+    _Inout_ PEPROCESS Process,
     _In_ HANDLE ProcessId,
-    _In_ BOOLEAN Create
-); 
-
-// API call-back prototype missing so define it here
-typedef
-_Function_class_(LOAD_IMAGE_NOTIFY_ROUTINE)
-_IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-VOID
-LOAD_IMAGE_NOTIFY_ROUTINE(
-    _In_opt_ PUNICODE_STRING FullImageName,
-    _In_ HANDLE ProcessId,
-    _In_ PIMAGE_INFO ImageInfo
+    _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
 );
 
 // Include the message file generated by the message compiler from the ETW manifest
@@ -26,3 +26,28 @@
 #define IOCTL_SET_WLINVERSE         CTL_CODE(IoControlDeviceType, 2055, METHOD_BUFFERED, FILE_READ_DATA)
 #define IOCTL_ADD_SESSION_BLACKLIST   CTL_CODE(IoControlDeviceType, 2056, METHOD_BUFFERED, FILE_READ_DATA)
 #define IOCTL_CLR_SESSION_BLACKLIST   CTL_CODE(IoControlDeviceType, 2057, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_ADD_SESSION_JAIL        CTL_CODE(IoControlDeviceType, 2058, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_DEL_SESSION_JAIL        CTL_CODE(IoControlDeviceType, 2059, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_CLR_SESSION_JAIL        CTL_CODE(IoControlDeviceType, 2060, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_GET_DEVICE_STATISTICS   CTL_CODE(IoControlDeviceType, 2061, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_DEL_SESSION_BLACKLIST   CTL_CODE(IoControlDeviceType, 2062, METHOD_BUFFERED, FILE_READ_DATA)
+
+// The number of buckets of the latency histograms; bucket 0 counts the durations below a microsecond,
+// bucket n (n > 0) those from 2^(n-1) up to 2^n microseconds, and the last bucket all longer ones
+#define HIDHIDE_LATENCY_BUCKETS 24
+
+// Statistics of a filter device as returned by IOCTL_GET_DEVICE_STATISTICS, one record per device
+// Each record is followed by the device instance path (not terminated) and padded to a multiple of eight bytes
+typedef struct _HIDHIDE_DEVICE_STATISTICS
+{
+    ULONG     recordSize;                               // Number of bytes up to the next record
+    ULONG     deviceInstancePathLength;                 // Number of characters of the device instance path
+    LONG64    opens;                                    // Open requests seen
+    LONG64    allows;                                   // Open requests passed down the stack, including the system process bypasses
+    LONG64    denies;                                   // Open requests failed
+    LONG64    systemBypasses;                           // Open requests of the system process, passed down without an access decision
+    LONG64    verdictCacheHits;                         // Access decisions taken from the verdict cache
+    LONG64    verdictCacheMisses;                       // Access decisions evaluated
+    LONG64    decisionLatency[HIDHIDE_LATENCY_BUCKETS]; // Time spent on the access decision
+    LONG64    forwardLatency[HIDHIDE_LATENCY_BUCKETS];  // Time spent by the lower stack on the open requests passed down
+} HIDHIDE_DEVICE_STATISTICS, *PHIDHIDE_DEVICE_STATISTICS;
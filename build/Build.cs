@@ -108,6 +108,29 @@ class Build : NukeBuild
                 .AssertZeroExitCode();
         });
 
+    /// <summary>Builds and runs the micro-benchmarks of the driver modules. Opt-in only: the solution build skips them, and CI never runs them, as timings on shared hosts are meaningless.</summary>
+    Target Benchmark => _ => _
+        .DependsOn(Restore)
+        .OnlyWhenStatic(() => RuntimeInformation.IsOSPlatform(OSPlatform.Windows)
+            && Platform.Equals("x64", StringComparison.OrdinalIgnoreCase))
+        .Executes(() =>
+        {
+            MSBuild(s => s
+                .SetTargetPath(RootDirectory / "HidHide.Benchmarks" / "HidHide.Benchmarks.vcxproj")
+                .SetTargets("Build")
+                .SetConfiguration(Configuration)
+                .SetTargetPlatform(ParsePlatform(Platform))
+                .SetProperty("SolutionDir", RootDirectory + Path.DirectorySeparatorChar.ToString())
+                .SetVerbosity(MSBuildVerbosity.Minimal));
+
+            var benchmarkExe = OutputRoot / "HidHide.Benchmarks.exe";
+            if (!File.Exists(benchmarkExe))
+                throw new FileNotFoundException($"Expected benchmark runner at '{benchmarkExe}'. Build HidHide.Benchmarks for {Configuration}|{Platform}.");
+
+            ProcessTasks.StartProcess(benchmarkExe, workingDirectory: OutputRoot, logInvocation: false)
+                .AssertZeroExitCode();
+        });
+
     Target StageInstallerPayload => _ => _
         .DependsOn(Compile)
         .Executes(async () =>